@@ -25,6 +25,8 @@ char svn_rev[128] = "\0";
 const char *xbee_svn_version(void) {
   if (svn_rev[0] == '\0') {
     char *t;
+    /* the keyword may not have been expanded... */
+    if (strlen(SVN_REV) <= 11) return "unknown";
     sprintf(svn_rev,"r%s",&SVN_REV[11]);
     t = strrchr(svn_rev,' ');
     if (t) {
@@ -42,39 +44,19 @@ const char *xbee_build_info(void) {
 /* ### Memory Handling ############################################# */
 /* ################################################################# */
 
-/* malloc wrapper function */
+/* malloc wrapper function - failures are counted, and NULL is returned */
 static void *Xmalloc2(xbee_hnd xbee, size_t size) {
   void *t;
   t = malloc(size);
-  if (!t) {
-    /* uhoh... thats pretty bad... */
-    xbee_perror("libxbee:malloc()");
-    exit(1);
-  }
+  if (!t && xbee) xbee_atomic_inc(xbee->memFailed);
   return t;
 }
 
-/* calloc wrapper function */
+/* calloc wrapper function - failures are counted, and NULL is returned */
 static void *Xcalloc2(xbee_hnd xbee, size_t size) {
   void *t;
   t = calloc(1, size);
-  if (!t) {
-    /* uhoh... thats pretty bad... */
-    xbee_perror("libxbee:calloc()");
-    exit(1);
-  }
-  return t;
-}
-
-/* realloc wrapper function */
-static void *Xrealloc2(xbee_hnd xbee, void *ptr, size_t size) {
-  void *t;
-  t = realloc(ptr,size);
-  if (!t) {
-    /* uhoh... thats pretty bad... */
-    fprintf(stderr,"libxbee:realloc(): Returned NULL\n");
-    exit(1);
-  }
+  if (!t && xbee) xbee_atomic_inc(xbee->memFailed);
   return t;
 }
 
@@ -85,10 +67,115 @@ static void Xfree2(void **ptr) {
   *ptr = NULL;
 }
 
+/* #################################################################
+   xbee_mem_add - INTERNAL
+   counts objects of a kind of memory held by the handle (a negative count takes
+   them off again). packets are only counted while they are queued, the rest from
+   when they are allocated until they are free()'d */
+static void xbee_mem_add(xbee_hnd xbee, int type, int count, size_t size) {
+  long bytes;
+  if (!xbee) return;
+  bytes = (long)size * count;
+  xbee_atomic_add(xbee->memObjects[type], count);
+  xbee_atomic_add(xbee->memTypeBytes[type], bytes);
+  xbee_atomic_add(xbee->memBytes, bytes);
+}
+
+/* #################################################################
+   xbee_mem_pkthold - INTERNAL
+   takes a reference to a packet for one of the handle's queues. the packet is
+   counted once, however many queues hold it (subscriptions share packets) */
+static void xbee_mem_pkthold(xbee_hnd xbee, xbee_pkt *p) {
+  if (xbee_atomic_inc(p->held) == 1) xbee_mem_add(xbee, xbee_mem_pkt, 1, xbee_pkt_size(p));
+}
+
+/* #################################################################
+   xbee_mem_pktrelease - INTERNAL
+   gives back a reference taken by xbee_mem_pkthold(), the packet stops being
+   counted when the last queue lets go of it */
+static void xbee_mem_pktrelease(xbee_hnd xbee, xbee_pkt *p) {
+  if (xbee_atomic_dec(p->held) == 0) xbee_mem_add(xbee, xbee_mem_pkt, -1, xbee_pkt_size(p));
+}
+
+/* #################################################################
+   xbee_mem_full - INTERNAL
+   returns TRUE if holding size more bytes would take the handle over its limit */
+static int xbee_mem_full(xbee_hnd xbee, size_t size) {
+  if (!xbee->memLimit) return 0;
+  return ((unsigned long)xbee->memBytes + size > xbee->memLimit);
+}
+
+/* #################################################################
+   xbee_memlimit
+   limits the memory held by the handle to bytes (0 for no limit). once it has
+   been reached recieved frames are dropped, and counted, and new connections are
+   refused until the packets that have been queued are collected. returns 0 on
+   success or -1 on error */
+int xbee_memlimit(unsigned long bytes) {
+  return _xbee_memlimit(default_xbee, bytes);
+}
+int _xbee_memlimit(xbee_hnd xbee, unsigned long bytes) {
+  ISREADYR(-1);
+  xbee->memLimit = bytes;
+  xbee_log("Memory limit set to %lu bytes",bytes);
+  return 0;
+}
+
+/* #################################################################
+   xbee_memstats
+   fills in stats with the memory held by the handle, and the frames that have
+   been dropped because of it. returns 0 on success or -1 on error */
+int xbee_memstats(xbee_meminfo *stats) {
+  return _xbee_memstats(default_xbee, stats);
+}
+int _xbee_memstats(xbee_hnd xbee, xbee_meminfo *stats) {
+  int i;
+  ISREADYR(-1);
+  if (!stats) return -1;
+  memset(stats, 0, sizeof(xbee_meminfo));
+  stats->bytes = xbee->memBytes;
+  stats->limit = xbee->memLimit;
+  for (i = 0; i < xbee_mem_types; i++) {
+    stats->objects[i] = xbee->memObjects[i];
+    stats->typeBytes[i] = xbee->memTypeBytes[i];
+  }
+  stats->dropped = xbee->memDropped;
+  stats->failed = xbee->memFailed;
+  return 0;
+}
+
 /* ################################################################# */
 /* ### Helper Functions ############################################ */
 /* ################################################################# */
 
+/* #################################################################
+   returns a zeroed packet with room for datalen bytes of data and the given
+   number of samples. the whole lot is released with a single free() */
+xbee_pkt *xbee_pkt_alloc(int datalen, int samples) {
+  xbee_pkt *p;
+  if (datalen < 0 || datalen > XBEE_PKT_MAXDATA) return NULL;
+  if (samples < 0) return NULL;
+
+  if ((p = calloc(1, sizeof(xbee_pkt) + (sizeof(xbee_sample) * samples) + datalen)) == NULL) return NULL;
+  p->IOdata = (xbee_sample *)&p[1];
+  p->data = (unsigned char *)&p->IOdata[samples];
+  return p;
+}
+
+/* #################################################################
+   takes another reference to a packet, each one must be given back with xbee_pkt_unref() */
+void xbee_pkt_ref(xbee_pkt *pkt) {
+  if (!pkt) return;
+  xbee_atomic_inc(pkt->refs);
+}
+
+/* #################################################################
+   gives back a reference to a packet, it is free()'d along with the last one */
+void xbee_pkt_unref(xbee_pkt *pkt) {
+  if (!pkt) return;
+  if (xbee_atomic_dec(pkt->refs) < 0) free(pkt);
+}
+
 /* #################################################################
    returns 1 if the packet has data for the digital input else 0 */
 int xbee_hasdigital(xbee_pkt *pkt, int sample, int input) {
@@ -130,6 +217,89 @@ double xbee_getanalog(xbee_pkt *pkt, int sample, int input, double Vref) {
   return pkt->IOdata[sample].IOanalog[input];
 }
 
+/* #################################################################
+   converts analog input from every sample in the packet, see xbee_getanalog_bulkn() */
+int xbee_getanalog_bulk(xbee_pkt *pkt, int input, double Vref, float *out, int *n) {
+  return xbee_getanalog_bulkn(&pkt, 1, input, Vref, out, n);
+}
+
+/* #################################################################
+   converts analog input from every sample in each of the packets into out,
+   which has room for *n values. *n is set to the number of values written.
+   samples without data for the input give 0, as xbee_getanalog() would.
+   returns 0 on success, 1 if out was too short (the values that fit are
+   still written), or -1 if the arguments are bad */
+int xbee_getanalog_bulkn(xbee_pkt **pkts, int npkts, int input, double Vref, float *out, int *n) {
+  float scale;
+  int i, c, o = 0, ret = 0;
+  if (!pkts || npkts < 0 || !out || !n || *n < 0) return -1;
+  if (input < 0 || input > 5) return -1;
+
+  scale = (float)(Vref?(Vref / 1023):1);
+  for (i = 0; i < npkts; i++) {
+    if (!pkts[i]) continue;
+    c = pkts[i]->samples;
+    if (c > *n - o) {
+      c = *n - o;
+      ret = 1;
+    }
+    xbee_analog_convert(pkts[i]->IOdata, c, input, scale, &out[o]);
+    o += c;
+    if (ret) break;
+  }
+  *n = o;
+  return ret;
+}
+
+/* #################################################################
+   xbee_analog_convert - INTERNAL
+   converts the input from count samples into out, 8 at a time with SSE2 */
+static void xbee_analog_convert(xbee_sample *s, int count, int input, float scale, float *out) {
+  unsigned short bit = 0x0200 << input;
+  int i = 0;
+#ifdef XBEE_SSE2
+  __m128 vscale = _mm_set1_ps(scale);
+  __m128i vbit = _mm_set1_epi16(bit);
+  __m128i zero = _mm_setzero_si128();
+  __m128i r[8], a, b, c, d, e, f, g, h, v, m;
+
+  /* each xbee_sample is 8 shorts, so 8 samples can be transposed into 8
+     registers, each holding one field from all 8 samples */
+  for (; i + 8 <= count; i += 8, s += 8) {
+    a = _mm_unpacklo_epi16(_mm_loadu_si128((__m128i *)&s[0]), _mm_loadu_si128((__m128i *)&s[1]));
+    b = _mm_unpacklo_epi16(_mm_loadu_si128((__m128i *)&s[2]), _mm_loadu_si128((__m128i *)&s[3]));
+    c = _mm_unpacklo_epi16(_mm_loadu_si128((__m128i *)&s[4]), _mm_loadu_si128((__m128i *)&s[5]));
+    d = _mm_unpacklo_epi16(_mm_loadu_si128((__m128i *)&s[6]), _mm_loadu_si128((__m128i *)&s[7]));
+    e = _mm_unpackhi_epi16(_mm_loadu_si128((__m128i *)&s[0]), _mm_loadu_si128((__m128i *)&s[1]));
+    f = _mm_unpackhi_epi16(_mm_loadu_si128((__m128i *)&s[2]), _mm_loadu_si128((__m128i *)&s[3]));
+    g = _mm_unpackhi_epi16(_mm_loadu_si128((__m128i *)&s[4]), _mm_loadu_si128((__m128i *)&s[5]));
+    h = _mm_unpackhi_epi16(_mm_loadu_si128((__m128i *)&s[6]), _mm_loadu_si128((__m128i *)&s[7]));
+    /* a-d hold fields 0-3, e-h hold fields 4-7 (as pairs of samples) */
+    r[0] = _mm_unpacklo_epi32(a, b);
+    r[1] = _mm_unpacklo_epi32(c, d);
+    r[2] = _mm_unpackhi_epi32(a, b);
+    r[3] = _mm_unpackhi_epi32(c, d);
+    r[4] = _mm_unpacklo_epi32(e, f);
+    r[5] = _mm_unpacklo_epi32(g, h);
+    r[6] = _mm_unpackhi_epi32(e, f);
+    r[7] = _mm_unpackhi_epi32(g, h);
+    /* r[n*2] and r[n*2+1] hold fields n*2 and n*2+1 for samples 0-3 and 4-7 */
+    m = _mm_unpacklo_epi64(r[0], r[1]);
+    v = (((2 + input) & 1)?_mm_unpackhi_epi64(r[(2 + input) & ~1], r[((2 + input) & ~1) + 1]):
+                           _mm_unpacklo_epi64(r[(2 + input) & ~1], r[((2 + input) & ~1) + 1]));
+    /* zero the values from samples that don't have the input */
+    m = _mm_cmpeq_epi16(_mm_and_si128(m, vbit), zero);
+    v = _mm_andnot_si128(m, v);
+    /* widen to 32-bit, convert and scale */
+    _mm_storeu_ps(&out[i],     _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero)), vscale));
+    _mm_storeu_ps(&out[i + 4], _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero)), vscale));
+  }
+#endif /* XBEE_SSE2 */
+  for (; i < count; i++, s++) {
+    out[i] = ((s->IOmask & bit)?(s->IOanalog[input] * scale):0);
+  }
+}
+
 /* ################################################################# */
 /* ### XBee Functions ############################################## */
 /* ################################################################# */
@@ -300,9 +470,10 @@ static int xbee_startAPI(xbee_hnd xbee) {
   buf[1] = '\0';
   xbee->oldAPI = atoi(buf);
 
-  if (xbee->oldAPI != 2) {
-    /* if it wasnt set to mode 2 already, then set it to mode 2 */
-    if (xbee_sendAT(xbee, "ATAP2\r", buf, 4) || strncmp(buf,"OK\r",3)) return 1;
+  if (xbee->oldAPI != xbee->apimode) {
+    /* if it wasnt set to the mode we want already, then set it */
+    sprintf(buf, "ATAP%d\r", xbee->apimode);
+    if (xbee_sendAT(xbee, buf, buf, 4) || strncmp(buf,"OK\r",3)) return 1;
   }
 
   /* quit from command mode, ready for some packets! :) */
@@ -311,6 +482,107 @@ static int xbee_startAPI(xbee_hnd xbee) {
   return 0;
 }
 
+/* #################################################################
+   xbee_autobaud - INTERNAL
+   finds the baud rate that the XBee is running at by probing at each rate
+   (fastest first) and taking the first that gets a clean response
+   returns the rate, or 0 if nothing answered. the XBee must be in API mode */
+static int xbee_autobaud(xbee_hnd xbee) {
+  static const int rates[] = { 921600, 460800, 230400, 115200, 57600, 38400, 19200, 9600, 4800, 2400, 1200 };
+  int i;
+
+  for (i = 0; i < (int)(sizeof(rates) / sizeof(rates[0])); i++) {
+    if (xbee_serial_speed(xbee,rates[i])) continue;
+    xbee_log("Trying %d baud...",rates[i]);
+    /* give the port a moment at the new rate */
+    usleep(10000);
+    if (xbee_probe(xbee)) {
+      xbee_log("XBee answered at %d baud",rates[i]);
+      return rates[i];
+    }
+  }
+
+  return 0;
+}
+
+/* #################################################################
+   xbee_probe - INTERNAL
+   sends a local ATVR as an API frame, and waits a short time for a clean response
+   returns 1 if the XBee answered (it is in API mode at this baud rate).
+   this must be used before the listen thread is started */
+static int xbee_probe(xbee_hnd xbee) {
+  unsigned char req[8], buf[64];
+  unsigned long long end, now;
+  struct timeval to;
+  int len, ret;
+
+  /* a local AT request for VR - none of these bytes need escaping */
+  req[0] = 0x7E;
+  req[1] = 0x00;
+  req[2] = 0x04;
+  req[3] = XBEE_LOCAL_ATREQ;
+  req[4] = XBEE_AUTOBAUD_FRAMEID;
+  req[5] = 'V';
+  req[6] = 'R';
+  req[7] = 0xFF - ((req[3] + req[4] + req[5] + req[6]) & 0xFF);
+
+  /* get rid of anything left over */
+  for (;;) {
+    memset(&to, 0, sizeof(to));
+    if (xbee_select(xbee,&to) <= 0 || xbee_read(xbee,buf,sizeof(buf)) <= 0) break;
+  }
+
+  if (xbee_write(xbee,req,sizeof(req)) != sizeof(req)) return 0;
+
+  /* collect whatever comes back until it makes a valid response, or we run out of time */
+  len = 0;
+  end = xbee_clock_ns() + (XBEE_AUTOBAUD_TIMEOUT * 1000000ULL);
+  while (len < (int)sizeof(buf) && (now = xbee_clock_ns()) < end) {
+    to.tv_sec = 0;
+    to.tv_usec = (end - now) / 1000;
+    if ((ret = xbee_select(xbee,&to)) <= 0) break;
+    if ((ret = xbee_read(xbee,&buf[len],sizeof(buf) - len)) <= 0) break;
+    len += ret;
+    if (xbee_autobaud_match(buf,len,(xbee->apimode == 2))) return 1;
+  }
+
+  return 0;
+}
+
+/* #################################################################
+   xbee_autobaud_match - INTERNAL
+   returns 1 if the bytes contain a good response to xbee_probe()'s request */
+static int xbee_autobaud_match(unsigned char *buf, int len, int escaped) {
+  unsigned char d[64], chksum;
+  int i, j, n, l;
+
+  for (i = 0; i < len; i++) {
+    if (buf[i] != 0x7E) continue;
+
+    /* un-escape up to the next start delimiter (API mode 1 may have 0x7E in the frame) */
+    for (n = 0, j = i + 1; j < len && (!escaped || buf[j] != 0x7E); j++) {
+      if (escaped && buf[j] == 0x7D) {
+        if (++j >= len) break;
+        d[n++] = buf[j] ^ 0x20;
+      } else {
+        d[n++] = buf[j];
+      }
+    }
+    if (n < 3) continue;
+
+    /* length, then the API data, then the checksum */
+    l = (d[0] << 8) | d[1];
+    if (l < 5 || n < l + 3) continue;
+    for (chksum = 0, j = 2; j < l + 3; j++) chksum += d[j];
+    if (chksum != 0xFF) continue;
+
+    if (d[2] == XBEE_LOCAL_AT && d[3] == XBEE_AUTOBAUD_FRAMEID &&
+        d[4] == 'V' && d[5] == 'R' && d[6] == 0x00) return 1;
+  }
+
+  return 0;
+}
+
 /* #################################################################
    xbee_end
    resets the API mode to the saved value - you must have called xbee_setup[log]API */
@@ -319,6 +591,7 @@ int xbee_end(void) {
 }
 int _xbee_end(xbee_hnd xbee) {
   int ret = 1;
+  int i;
   xbee_con *con, *ncon;
   xbee_pkt *pkt, *npkt;
   xbee_hnd xbeet;
@@ -326,6 +599,13 @@ int _xbee_end(xbee_hnd xbee) {
   ISREADYR(0);
   xbee_log("Stopping libxbee instance...");
 
+  /* stop the background discovery and the frame server, they use the serial port */
+  xbee_discover_stop(xbee);
+  _xbee_serve_stop(xbee);
+
+  /* readers of the packet ring see that nothing more is coming */
+  _xbee_ring_stop(xbee);
+
   /* unlink the instance from list... */
   xbee_log("Unlinking instance from list...");
   xbee_mutex_lock(xbee_hnd_mutex);
@@ -346,28 +626,32 @@ int _xbee_end(xbee_hnd xbee) {
   }
   if (default_xbee) xbee_mutex_unlock(xbee_hnd_mutex);
   
-  /* if the api mode was not 2 to begin with then put it back */
-  if (xbee->oldAPI == 2) {
-    xbee_log("XBee was already in API mode 2, no need to reset");
+  /* if the api mode was different to begin with then put it back */
+  if (xbee->oldAPI == xbee->apimode) {
+    xbee_log("XBee was already in API mode %d, no need to reset",xbee->apimode);
     ret = 0;
   } else {
     int to = 5;
 
-    con = _xbee_newcon(xbee,'I',xbee_localAT);
-    con->callback = NULL;
-    con->waitforACK = 1;
-    _xbee_senddata(xbee,con,"AP%c",xbee->oldAPI);
+    if ((con = _xbee_newcon(xbee,'I',xbee_localAT)) == NULL) {
+      /* out of memory, or over the handle's limit */
+      xbee_log("Unable to make a connection, the XBee has been left in API mode %d",xbee->apimode);
+    } else {
+      con->callback = NULL;
+      con->waitforACK = 1;
+      _xbee_senddata(xbee,con,"AP%c",xbee->oldAPI);
 
-    pkt = NULL;
+      pkt = NULL;
 
-    while (!pkt && to--) {
-      pkt = _xbee_getpacketwait(xbee,con);
-    }
-    if (pkt) {
-      ret = pkt->status;
-      Xfree(pkt);
+      while (!pkt && to--) {
+        pkt = _xbee_getpacketwait(xbee,con);
+      }
+      if (pkt) {
+        ret = pkt->status;
+        Xfree(pkt);
+      }
+      _xbee_endcon(xbee,con);
     }
-    _xbee_endcon(xbee,con);
   }
 
   /* xbee_* functions may no longer run... */
@@ -386,6 +670,8 @@ int _xbee_end(xbee_hnd xbee) {
   
   xbee_mutex_destroy(xbee->threadmutex);
   xbee_sem_destroy(xbee->threadsem);
+  xbee_cond_destroy(xbee->readycond);
+  xbee_mutex_destroy(xbee->readymutex);
 
   /* free all connections */
   con = xbee->conlist;
@@ -397,7 +683,15 @@ int _xbee_end(xbee_hnd xbee) {
     con->callbackList = NULL;
     while (t) {
       n = t->next;
-      Xfree(t->pkt);
+      xbee_pkt_unref(t->pkt);
+      Xfree(t);
+      t = n;
+    }
+    t = con->subList;
+    con->subList = NULL;
+    while (t) {
+      n = t->next;
+      xbee_pkt_unref(t->pkt);
       Xfree(t);
       t = n;
     }
@@ -420,6 +714,39 @@ int _xbee_end(xbee_hnd xbee) {
   xbee_mutex_destroy(xbee->pktmutex);
   xbee_mutex_destroy(xbee->sendmutex);
 
+  /* free the I/O sink */
+  xbee_iosink_free(xbee);
+  xbee_mutex_destroy(xbee->iosinkmutex);
+
+  /* free the node table */
+  xbee_node_free(xbee);
+  xbee_mutex_destroy(xbee->nodemutex);
+  xbee_sem_destroy(xbee->discoversem);
+
+  /* free the remote AT cache */
+  xbee_atcache_free(xbee);
+  xbee_cond_destroy(xbee->atcachecond);
+  xbee_mutex_destroy(xbee->atcachemutex);
+
+  /* free any responses that nobody collected */
+  for (i = 0; i < 256; i++) {
+    if (xbee->frames[i].pkt) Xfree(xbee->frames[i].pkt);
+  }
+  xbee_cond_destroy(xbee->framecond);
+  xbee_mutex_destroy(xbee->framemutex);
+
+  /* free the frame filters */
+  xbee_filter_setfree(xbee->filters);
+  xbee_filter_setfree(xbee->filternext);
+  xbee_mutex_destroy(xbee->filtermutex);
+
+  /* free the duplicate suppression table */
+  xbee_dedup_free(xbee->dedup);
+  xbee_dedup_free(xbee->dedupnext);
+  xbee_mutex_destroy(xbee->dedupmutex);
+  xbee_mutex_destroy(xbee->servemutex);
+  xbee_mutex_destroy(xbee->ringmutex);
+
   /* close the serial port */
   Xfree(xbee->path);
   if (xbee->tty) xbee_close(xbee->tty);
@@ -465,12 +792,90 @@ int xbee_setuplogAPI(char *path, int baudrate, int logfd, char cmdSeq, int cmdTi
   return (default_xbee?0:-1);
 }
 xbee_hnd _xbee_setuplogAPI(char *path, int baudrate, int logfd, char cmdSeq, int cmdTime) {
+  return _xbee_setupflags(path,baudrate,logfd,cmdSeq,cmdTime,0);
+}
+int xbee_setupflags(char *path, int baudrate, int logfd, char cmdSeq, int cmdTime, int flags) {
+  if (default_xbee) return 0;
+  default_xbee = _xbee_setupflags(path,baudrate,logfd,cmdSeq,cmdTime,flags);
+  return (default_xbee?0:-1);
+}
+xbee_hnd _xbee_setupflags(char *path, int baudrate, int logfd, char cmdSeq, int cmdTime, int flags) {
+  xbee_hnd xbee;
+
+  if ((xbee = xbee_setup_open(path,baudrate,logfd,cmdSeq,cmdTime,flags)) == NULL) return NULL;
+  xbee_setup_link(xbee);
+
+  return xbee;
+}
+
+/* #################################################################
+   _xbee_setupmany
+   opens a number of XBees at the same time, each entry's xbee is set to its
+   handle (or NULL if it failed). returns the number that were opened */
+int _xbee_setupmany(xbee_setupinfo *info, int count) {
+  xbee_thread_t *threads;
+  int *started;
+  xbee_hnd xbee = NULL; /* for Xcalloc() */
+  int i, n = 0;
+
+  if (!info || count <= 0) return 0;
+  threads = Xcalloc(sizeof(xbee_thread_t) * count);
+  started = Xcalloc(sizeof(int) * count);
+  if (!threads || !started) {
+    Xfree(started);
+    Xfree(threads);
+    return 0;
+  }
+
+  /* the slow part (probing, command mode...) runs in a thread for each XBee */
+  for (i = 0; i < count; i++) {
+    info[i].xbee = NULL;
+    if (xbee_thread_create(threads[i], xbee_setup_thread, &info[i])) {
+      /* couldn't start a thread, just do this one here */
+      xbee_setup_thread(&info[i]);
+    } else {
+      started[i] = 1;
+    }
+  }
+  for (i = 0; i < count; i++) {
+    if (started[i]) xbee_thread_join(threads[i]);
+  }
+  Xfree(started);
+  Xfree(threads);
+
+  /* then they are linked in order */
+  for (i = 0; i < count; i++) {
+    if (!info[i].xbee) continue;
+    xbee_setup_link(info[i].xbee);
+    n++;
+  }
+
+  return n;
+}
+
+/* #################################################################
+   xbee_setup_thread - INTERNAL
+   opens one of the XBees given to _xbee_setupmany() */
+static void xbee_setup_thread(xbee_setupinfo *info) {
+  info->xbee = xbee_setup_open(info->path,info->baudrate,info->logfd,info->cmdSeq,info->cmdTime,info->flags);
+}
+
+/* #################################################################
+   xbee_setup_open - INTERNAL
+   opens the serial port, gets the XBee into API mode and starts the threads
+   the handle isn't added to the instance list, see xbee_setup_link() */
+static xbee_hnd xbee_setup_open(char *path, int baudrate, int logfd, char cmdSeq, int cmdTime, int flags) {
   int ret;
   xbee_hnd xbee = NULL;
 
   /* create a new instance */
-  xbee = Xcalloc(sizeof(struct xbee_hnd));
+  if ((xbee = Xcalloc(sizeof(struct xbee_hnd))) == NULL) {
+    perror("xbee_setup():Xcalloc()");
+    return NULL;
+  }
   xbee->next = NULL;
+  xbee->flags = flags;
+  xbee->apimode = (flags & XBEE_SETUP_AP1)?1:2;
   
   xbee_mutex_init(xbee->logmutex);
 #ifdef DEBUG
@@ -513,6 +918,7 @@ xbee_hnd _xbee_setuplogAPI(char *path, int baudrate, int logfd, char cmdSeq, int
   if (xbee_mutex_init(xbee->conmutex)) {
     xbee_perror("xbee_setup():xbee_mutex_init(conmutex)");
     if (xbee->log) xbee_close(xbee->log);
+    xbee_mutex_destroy(xbee->logmutex);
     Xfree(xbee);
     return NULL;
   }
@@ -520,6 +926,7 @@ xbee_hnd _xbee_setuplogAPI(char *path, int baudrate, int logfd, char cmdSeq, int
     xbee_perror("xbee_setup():xbee_mutex_init(pktmutex)");
     if (xbee->log) xbee_close(xbee->log);
     xbee_mutex_destroy(xbee->conmutex);
+    xbee_mutex_destroy(xbee->logmutex);
     Xfree(xbee);
     return NULL;
   }
@@ -528,6 +935,7 @@ xbee_hnd _xbee_setuplogAPI(char *path, int baudrate, int logfd, char cmdSeq, int
     if (xbee->log) xbee_close(xbee->log);
     xbee_mutex_destroy(xbee->conmutex);
     xbee_mutex_destroy(xbee->pktmutex);
+    xbee_mutex_destroy(xbee->logmutex);
     Xfree(xbee);
     return NULL;
   }
@@ -539,6 +947,7 @@ xbee_hnd _xbee_setuplogAPI(char *path, int baudrate, int logfd, char cmdSeq, int
     xbee_mutex_destroy(xbee->conmutex);
     xbee_mutex_destroy(xbee->pktmutex);
     xbee_mutex_destroy(xbee->sendmutex);
+    xbee_mutex_destroy(xbee->logmutex);
     Xfree(xbee);
     return NULL;
   }
@@ -553,16 +962,49 @@ xbee_hnd _xbee_setuplogAPI(char *path, int baudrate, int logfd, char cmdSeq, int
     xbee_mutex_destroy(xbee->pktmutex);
     xbee_mutex_destroy(xbee->sendmutex);
     Xfree(xbee->path);
+    xbee_mutex_destroy(xbee->logmutex);
     Xfree(xbee);
     return NULL;
   }
 
-  /* when xbee_end() is called, if this is not 2 then ATAP will be set to this value */
-  xbee->oldAPI = 2;
+  /* a frame server always talks API mode 1, and looks after the XBee itself */
+  if (xbee->client) {
+    xbee->apimode = 1;
+    cmdSeq = 0;
+    cmdTime = 0;
+    xbee_log("Connected to a frame server, the XBee is shared");
+  }
+
+  /* find the rate the XBee is running at */
+  if (baudrate == XBEE_BAUD_AUTO && !xbee->client) {
+    if ((baudrate = xbee_autobaud(xbee)) == 0) {
+      if (xbee->log) {
+        xbee_log("Couldn't find the XBee's baud rate...");
+        xbee_close(xbee->log);
+      }
+      xbee_mutex_destroy(xbee->conmutex);
+      xbee_mutex_destroy(xbee->pktmutex);
+      xbee_mutex_destroy(xbee->sendmutex);
+      Xfree(xbee->path);
+#ifdef __GNUC__ /* ---- */
+      close(xbee->ttyfd);
+#endif /* ------------- */
+      xbee_close(xbee->tty);
+      xbee_mutex_destroy(xbee->logmutex);
+      Xfree(xbee);
+      return NULL;
+    }
+  }
+
+  /* when xbee_end() is called, if this is not apimode then ATAP will be set to this value */
+  xbee->oldAPI = xbee->apimode;
   xbee->cmdSeq = cmdSeq;
   xbee->cmdTime = cmdTime;
   if (xbee->cmdSeq && xbee->cmdTime) {
-    if (xbee_startAPI(xbee)) {
+    /* a single API frame is much quicker than command mode's guard times */
+    if ((flags & XBEE_SETUP_PROBE) && xbee_probe(xbee)) {
+      xbee_log("XBee is already in API mode %d, command mode isn't needed",xbee->apimode);
+    } else if (xbee_startAPI(xbee)) {
       if (xbee->log) {
         xbee_log("Couldn't communicate with XBee...");
         xbee_close(xbee->log);
@@ -575,11 +1017,43 @@ xbee_hnd _xbee_setuplogAPI(char *path, int baudrate, int logfd, char cmdSeq, int
       close(xbee->ttyfd);
 #endif /* ------------- */
       xbee_close(xbee->tty);
+      xbee_mutex_destroy(xbee->logmutex);
       Xfree(xbee);
       return NULL;
     }
   }
 
+  /* setup the I/O sink (disabled until xbee_iosink() is called) */
+  xbee_mutex_init(xbee->iosinkmutex);
+
+  /* setup the node table */
+  xbee_mutex_init(xbee->nodemutex);
+  xbee_sem_init(xbee->discoversem);
+
+  /* setup the remote AT cache */
+  xbee_mutex_init(xbee->atcachemutex);
+  xbee_cond_init(xbee->atcachecond);
+
+  /* setup the reserved frame IDs */
+  xbee_mutex_init(xbee->framemutex);
+  xbee_cond_init(xbee->framecond);
+
+  /* setup the frame filters (there are none until xbee_setfilter() is called) */
+  xbee_mutex_init(xbee->filtermutex);
+
+  /* setup duplicate suppression (disabled until xbee_dedup() is called) */
+  xbee_mutex_init(xbee->dedupmutex);
+
+  /* setup the frame server (not running until xbee_serve() is called) */
+  xbee_mutex_init(xbee->servemutex);
+
+  /* setup the packet ring (not published until xbee_ring_publish() is called) */
+  xbee_mutex_init(xbee->ringmutex);
+
+  /* the listen thread signals readycond once it is running */
+  xbee_mutex_init(xbee->readymutex);
+  xbee_cond_init(xbee->readycond);
+
   /* allow the listen thread to start */
   xbee->xbee_ready = -1;
 
@@ -587,6 +1061,7 @@ xbee_hnd _xbee_setuplogAPI(char *path, int baudrate, int logfd, char cmdSeq, int
   if (xbee_thread_create(xbee->listent, xbee_listen_wrapper, xbee)) {
     xbee_perror("xbee_setup():xbee_thread_create(listent)");
     if (xbee->log) xbee_close(xbee->log);
+    xbee_setup_undo(xbee);
     xbee_mutex_destroy(xbee->conmutex);
     xbee_mutex_destroy(xbee->pktmutex);
     xbee_mutex_destroy(xbee->sendmutex);
@@ -595,6 +1070,7 @@ xbee_hnd _xbee_setuplogAPI(char *path, int baudrate, int logfd, char cmdSeq, int
     close(xbee->ttyfd);
 #endif /* ------------- */
     xbee_close(xbee->tty);
+    xbee_mutex_destroy(xbee->logmutex);
     Xfree(xbee);
     return NULL;
   }
@@ -604,7 +1080,14 @@ xbee_hnd _xbee_setuplogAPI(char *path, int baudrate, int logfd, char cmdSeq, int
   xbee_sem_init(xbee->threadsem);
   if (xbee_thread_create(xbee->threadt, xbee_thread_watch, xbee)) {
     xbee_perror("xbee_setup():xbee_thread_create(threadt)");
+    /* the listen thread is already running */
+    xbee->run = 0;
+    xbee_thread_cancel(xbee->listent,0);
+    xbee_thread_join(xbee->listent);
     if (xbee->log) xbee_close(xbee->log);
+    xbee_mutex_destroy(xbee->threadmutex);
+    xbee_sem_destroy(xbee->threadsem);
+    xbee_setup_undo(xbee);
     xbee_mutex_destroy(xbee->conmutex);
     xbee_mutex_destroy(xbee->pktmutex);
     xbee_mutex_destroy(xbee->sendmutex);
@@ -613,19 +1096,49 @@ xbee_hnd _xbee_setuplogAPI(char *path, int baudrate, int logfd, char cmdSeq, int
     close(xbee->ttyfd);
 #endif /* ------------- */
     xbee_close(xbee->tty);
+    xbee_mutex_destroy(xbee->logmutex);
     Xfree(xbee);
     return NULL;
   }
 
-  usleep(500);
+  /* wait for xbee_listen() to be ready */
+  xbee_mutex_lock(xbee->readymutex);
   while (xbee->xbee_ready != -2) {
-    usleep(500);
-    xbee_log("Waiting for xbee_listen() to be ready...");
+    xbee_cond_wait(xbee->readycond,xbee->readymutex);
   }
 
   /* allow other functions to be used! */
   xbee->xbee_ready = 1;
-  
+  xbee_mutex_unlock(xbee->readymutex);
+
+  return xbee;
+}
+
+/* #################################################################
+   xbee_setup_undo - INTERNAL
+   destroys the mutexes, condition variables and semaphores that
+   xbee_setup_open() makes once the XBee is in API mode, for when one of the
+   threads can't be started */
+static void xbee_setup_undo(xbee_hnd xbee) {
+  xbee_mutex_destroy(xbee->iosinkmutex);
+  xbee_mutex_destroy(xbee->nodemutex);
+  xbee_sem_destroy(xbee->discoversem);
+  xbee_cond_destroy(xbee->atcachecond);
+  xbee_mutex_destroy(xbee->atcachemutex);
+  xbee_cond_destroy(xbee->framecond);
+  xbee_mutex_destroy(xbee->framemutex);
+  xbee_mutex_destroy(xbee->filtermutex);
+  xbee_mutex_destroy(xbee->dedupmutex);
+  xbee_mutex_destroy(xbee->servemutex);
+  xbee_mutex_destroy(xbee->ringmutex);
+  xbee_cond_destroy(xbee->readycond);
+  xbee_mutex_destroy(xbee->readymutex);
+}
+
+/* #################################################################
+   xbee_setup_link - INTERNAL
+   adds an opened handle to the instance list */
+static void xbee_setup_link(xbee_hnd xbee) {
   xbee_log("Linking xbee instance...");
   if (!default_xbee) {
     xbee_mutex_init(xbee_hnd_mutex);
@@ -644,8 +1157,6 @@ xbee_hnd _xbee_setuplogAPI(char *path, int baudrate, int logfd, char cmdSeq, int
   }
   
   xbee_log("libxbee: Started!");
-
-  return xbee;
 }
 
 /* #################################################################
@@ -675,7 +1186,7 @@ xbee_con *_xbee_getcon(xbee_hnd xbee, unsigned char frameID, xbee_types type, ..
   return ret;
 }
 xbee_con *_xbee_vgetcon(xbee_hnd xbee, unsigned char frameID, xbee_types type, va_list ap) {
-  unsigned char tAddr[8];
+  unsigned char tAddr[XBEE_CONKEYLEN];
 
   return _xbee_vvgetcon(xbee,tAddr,frameID,type,ap);
 }
@@ -691,7 +1202,9 @@ xbee_con *_xbee_vvgetcon(xbee_hnd xbee, unsigned char *tAddr, unsigned char fram
   if ((type == xbee_64bitRemoteAT) ||
       (type == xbee_64bitData) ||
       (type == xbee_64bitIO) ||
-      (type == xbee2_data)) {
+      (type == xbee2_data) ||
+      (type == xbee2_IO) ||
+      (type == xbee2_explicit)) {
     t = va_arg(ap, int);
     tAddr[0] = (t >> 24) & 0xFF;
     tAddr[1] = (t >> 16) & 0xFF;
@@ -703,6 +1216,18 @@ xbee_con *_xbee_vvgetcon(xbee_hnd xbee, unsigned char *tAddr, unsigned char fram
     tAddr[6] = (t >>  8) & 0xFF;
     tAddr[7] = (t      ) & 0xFF;
 
+    /* if: explicit, the endpoints, cluster and profile follow the address */
+    if (type == xbee2_explicit) {
+      tAddr[8] = va_arg(ap, int) & 0xFF;
+      tAddr[9] = va_arg(ap, int) & 0xFF;
+      t = va_arg(ap, int);
+      tAddr[10] = (t >>  8) & 0xFF;
+      tAddr[11] = (t      ) & 0xFF;
+      t = va_arg(ap, int);
+      tAddr[12] = (t >>  8) & 0xFF;
+      tAddr[13] = (t      ) & 0xFF;
+    }
+
     /* if: 16 bit address expected (1 int) */
   } else if ((type == xbee_16bitRemoteAT) ||
              (type == xbee_16bitData) ||
@@ -734,6 +1259,12 @@ xbee_con *_xbee_xgetcon(xbee_hnd xbee, unsigned char frameID, xbee_types type, u
   if (xbee->conlist) {
     con = xbee->conlist;
     while (con) {
+      /* if: it is a subscription, it won't be given out again */
+      if (con->subscribe) {
+        con = con->next;
+        continue;
+      }
+
       /* if: looking for a modemStatus, and the types match! */
       if ((type == xbee_modemStatus) &&
           (con->type == type)) {
@@ -757,7 +1288,12 @@ xbee_con *_xbee_xgetcon(xbee_hnd xbee, unsigned char frameID, xbee_types type, u
         /* if: connection types match, the frameIDs match, and the addresses match! */
       } else if ((type == con->type) &&
                  (frameID == con->frameID) &&
-                 (!memcmp(tAddr,con->tAddr,8))) {
+                 (!memcmp(tAddr,con->tAddr,8)) &&
+                 ((type != xbee2_explicit) ||
+                  ((tAddr[8] == con->srcEndpoint) &&
+                   (tAddr[9] == con->dstEndpoint) &&
+                   (((tAddr[10] << 8) | tAddr[11]) == con->clusterID) &&
+                   (((tAddr[12] << 8) | tAddr[13]) == con->profileID)))) {
         xbee_mutex_unlock(xbee->conmutex);
         return con;
       }
@@ -802,8 +1338,42 @@ xbee_con *_xbee_newcon(xbee_hnd xbee, unsigned char frameID, xbee_types type, ..
   return ret;
 }
 xbee_con *_xbee_vnewcon(xbee_hnd xbee, unsigned char frameID, xbee_types type, va_list ap) {
+  return xbee_vnewcon2(xbee, frameID, type, ap, 0);
+}
+
+/* #################################################################
+   xbee_subscribe
+   produces a new connection that is given a reference to every packet that
+   matches it, even if another connection has been given the same packet.
+   the address is given as for xbee_newcon(), and a new connection is always made */
+xbee_con *xbee_subscribe(xbee_types type, ...) {
+  xbee_con *ret;
+  va_list ap;
+
+  va_start(ap, type);
+  ret = _xbee_vsubscribe(default_xbee, type, ap);
+  va_end(ap);
+  return ret;
+}
+xbee_con *_xbee_subscribe(xbee_hnd xbee, xbee_types type, ...) {
+  xbee_con *ret;
+  va_list ap;
+
+  va_start(ap, type);
+  ret = _xbee_vsubscribe(xbee, type, ap);
+  va_end(ap);
+  return ret;
+}
+xbee_con *_xbee_vsubscribe(xbee_hnd xbee, xbee_types type, va_list ap) {
+  return xbee_vnewcon2(xbee, 0, type, ap, 1);
+}
+
+/* #################################################################
+   xbee_vnewcon2 - INTERNAL
+   makes the connection for xbee_newcon() and xbee_subscribe() */
+static xbee_con *xbee_vnewcon2(xbee_hnd xbee, unsigned char frameID, xbee_types type, va_list ap, int subscribe) {
   xbee_con *scon, *con, *ocon;
-  unsigned char tAddr[8];
+  unsigned char tAddr[XBEE_CONKEYLEN];
   int i;
 
   ISREADYR(NULL);
@@ -813,6 +1383,10 @@ xbee_con *_xbee_vnewcon(xbee_hnd xbee, unsigned char frameID, xbee_types type, v
   
   con = _xbee_vvgetcon(xbee, tAddr, frameID, type, ap);
   scon = NULL;
+  if (subscribe) {
+    /* subscriptions are never shared, or take the place of a sleeping connection */
+    con = NULL;
+  }
   if (con) {
     if (con->sleeping) {
       scon = con;
@@ -821,14 +1395,20 @@ xbee_con *_xbee_vnewcon(xbee_hnd xbee, unsigned char frameID, xbee_types type, v
     }
   }
   
-  /* create a new connection and set its attributes */
-  con = Xcalloc(sizeof(xbee_con));
+  /* create a new connection and set its attributes (not if the handle is over its memory limit) */
+  if (xbee_mem_full(xbee, sizeof(xbee_con)) || (con = Xcalloc(sizeof(xbee_con))) == NULL) {
+    xbee_log("Unable to allocate a connection!");
+    return NULL;
+  }
+  xbee_mem_add(xbee, xbee_mem_con, 1, sizeof(xbee_con));
   con->type = type;
   /* is it a 64bit connection? */
   if ((type == xbee_64bitRemoteAT) ||
       (type == xbee_64bitData) ||
       (type == xbee_64bitIO) ||
-      (type == xbee2_data)) {
+      (type == xbee2_data) ||
+      (type == xbee2_IO) ||
+      (type == xbee2_explicit)) {
     con->tAddr64 = TRUE;
   }
   con->atQueue = 0; /* queue AT commands? */
@@ -836,9 +1416,17 @@ xbee_con *_xbee_vnewcon(xbee_hnd xbee, unsigned char frameID, xbee_types type, v
   con->txBroadcastPAN = 0; /* broadcast? */
   con->frameID = frameID;
   con->waitforACK = 0;
+  con->subscribe = subscribe;
   memcpy(con->tAddr,tAddr,8); /* copy in the remote address */
+  if (type == xbee2_explicit) {
+    con->srcEndpoint = tAddr[8];
+    con->dstEndpoint = tAddr[9];
+    con->clusterID = (tAddr[10] << 8) | tAddr[11];
+    con->profileID = (tAddr[12] << 8) | tAddr[13];
+  }
   xbee_mutex_init(con->callbackmutex);
   xbee_mutex_init(con->callbackListmutex);
+  xbee_cond_init(con->batchcond);
   xbee_mutex_init(con->Txmutex);
   xbee_sem_init(con->waitforACKsem);
 
@@ -886,6 +1474,23 @@ xbee_con *_xbee_vnewcon(xbee_hnd xbee, unsigned char frameID, xbee_types type, v
       fprintf(xbee->log,")");
       xbee_logcf();
       break;
+    case xbee2_IO:
+      xbee_logc("New Series 2 IO connection! (to: ");
+      for (i=0;i<8;i++) {
+        fprintf(xbee->log,(i?":%02X":"%02X"),tAddr[i]);
+      }
+      fprintf(xbee->log,")");
+      xbee_logcf();
+      break;
+    case xbee2_explicit:
+      xbee_logc("New Series 2 explicit connection! (to: ");
+      for (i=0;i<8;i++) {
+        fprintf(xbee->log,(i?":%02X":"%02X"),tAddr[i]);
+      }
+      fprintf(xbee->log," endpoint 0x%02X -> 0x%02X, cluster 0x%04X, profile 0x%04X)",
+              con->srcEndpoint,con->dstEndpoint,con->clusterID,con->profileID);
+      xbee_logcf();
+      break;
     case xbee_txStatus:
       xbee_log("New Tx status connection!");
       break;
@@ -932,11 +1537,38 @@ xbee_con *_xbee_vnewcon(xbee_hnd xbee, unsigned char frameID, xbee_types type, v
     }
   }
 
+  if (subscribe) xbee->subscriptions++;
+
   /* unlock the mutex */
   xbee_mutex_unlock(xbee->conmutex);
   return con;
 }
 
+/* #################################################################
+   xbee_batchcallback
+   gives the connection's packets to callback in batches, instead of one at a time
+   to con->callback. each call is given every packet that is waiting, up to max
+   (0 for XBEE_BATCH_MAX). if linger is more than 0, a batch that isn't full is held
+   until the oldest packet in it has waited that many ms. the packets are released
+   after the callback returns (unless con->noFreeAfterCB is set). a NULL callback
+   goes back to using con->callback. returns 0 on success or -1 on error */
+int xbee_batchcallback(xbee_con *con, void (*callback)(xbee_con*,xbee_pkt**,int), int max, int linger) {
+  return _xbee_batchcallback(default_xbee, con, callback, max, linger);
+}
+int _xbee_batchcallback(xbee_hnd xbee, xbee_con *con, void (*callback)(xbee_con*,xbee_pkt**,int), int max, int linger) {
+  ISREADYR(-1);
+  if (!con || max < 0 || linger < 0) return -1;
+  if (!max) max = XBEE_BATCH_MAX;
+
+  xbee_mutex_lock(con->callbackListmutex);
+  con->batchMax = max;
+  con->batchLinger = linger;
+  con->batchCallback = callback;
+  xbee_cond_signal(con->batchcond);
+  xbee_mutex_unlock(con->callbackListmutex);
+  return 0;
+}
+
 /* #################################################################
    xbee_conflush
    removes any packets that have been collected for the specified
@@ -948,6 +1580,24 @@ void _xbee_purgecon(xbee_hnd xbee, xbee_con *con) {
   xbee_pkt *r, *p, *n;
 
   ISREADYP();
+
+  /* if: it is a subscription, its packets are in its own list */
+  if (con->subscribe) {
+    t_callback_list *l, *m;
+    xbee_mutex_lock(con->callbackListmutex);
+    l = con->subList;
+    con->subList = NULL;
+    xbee_mutex_unlock(con->callbackListmutex);
+    while (l) {
+      m = l->next;
+      xbee_mem_add(xbee, xbee_mem_callback, -1, sizeof(t_callback_list));
+      xbee_mem_pktrelease(xbee, l->pkt);
+      xbee_pkt_unref(l->pkt);
+      Xfree(l);
+      l = m;
+    }
+    return;
+  }
   
   /* lock the packet mutex */
   xbee_mutex_lock(xbee->pktmutex);
@@ -971,6 +1621,7 @@ void _xbee_purgecon(xbee_hnd xbee, xbee_con *con) {
 
         /* free this packet! */
         n = p->next;
+        xbee_mem_pktrelease(xbee, p);
         Xfree(p);
         /* move on */
         p = n;
@@ -1025,13 +1676,14 @@ void _xbee_endcon2(xbee_hnd xbee, xbee_con **con, int alreadyUnlinked) {
     } else {
       u->next = t->next;
     }
+    if (t->subscribe) xbee->subscriptions--;
   }
   
   /* unlock the connection mutex */
   xbee_mutex_unlock(xbee->conmutex);
 
   /* check if a callback thread is running... */
-  if (t->callback && xbee_mutex_trylock(t->callbackmutex)) {
+  if ((t->callback || t->batchCallback) && xbee_mutex_trylock(t->callbackmutex)) {
     /* if it is running... tell it to destroy the connection on completion */
     xbee_log("Attempted to close a connection with active callbacks... "
              "Connection will be destroyed when callbacks have completeted...");
@@ -1045,10 +1697,12 @@ void _xbee_endcon2(xbee_hnd xbee, xbee_con **con, int alreadyUnlinked) {
   /* destroy the callback mutex */
   xbee_mutex_destroy(t->callbackmutex);
   xbee_mutex_destroy(t->callbackListmutex);
+  xbee_cond_destroy(t->batchcond);
   xbee_mutex_destroy(t->Txmutex);
   xbee_sem_destroy(t->waitforACKsem);
 
   /* free the connection! */
+  xbee_mem_add(xbee, xbee_mem_con, -1, sizeof(xbee_con));
   Xfree(*con);
 }
 
@@ -1126,6 +1780,8 @@ int _xbee_nsenddata(xbee_hnd xbee, xbee_con *con, char *data, int length) {
     case xbee_64bitIO:       fprintf(xbee->log,"IO (64-bit)"); break;
     case xbee2_data:         fprintf(xbee->log,"Series 2 Data"); break;
     case xbee2_txStatus:     fprintf(xbee->log,"Series 2 Tx Status"); break;
+    case xbee2_IO:           fprintf(xbee->log,"Series 2 IO"); break;
+    case xbee2_explicit:     fprintf(xbee->log,"Series 2 Explicit"); break;
     case xbee_txStatus:      fprintf(xbee->log,"Tx Status"); break;
     case xbee_modemStatus:   fprintf(xbee->log,"Modem Status"); break;
     }
@@ -1200,6 +1856,9 @@ int _xbee_nsenddata(xbee_hnd xbee, xbee_con *con, char *data, int length) {
       buf[i+13] = data[i];
     }
 
+    /* if this changes a parameter, the cached value is no longer any good */
+    xbee_atcache_written(xbee, con, data, length);
+
     /* setup the packet */
     pkt = xbee_make_pkt(xbee, buf, i+13);
     /* send it on */
@@ -1280,26 +1939,63 @@ int _xbee_nsenddata(xbee_hnd xbee, xbee_con *con, char *data, int length) {
     pkt = xbee_make_pkt(xbee, buf, i+14);
     /* send it on */
     return _xbee_send_pkt(xbee, pkt, con);
-  }
 
-  return -2;
-}
+    /* ########################################## */
+    /* if: Series 2 Explicit */
+  } else if (con->type == xbee2_explicit) {
+    if (length > 72) return -1;
 
-/* #################################################################
-   xbee_getpacket
-   retrieves the next packet destined for the given connection
-   once the packet has been retrieved, it is removed for the list! */
-xbee_pkt *xbee_getpacketwait(xbee_con *con) {
-  return _xbee_getpacketwait(default_xbee, con);
-}
-xbee_pkt *_xbee_getpacketwait(xbee_hnd xbee, xbee_con *con) {
-  xbee_pkt *p = NULL;
-  int i = 20;
+    buf[0] = XBEE2_EXPLICITTX;
+    buf[1] = con->frameID;
 
-  /* 50ms * 20 = 1 second */
-  for (; i; i--) {
-    p = _xbee_getpacket(xbee, con);
-    if (p) break;
+    /* copy in the relevant address */
+    memcpy(&buf[2],con->tAddr,8);
+    buf[10] = 0xFF;
+    buf[11] = 0xFE;
+
+    /* endpoints, cluster and profile */
+    buf[12] = con->srcEndpoint;
+    buf[13] = con->dstEndpoint;
+    buf[14] = (con->clusterID >> 8) & 0xFF;
+    buf[15] = (con->clusterID     ) & 0xFF;
+    buf[16] = (con->profileID >> 8) & 0xFF;
+    buf[17] = (con->profileID     ) & 0xFF;
+
+    /* Maximum Radius/hops */
+    buf[18] = 0x00;
+
+    /* Options */
+    buf[19] = 0x00;
+
+    /* copy in the data */
+    for (i=0;i<length;i++) {
+      buf[i+20] = data[i];
+    }
+
+    /* setup the packet */
+    pkt = xbee_make_pkt(xbee, buf, i+20);
+    /* send it on */
+    return _xbee_send_pkt(xbee, pkt, con);
+  }
+
+  return -2;
+}
+
+/* #################################################################
+   xbee_getpacket
+   retrieves the next packet destined for the given connection
+   once the packet has been retrieved, it is removed for the list! */
+xbee_pkt *xbee_getpacketwait(xbee_con *con) {
+  return _xbee_getpacketwait(default_xbee, con);
+}
+xbee_pkt *_xbee_getpacketwait(xbee_hnd xbee, xbee_con *con) {
+  xbee_pkt *p = NULL;
+  int i = 20;
+
+  /* 50ms * 20 = 1 second */
+  for (; i; i--) {
+    p = _xbee_getpacket(xbee, con);
+    if (p) break;
     usleep(50000); /* 50ms */
   }
 
@@ -1312,6 +2008,21 @@ xbee_pkt *_xbee_getpacket(xbee_hnd xbee, xbee_con *con) {
   xbee_pkt *l, *p, *q;
 
   ISREADYR(NULL);
+
+  /* if: it is a subscription, its packets are in its own list
+     (they are shared, so must be given back with xbee_pkt_unref()) */
+  if (con->subscribe) {
+    t_callback_list *s;
+    xbee_mutex_lock(con->callbackListmutex);
+    if ((s = con->subList) != NULL) con->subList = s->next;
+    xbee_mutex_unlock(con->callbackListmutex);
+    if (!s) return NULL;
+    q = s->pkt;
+    xbee_mem_add(xbee, xbee_mem_callback, -1, sizeof(t_callback_list));
+    xbee_mem_pktrelease(xbee, q);
+    Xfree(s);
+    return q;
+  }
   
   /* lock the packet mutex */
   xbee_mutex_lock(xbee->pktmutex);
@@ -1366,6 +2077,7 @@ xbee_pkt *_xbee_getpacket(xbee_hnd xbee, xbee_con *con) {
     }
   }
   xbee->pktcount--;
+  xbee_mem_pktrelease(xbee, q);
 
   /* unlink this packet from the chain! */
   q->next = NULL;
@@ -1385,129 +2097,2959 @@ xbee_pkt *_xbee_getpacket(xbee_hnd xbee, xbee_con *con) {
   return q;
 }
 
+/* ################################################################# */
+/* ### I/O Sample Sink ############################################# */
+/* ################################################################# */
+
 /* #################################################################
-   xbee_matchpktcon - INTERNAL
-   checks if the packet matches the connection */
-static int xbee_matchpktcon(xbee_hnd xbee, xbee_pkt *pkt, xbee_con *con) {
-  /* if: the connection type matches the packet type OR
-     the connection is 16/64bit remote AT, and the packet is a remote AT response */
-  if ((pkt->type == con->type) || /* -- */
-      ((pkt->type == xbee_remoteAT) && /* -- */
-       ((con->type == xbee_16bitRemoteAT) ||
-        (con->type == xbee_64bitRemoteAT)))) {
+   xbee_iosink
+   records the samples from every I/O packet into a buffer for the node that
+   sent it, holding the most recent 'samples' samples. 0 disables the sink.
+   if passthrough is 0, the I/O packets are not given to any connections.
+   any samples that have already been recorded are thrown away */
+int xbee_iosink(int samples, int passthrough) {
+  return _xbee_iosink(default_xbee, samples, passthrough);
+}
+int _xbee_iosink(xbee_hnd xbee, int samples, int passthrough) {
+  ISREADYR(-1);
+  if (samples < 0) return -1;
 
-    
-    /* if: is a modem status (there can only be 1 modem status connection) */
-    if (pkt->type == xbee_modemStatus) return 1;
+  xbee_mutex_lock(xbee->iosinkmutex);
+  xbee_iosink_free(xbee);
+  xbee->iosinkcap = samples;
+  xbee->iosinkpass = !!passthrough;
+  xbee_mutex_unlock(xbee->iosinkmutex);
 
-    /* if: the packet is a txStatus or localAT and the frameIDs match */
-    if ((pkt->type == xbee_txStatus) ||
-        (pkt->type == xbee_localAT)) {
-      if (pkt->frameID == con->frameID) {
-        return 1;
-      }
-    /* if: the packet was sent as a 16bit remoteAT, and the 16bit addresss match */
-    } else if ((pkt->type == xbee_remoteAT) &&
-               (con->type == xbee_16bitRemoteAT) &&
-               !memcmp(pkt->Addr16,con->tAddr,2)) {
-      return 1;
-    /* if: the packet was sent as a 64bit remoteAT, and the 64bit addresss match */
-    } else if ((pkt->type == xbee_remoteAT) &&
-               (con->type == xbee_64bitRemoteAT) &&
-               !memcmp(pkt->Addr64,con->tAddr,8)) {
-      return 1;
-    /* if: the packet is 64bit addressed, and the addresses match */
-    } else if (pkt->sAddr64 && !memcmp(pkt->Addr64,con->tAddr,8)) {
-      return 1;
-    /* if: the packet is 16bit addressed, and the addresses match */
-    } else if (!pkt->sAddr64 && !memcmp(pkt->Addr16,con->tAddr,2)) {
-      return 1;
-    } else if (con->type == pkt->type && 
-               (con->type == xbee_16bitData || con->type == xbee_64bitData) && 
-               (pkt->isBroadcastADR || pkt->isBroadcastPAN)) {
-      unsigned char t[8] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
-      if ((con->tAddr64 && !memcmp(con->tAddr,t,8)) ||
-          (!con->tAddr64 && !memcmp(con->tAddr,t,2))) {
-        return 1;
+  xbee_log("I/O sink %s (%d samples per node)",(samples?"enabled":"disabled"),samples);
+  return 0;
+}
+
+/* #################################################################
+   xbee_iosink_nodes
+   fills in up to max nodes that the sink has samples for
+   returns the total number of nodes (which may be more than max) */
+int xbee_iosink_nodes(xbee_ionode *nodes, int max) {
+  return _xbee_iosink_nodes(default_xbee, nodes, max);
+}
+int _xbee_iosink_nodes(xbee_hnd xbee, xbee_ionode *nodes, int max) {
+  t_ionode *n;
+  int i, c = 0;
+  ISREADYR(-1);
+
+  xbee_mutex_lock(xbee->iosinkmutex);
+  for (i = 0; i < XBEE_IOSINK_HASH; i++) {
+    for (n = xbee->iosink[i]; n; n = n->next, c++) {
+      if (!nodes || c >= max) continue;
+      memset(&nodes[c], 0, sizeof(xbee_ionode));
+      nodes[c].addr64 = n->addr64;
+      memcpy(nodes[c].addr, n->addr, (n->addr64?8:2));
+      nodes[c].samples = n->count;
+      nodes[c].total = n->total;
+    }
+  }
+  xbee_mutex_unlock(xbee->iosinkmutex);
+
+  return c;
+}
+
+/* #################################################################
+   xbee_iosink_read
+   copies the node's samples (oldest first) into the arrays given in buf
+   if consume is set, the samples copied are removed from the sink
+   returns the number of samples copied, or -1 if the node is unknown */
+int xbee_iosink_read(xbee_ionode *node, xbee_iobuf *buf, int consume) {
+  return _xbee_iosink_read(default_xbee, node, buf, consume);
+}
+int _xbee_iosink_read(xbee_hnd xbee, xbee_ionode *node, xbee_iobuf *buf, int consume) {
+  t_ionode *n;
+  int i, c, tail, first;
+  ISREADYR(-1);
+  if (!node || !buf || buf->len < 0) return -1;
+
+  xbee_mutex_lock(xbee->iosinkmutex);
+  if ((n = xbee_iosink_find(xbee, node->addr64, node->addr, 0)) == NULL) {
+    xbee_mutex_unlock(xbee->iosinkmutex);
+    buf->count = 0;
+    return -1;
+  }
+
+  c = ((n->count < buf->len)?n->count:buf->len);
+
+  /* the samples may wrap around the end of the ring, so copy them in (up to) 2 runs */
+  tail = n->head - n->count;
+  if (tail < 0) tail += xbee->iosinkcap;
+  first = xbee->iosinkcap - tail;
+  if (first > c) first = c;
+
+#define IOSINK_COPY(dst,src)                                                  \
+  if (dst) {                                                                  \
+    memcpy((dst), &(src)[tail], first * sizeof(*(src)));                      \
+    memcpy(&(dst)[first], (src), (c - first) * sizeof(*(src)));               \
+  }
+  IOSINK_COPY(buf->time, n->time);
+  IOSINK_COPY(buf->mask, n->mask);
+  IOSINK_COPY(buf->digital, n->digital);
+  for (i = 0; i < 6; i++) {
+    IOSINK_COPY(buf->analog[i], n->analog[i]);
+  }
+#undef IOSINK_COPY
+
+  if (consume) n->count -= c;
+  node->samples = n->count;
+  node->total = n->total;
+  xbee_mutex_unlock(xbee->iosinkmutex);
+
+  buf->count = c;
+  return c;
+}
+
+/* #################################################################
+   xbee_iosink_free - INTERNAL
+   frees all of the sink's nodes (iosinkmutex must be held) */
+static void xbee_iosink_free(xbee_hnd xbee) {
+  t_ionode *n, *q;
+  int i;
+  for (i = 0; i < XBEE_IOSINK_HASH; i++) {
+    n = xbee->iosink[i];
+    xbee->iosink[i] = NULL;
+    while (n) {
+      q = n->next;
+      Xfree(n->time);
+      Xfree(n);
+      n = q;
+    }
+  }
+  xbee->iosinknodes = 0;
+}
+
+/* #################################################################
+   xbee_iosink_find - INTERNAL
+   finds the node with the given address, creating it if asked to
+   (iosinkmutex must be held) */
+static t_ionode *xbee_iosink_find(xbee_hnd xbee, int addr64, unsigned char *addr, int create) {
+  unsigned int h;
+  int i, len = (addr64?8:2);
+  t_ionode *n;
+  size_t cap;
+
+  h = xbee_hash(addr, len) & (XBEE_IOSINK_HASH - 1);
+
+  for (n = xbee->iosink[h]; n; n = n->next) {
+    if (n->addr64 == !!addr64 && !memcmp(n->addr, addr, len)) return n;
+  }
+  if (!create) return NULL;
+
+  if (xbee->iosinknodes >= XBEE_IOSINK_MAXNODES) {
+    /* only called with create set by the listen thread, which holds the log */
+    xbee_logI("I/O sink is full (%d nodes), dropping samples!",xbee->iosinknodes);
+    return NULL;
+  }
+
+  if ((n = Xcalloc(sizeof(t_ionode))) == NULL) return NULL;
+  n->addr64 = !!addr64;
+  memcpy(n->addr, addr, len);
+
+  /* allocate all of the columns in one go */
+  cap = xbee->iosinkcap;
+  if ((n->time = Xmalloc(cap * (sizeof(unsigned long long) + (sizeof(unsigned short) * 8)))) == NULL) {
+    Xfree(n);
+    return NULL;
+  }
+  n->mask = (unsigned short *)&n->time[cap];
+  n->digital = &n->mask[cap];
+  for (i = 0; i < 6; i++) {
+    n->analog[i] = &n->digital[cap * (i + 1)];
+  }
+
+  n->next = xbee->iosink[h];
+  xbee->iosink[h] = n;
+  xbee->iosinknodes++;
+
+  return n;
+}
+
+/* #################################################################
+   xbee_iosink_add - INTERNAL
+   records the packet's I/O samples in the sink
+   returns 1 if the packet should be passed on to connections, else 0 */
+static int xbee_iosink_add(xbee_hnd xbee, xbee_pkt *p) {
+  unsigned long long now;
+  t_ionode *n;
+  xbee_sample *s;
+  int i, j, h;
+
+  xbee_mutex_lock(xbee->iosinkmutex);
+  if (!xbee->iosinkcap) {
+    xbee_mutex_unlock(xbee->iosinkmutex);
+    return 1;
+  }
+  now = xbee_clock_ns();
+  if ((n = xbee_iosink_find(xbee, p->sAddr64, (p->sAddr64?p->Addr64:p->Addr16), 1)) != NULL) {
+    h = n->head;
+    for (i = 0; i < p->samples; i++) {
+      s = &p->IOdata[i];
+      n->time[h] = now;
+      n->mask[h] = s->IOmask;
+      n->digital[h] = s->IOdigital;
+      for (j = 0; j < 6; j++) {
+        n->analog[j][h] = s->IOanalog[j];
       }
+      if (++h >= xbee->iosinkcap) h = 0;
+    }
+    n->head = h;
+    n->count += p->samples;
+    if (n->count > xbee->iosinkcap) n->count = xbee->iosinkcap;
+    n->total += p->samples;
+  }
+  i = xbee->iosinkpass;
+  xbee_mutex_unlock(xbee->iosinkmutex);
+
+  return i;
+}
+
+/* #################################################################
+   xbee_hash - INTERNAL
+   FNV-1a hash of the given bytes */
+static unsigned int xbee_hash(const unsigned char *data, int len) {
+  unsigned int h = 2166136261u;
+  int i;
+  for (i = 0; i < len; i++) {
+    h = (h ^ data[i]) * 16777619u;
+  }
+  return h;
+}
+
+/* ################################################################# */
+/* ### Node Table ################################################## */
+/* ################################################################# */
+
+/* #################################################################
+   xbee_nodelist
+   fills in up to max of the nodes that have been discovered
+   returns the total number of nodes (which may be more than max) */
+int xbee_nodelist(xbee_node *nodes, int max) {
+  return _xbee_nodelist(default_xbee, nodes, max);
+}
+int _xbee_nodelist(xbee_hnd xbee, xbee_node *nodes, int max) {
+  t_node *n;
+  int i, c = 0;
+  ISREADYR(-1);
+
+  xbee_mutex_lock(xbee->nodemutex);
+  for (i = 0; i < XBEE_NODE_HASH; i++) {
+    for (n = xbee->nodes64[i]; n; n = n->next64, c++) {
+      if (nodes && c < max) nodes[c] = n->info;
+    }
+  }
+  xbee_mutex_unlock(xbee->nodemutex);
+
+  return c;
+}
+
+/* #################################################################
+   xbee_getnode64
+   looks up a node by its 64-bit address
+   returns 0 and fills in node if it is known, else -1 */
+int xbee_getnode64(unsigned char *addr64, xbee_node *node) {
+  return _xbee_getnode64(default_xbee, addr64, node);
+}
+int _xbee_getnode64(xbee_hnd xbee, unsigned char *addr64, xbee_node *node) {
+  t_node *n;
+  ISREADYR(-1);
+  if (!addr64) return -1;
+
+  xbee_mutex_lock(xbee->nodemutex);
+  for (n = xbee->nodes64[xbee_hash(addr64, 8) & (XBEE_NODE_HASH - 1)]; n; n = n->next64) {
+    if (!memcmp(n->info.Addr64, addr64, 8)) break;
+  }
+  if (n && node) *node = n->info;
+  xbee_mutex_unlock(xbee->nodemutex);
+
+  return (n?0:-1);
+}
+
+/* #################################################################
+   xbee_getnode16
+   looks up a node by its 16-bit address
+   returns 0 and fills in node if it is known, else -1 */
+int xbee_getnode16(unsigned char *addr16, xbee_node *node) {
+  return _xbee_getnode16(default_xbee, addr16, node);
+}
+int _xbee_getnode16(xbee_hnd xbee, unsigned char *addr16, xbee_node *node) {
+  t_node *n;
+  ISREADYR(-1);
+  if (!addr16) return -1;
+
+  xbee_mutex_lock(xbee->nodemutex);
+  for (n = xbee->nodes16[xbee_hash(addr16, 2) & (XBEE_NODE_HASH - 1)]; n; n = n->next16) {
+    if (!memcmp(n->info.Addr16, addr16, 2)) break;
+  }
+  if (n && node) *node = n->info;
+  xbee_mutex_unlock(xbee->nodemutex);
+
+  return (n?0:-1);
+}
+
+/* #################################################################
+   xbee_getnodeNI
+   looks up a node by its node identifier, if more than one node has the
+   same NI then the one that was most recently seen is given
+   returns 0 and fills in node if it is known, else -1 */
+int xbee_getnodeNI(const char *NI, xbee_node *node) {
+  return _xbee_getnodeNI(default_xbee, NI, node);
+}
+int _xbee_getnodeNI(xbee_hnd xbee, const char *NI, xbee_node *node) {
+  t_node *n;
+  ISREADYR(-1);
+  if (!NI || !NI[0]) return -1;
+
+  xbee_mutex_lock(xbee->nodemutex);
+  for (n = xbee->nodesNI[xbee_hash((const unsigned char *)NI, strlen(NI)) & (XBEE_NODE_HASH - 1)]; n; n = n->nextNI) {
+    if (!strcmp(n->info.NI, NI)) break;
+  }
+  if (n && node) *node = n->info;
+  xbee_mutex_unlock(xbee->nodemutex);
+
+  return (n?0:-1);
+}
+
+/* #################################################################
+   xbee_node_free - INTERNAL
+   frees all of the nodes in the table (nodemutex must be held) */
+static void xbee_node_free(xbee_hnd xbee) {
+  t_node *n, *q;
+  int i;
+  for (i = 0; i < XBEE_NODE_HASH; i++) {
+    n = xbee->nodes64[i];
+    xbee->nodes64[i] = NULL;
+    xbee->nodes16[i] = NULL;
+    xbee->nodesNI[i] = NULL;
+    while (n) {
+      q = n->next64;
+      Xfree(n);
+      n = q;
+    }
+  }
+  xbee->nodecount = 0;
+}
+
+/* #################################################################
+   xbee_node_parse - INTERNAL
+   parses a node description, as given by an ND response or a 0x95 frame
+   (starting at the 16-bit address). Series 1 modules give:
+     MY(2) SH(4) SL(4) dB(1) NI(\0)
+   ZigBee modules give:
+     MY(2) SH(4) SL(4) NI(\0) parent(2) device type(1) status(1) profile(2) manufacturer(2)
+   if zigbee is set, only the ZigBee layout is accepted
+   returns 0 on success, or -1 if it doesn't look like either */
+static int xbee_node_parse(xbee_node *n, unsigned char *d, int len, int zigbee) {
+  int i;
+
+  if (len < 11) return -1;
+  memset(n, 0, sizeof(xbee_node));
+  n->Addr16[0] = d[0];
+  n->Addr16[1] = d[1];
+  memcpy(n->Addr64, &d[2], 8);
+
+  /* find the end of a ZigBee NI, the fixed fields follow it */
+  for (i = 10; i < len && d[i]; i++);
+  if (i + 9 == len) {
+    if (i - 10 >= (int)sizeof(n->NI)) return -1;
+    memcpy(n->NI, &d[10], i - 10);
+    n->parent[0] = d[i + 1];
+    n->parent[1] = d[i + 2];
+    n->deviceType = d[i + 3];
+    n->RSSI = -1;
+    return 0;
+  }
+  if (zigbee) return -1;
+
+  /* otherwise it should be a Series 1 response, where the NI may not be terminated */
+  for (i = 11; i < len && d[i]; i++);
+  if (i - 11 >= (int)sizeof(n->NI)) return -1;
+  memcpy(n->NI, &d[11], i - 11);
+  n->parent[0] = 0xFF;
+  n->parent[1] = 0xFE;
+  n->deviceType = -1;
+  n->RSSI = d[10];
+  return 0;
+}
+
+/* #################################################################
+   xbee_node_update - INTERNAL
+   adds the node to the table, or updates the entry that has the same
+   64-bit address. only called by the listen thread, which holds the log */
+static void xbee_node_update(xbee_hnd xbee, xbee_node *info) {
+  t_node *n;
+  unsigned int h;
+
+  info->lastSeen = xbee_clock_ns();
+
+  xbee_mutex_lock(xbee->nodemutex);
+  h = xbee_hash(info->Addr64, 8) & (XBEE_NODE_HASH - 1);
+  for (n = xbee->nodes64[h]; n; n = n->next64) {
+    if (!memcmp(n->info.Addr64, info->Addr64, 8)) break;
+  }
+
+  if (!n) {
+    if (xbee->nodecount >= XBEE_NODE_MAXNODES) {
+      xbee_mutex_unlock(xbee->nodemutex);
+      xbee_logI("Node table is full (%d nodes), not adding node!",xbee->nodecount);
+      return;
+    }
+    if ((n = Xcalloc(sizeof(t_node))) == NULL) {
+      xbee_mutex_unlock(xbee->nodemutex);
+      xbee_logI("Unable to allocate a node, not adding node!");
+      return;
     }
+    n->next64 = xbee->nodes64[h];
+    xbee->nodes64[h] = n;
+    xbee->nodecount++;
+    xbee_logI("New node: %s",info->NI);
+    /* let the discovery thread know, so that it can announce the node */
+    if (xbee->discoverrun) xbee_sem_post(xbee->discoversem);
+  } else {
+    /* it is relinked below in case the 16-bit address or NI have changed */
+    xbee_node_unlink(xbee, n, 0);
+  }
+  n->info = *info;
+  n->missed = 0;
+
+  /* 0xFFFE is 'unknown', so don't index by it */
+  if ((n->in16 = !(n->info.Addr16[0] == 0xFF && n->info.Addr16[1] == 0xFE)) != 0) {
+    h = xbee_hash(n->info.Addr16, 2) & (XBEE_NODE_HASH - 1);
+    n->next16 = xbee->nodes16[h];
+    xbee->nodes16[h] = n;
+  }
+  if ((n->inNI = (n->info.NI[0] != '\0')) != 0) {
+    h = xbee_hash((unsigned char *)n->info.NI, strlen(n->info.NI)) & (XBEE_NODE_HASH - 1);
+    n->nextNI = xbee->nodesNI[h];
+    xbee->nodesNI[h] = n;
+  }
+  xbee_mutex_unlock(xbee->nodemutex);
+}
+
+/* #################################################################
+   xbee_node_unlink - INTERNAL
+   removes the node from the 16-bit and NI chains, and from the 64-bit chain
+   too if all is set (nodemutex must be held) */
+static void xbee_node_unlink(xbee_hnd xbee, t_node *n, int all) {
+  t_node **pn;
+  unsigned int h;
+
+  if (n->in16) {
+    h = xbee_hash(n->info.Addr16, 2) & (XBEE_NODE_HASH - 1);
+    for (pn = &xbee->nodes16[h]; *pn != n; pn = &(*pn)->next16);
+    *pn = n->next16;
+    n->in16 = 0;
   }
+  if (n->inNI) {
+    h = xbee_hash((unsigned char *)n->info.NI, strlen(n->info.NI)) & (XBEE_NODE_HASH - 1);
+    for (pn = &xbee->nodesNI[h]; *pn != n; pn = &(*pn)->nextNI);
+    *pn = n->nextNI;
+    n->inNI = 0;
+  }
+  if (all) {
+    h = xbee_hash(n->info.Addr64, 8) & (XBEE_NODE_HASH - 1);
+    for (pn = &xbee->nodes64[h]; *pn != n; pn = &(*pn)->next64);
+    *pn = n->next64;
+  }
+}
+
+/* ################################################################# */
+/* ### Background Discovery ######################################## */
+/* ################################################################# */
+
+/* #################################################################
+   xbee_discover
+   starts a thread that sends ND requests in the background, keeping the node
+   table up to date. nodes that miss XBEE_DISCOVER_MISSES rounds in a row are
+   removed from the table. the callback (which may be NULL) is given each node
+   as it joins or leaves.
+   the time between rounds starts at minInterval ms, and is halved whenever a
+   round sees a node join or leave, or doubled (up to maxInterval ms) when
+   nothing changes. a minInterval of 0 stops the thread */
+int xbee_discover(int minInterval, int maxInterval, void (*callback)(xbee_node *node, int event)) {
+  return _xbee_discover(default_xbee, minInterval, maxInterval, callback);
+}
+int _xbee_discover(xbee_hnd xbee, int minInterval, int maxInterval, void (*callback)(xbee_node *node, int event)) {
+  ISREADYR(-1);
+  if (minInterval < 0 || (minInterval && maxInterval < minInterval)) return -1;
+
+  /* stop the current thread, if there is one */
+  xbee_discover_stop(xbee);
+  if (!minInterval) return 0;
+
+  xbee->discovermin = minInterval;
+  xbee->discovermax = maxInterval;
+  xbee->discoverinterval = minInterval;
+  xbee->discovercb = callback;
+
+  /* the requests are sent on a private connection with a frame ID that nothing
+     else is using, so the responses are never given to the application's
+     connections (see xbee_listen()) */
+  if ((xbee->discovercon = Xcalloc(sizeof(xbee_con))) == NULL) return -1;
+  if ((xbee->discoverframe = xbee_frame_alloc(xbee)) == -1) {
+    xbee_log("No free frame ID for background discovery");
+    Xfree(xbee->discovercon);
+    return -1;
+  }
+  xbee->discovercon->type = xbee_localAT;
+  xbee->discovercon->frameID = xbee->discoverframe;
+  xbee_mutex_init(xbee->discovercon->Txmutex);
+
+  xbee->discoverrun = 1;
+  if (xbee_thread_create(xbee->discovert, xbee_discover_thread, xbee)) {
+    xbee_perror("xbee_discover():xbee_thread_create()");
+    xbee->discoverrun = 0;
+    xbee_frame_free(xbee, xbee->discoverframe);
+    xbee_mutex_destroy(xbee->discovercon->Txmutex);
+    Xfree(xbee->discovercon);
+    return -1;
+  }
+
+  xbee_log("Background discovery started (every %d - %d ms)",minInterval,maxInterval);
   return 0;
 }
 
 /* #################################################################
-   xbee_parse_io - INTERNAL
-   parses the data given into the packet io information */
-static int xbee_parse_io(xbee_hnd xbee, xbee_pkt *p, unsigned char *d,
-                         int maskOffset, int sampleOffset, int sample) {
-  xbee_sample *s = &(p->IOdata[sample]);
+   xbee_discover_stop - INTERNAL
+   stops the discovery thread and waits for it to finish */
+static void xbee_discover_stop(xbee_hnd xbee) {
+  if (!xbee->discoverrun) return;
+  xbee->discoverrun = 0;
+  xbee_sem_post(xbee->discoversem);
+  xbee_thread_join(xbee->discovert);
+  xbee_frame_free(xbee, xbee->discoverframe);
+  xbee_mutex_destroy(xbee->discovercon->Txmutex);
+  Xfree(xbee->discovercon);
+  xbee_log("Background discovery stopped");
+}
+
+/* #################################################################
+   xbee_discover_thread - INTERNAL
+   runs the discovery rounds */
+static void xbee_discover_thread(xbee_hnd xbee) {
+  unsigned char buf[4] = { XBEE_LOCAL_ATREQ, 0, 'N', 'D' };
+  unsigned long long start, end, now;
+  int churn = 0;
+
+  buf[1] = xbee->discoverframe;
+
+  while (xbee->discoverrun) {
+    /* start a round... any joins are given to the callback as they are found */
+    xbee->discoverdone = 0;
+    start = xbee_clock_ns();
+    _xbee_send_pkt(xbee, xbee_make_pkt(xbee, buf, 4), xbee->discovercon);
+    end = start + (XBEE_DISCOVER_TIMEOUT * 1000000ULL);
+    while (xbee->discoverrun && !xbee->discoverdone && (now = xbee_clock_ns()) < end) {
+      xbee_sem_waitms(xbee->discoversem, (int)((end - now) / 1000000) + 1);
+      churn += xbee_discover_events(xbee, 0);
+    }
+    if (!xbee->discoverrun) break;
+
+    /* the round is over, anything that didn't answer has missed it */
+    churn += xbee_discover_events(xbee, start);
+
+    /* adapt the interval to how busy the network is */
+    if (churn) {
+      xbee->discoverinterval /= 2;
+      if (xbee->discoverinterval < xbee->discovermin) xbee->discoverinterval = xbee->discovermin;
+    } else {
+      xbee->discoverinterval *= 2;
+      if (xbee->discoverinterval > xbee->discovermax) xbee->discoverinterval = xbee->discovermax;
+    }
+    xbee_log("Discovery round complete (%d changes), next in %d ms",churn,xbee->discoverinterval);
+    churn = 0;
+
+    /* wait for the next round, nodes may still join (0x95) in the mean time */
+    end = xbee_clock_ns() + (xbee->discoverinterval * 1000000ULL);
+    while (xbee->discoverrun && (now = xbee_clock_ns()) < end) {
+      xbee_sem_waitms(xbee->discoversem, (int)((end - now) / 1000000) + 1);
+      churn += xbee_discover_events(xbee, 0);
+    }
+  }
+}
+
+/* #################################################################
+   xbee_discover_events - INTERNAL
+   gives any new nodes to the discovery callback. if roundStart is given, the
+   nodes that haven't been seen since then have missed a round, and are
+   removed if they have missed too many
+   returns the number of nodes that joined or left */
+static int xbee_discover_events(xbee_hnd xbee, unsigned long long roundStart) {
+  t_node *n, *q;
+  xbee_node *ev = NULL;
+  int *evtype = NULL;
+  int i, c = 0, max;
+
+  xbee_mutex_lock(xbee->nodemutex);
+  /* there can't be more events than nodes */
+  if ((max = xbee->nodecount) > 0) {
+    ev = Xmalloc(sizeof(xbee_node) * max);
+    evtype = Xmalloc(sizeof(int) * max);
+    if (!ev || !evtype) {
+      /* try again next time */
+      xbee_mutex_unlock(xbee->nodemutex);
+      Xfree(ev);
+      Xfree(evtype);
+      return 0;
+    }
+  }
+  for (i = 0; i < XBEE_NODE_HASH; i++) {
+    for (n = xbee->nodes64[i]; n; n = q) {
+      q = n->next64;
+      if (roundStart && n->info.lastSeen < roundStart &&
+          ++n->missed >= XBEE_DISCOVER_MISSES) {
+        /* it has gone */
+        if (n->announced) {
+          ev[c] = n->info;
+          evtype[c++] = XBEE_NODE_LEAVE;
+        }
+        xbee_node_unlink(xbee, n, 1);
+        xbee->nodecount--;
+        Xfree(n);
+        continue;
+      }
+      if (!n->announced) {
+        n->announced = 1;
+        ev[c] = n->info;
+        evtype[c++] = XBEE_NODE_JOIN;
+      }
+    }
+  }
+  xbee_mutex_unlock(xbee->nodemutex);
+
+  /* the callback is run without the lock held, so it may use the node table */
+  for (i = 0; i < c; i++) {
+    xbee_log("Node %s: %s",((evtype[i] == XBEE_NODE_JOIN)?"joined":"left"),ev[i].NI);
+    if (xbee->discovercb) xbee->discovercb(&ev[i], evtype[i]);
+  }
+  if (ev) Xfree(ev);
+  if (evtype) Xfree(evtype);
+
+  return c;
+}
+
+/* ################################################################# */
+/* ### Remote AT Cache ############################################# */
+/* ################################################################# */
+
+/* #################################################################
+   xbee_atcache_get
+   reads a parameter (e.g. "NI") from the node that con points at. if the
+   value was read less than ttl ms ago it is given straight from the cache,
+   otherwise it is requested. if the parameter is already being requested by
+   another thread, this will wait for that request rather than send another.
+   con must be a xbee_64bitRemoteAT connection
+   returns the length of the value (which is copied into value, up to maxlen
+   bytes), -1 on error or timeout, or -2 if the node rejected the command */
+int xbee_atcache_get(xbee_con *con, char *cmd, int ttl, unsigned char *value, int maxlen) {
+  return _xbee_atcache_get(default_xbee, con, cmd, ttl, value, maxlen);
+}
+int _xbee_atcache_get(xbee_hnd xbee, xbee_con *con, char *cmd, int ttl, unsigned char *value, int maxlen) {
+  unsigned long long now, end;
+  unsigned char buf[15];
+  unsigned long seq;
+  t_atcache *e;
+  int ret;
+  ISREADYR(-1);
+  if (!con || !cmd || !cmd[0] || !cmd[1] || ttl < 0 || maxlen < 0) return -1;
+  if (con->type != xbee_64bitRemoteAT) return -1;
+  /* IS gives a sample rather than a parameter, so there is nothing to cache */
+  if (cmd[0] == 'I' && cmd[1] == 'S') return -1;
+
+  xbee_mutex_lock(xbee->atcachemutex);
+  if ((e = xbee_atcache_find(xbee, con->tAddr, (unsigned char *)cmd, 1)) == NULL) {
+    xbee_mutex_unlock(xbee->atcachemutex);
+    /* the log can't be used while atcachemutex is held, the listen thread takes them the other way around */
+    xbee_log("AT cache is full (%d parameters being requested), asking the node directly",XBEE_ATCACHE_MAX);
+    return xbee_atcache_direct(xbee, con, cmd, value, maxlen);
+  }
+  now = xbee_clock_ns();
+
+  /* if: the cached value is fresh enough */
+  if (e->state == XBEE_ATC_VALID && now - e->fetched <= ttl * 1000000ULL) {
+    ret = ((e->len < maxlen)?e->len:maxlen);
+    if (value) memcpy(value, e->value, ret);
+    xbee_mutex_unlock(xbee->atcachemutex);
+    return ret;
+  }
+  e->users++;
+
+  /* if: nobody is already asking for it, send the request */
+  seq = e->seq;
+  if (e->state != XBEE_ATC_PENDING) {
+    e->state = XBEE_ATC_PENDING;
+    e->stale = 0;
+    xbee_mutex_unlock(xbee->atcachemutex);
+
+    buf[0] = XBEE_REMOTE_ATREQ;
+    buf[1] = XBEE_ATCACHE_FRAMEID;
+    memcpy(&buf[2],con->tAddr,8);
+    buf[10] = 0xFF;
+    buf[11] = 0xFE;
+    buf[12] = 0x02;
+    buf[13] = cmd[0];
+    buf[14] = cmd[1];
+    xbee_log("Requesting %c%c for the AT cache",cmd[0],cmd[1]);
+    _xbee_send_pkt(xbee, xbee_make_pkt(xbee, buf, 15), con);
+
+    xbee_mutex_lock(xbee->atcachemutex);
+  }
+
+  /* wait for the request to complete (e can't be freed while it is pending) */
+  end = now + (XBEE_ATCACHE_TIMEOUT * 1000000ULL);
+  while (e->seq == seq && (now = xbee_clock_ns()) < end) {
+    xbee_cond_timedwait(xbee->atcachecond, xbee->atcachemutex, (int)((end - now) / 1000000) + 1);
+  }
+
+  if (e->seq == seq) {
+    /* timed out... let the next reader try again */
+    e->state = XBEE_ATC_EMPTY;
+    ret = -1;
+  } else if (e->status) {
+    ret = -2;
+  } else {
+    ret = ((e->len < maxlen)?e->len:maxlen);
+    if (value) memcpy(value, e->value, ret);
+  }
+  e->users--;
+  xbee_mutex_unlock(xbee->atcachemutex);
+
+  if (ret == -1) xbee_log("AT cache request for %c%c timed out",cmd[0],cmd[1]);
+  return ret;
+}
+
+/* #################################################################
+   xbee_atcache_direct - INTERNAL
+   reads a parameter without the cache, for when every entry is being requested
+   returns the same as xbee_atcache_get() */
+static int xbee_atcache_direct(xbee_hnd xbee, xbee_con *con, char *cmd, unsigned char *value, int maxlen) {
+  unsigned char buf[15];
+  xbee_pkt *p;
+  int id, ret;
+
+  if ((id = xbee_frame_alloc(xbee)) == -1) return -1;
+  buf[0] = XBEE_REMOTE_ATREQ;
+  buf[1] = id;
+  memcpy(&buf[2],con->tAddr,8);
+  buf[10] = 0xFF;
+  buf[11] = 0xFE;
+  buf[12] = 0x02;
+  buf[13] = cmd[0];
+  buf[14] = cmd[1];
+  if (_xbee_send_pkt(xbee, xbee_make_pkt(xbee, buf, 15), con) ||
+      (p = xbee_frame_wait(xbee, id, XBEE_ATCACHE_TIMEOUT)) == NULL) {
+    xbee_frame_free(xbee, id);
+    xbee_log("Request for %c%c timed out",cmd[0],cmd[1]);
+    return -1;
+  }
+  xbee_frame_free(xbee, id);
+
+  if (p->status) {
+    ret = -2;
+  } else {
+    ret = ((p->datalen < maxlen)?p->datalen:maxlen);
+    if (value) memcpy(value, p->data, ret);
+  }
+  Xfree(p);
+  return ret;
+}
+
+/* #################################################################
+   xbee_atcache_flush
+   throws away the cached parameters for the node that con points at,
+   or for every node if con is NULL */
+void xbee_atcache_flush(xbee_con *con) {
+  _xbee_atcache_flush(default_xbee, con);
+}
+void _xbee_atcache_flush(xbee_hnd xbee, xbee_con *con) {
+  t_atcache *e, **l;
+  int i;
+  ISREADYP();
+
+  xbee_mutex_lock(xbee->atcachemutex);
+  for (i = 0; i < XBEE_ATCACHE_HASH; i++) {
+    for (l = &xbee->atcache[i]; (e = *l) != NULL; ) {
+      if (con && (!con->tAddr64 || memcmp(e->key, con->tAddr, 8))) {
+        l = &e->next;
+      } else if (e->state == XBEE_ATC_PENDING || e->users) {
+        e->stale = 1;
+        l = &e->next;
+      } else {
+        /* nobody is using it, so it is freed rather than left taking up room */
+        *l = e->next;
+        Xfree(e);
+        xbee->atcachecount--;
+      }
+    }
+  }
+  xbee_mutex_unlock(xbee->atcachemutex);
+}
+
+/* #################################################################
+   xbee_atcache_free - INTERNAL
+   frees the whole cache (atcachemutex must be held) */
+static void xbee_atcache_free(xbee_hnd xbee) {
+  t_atcache *e, *q;
+  int i;
+  for (i = 0; i < XBEE_ATCACHE_HASH; i++) {
+    e = xbee->atcache[i];
+    xbee->atcache[i] = NULL;
+    while (e) {
+      q = e->next;
+      Xfree(e);
+      e = q;
+    }
+  }
+  xbee->atcachecount = 0;
+}
+
+/* #################################################################
+   xbee_atcache_find - INTERNAL
+   finds the entry for the node's parameter, creating it if asked to
+   (atcachemutex must be held) */
+static t_atcache *xbee_atcache_find(xbee_hnd xbee, unsigned char *addr, unsigned char *cmd, int create) {
+  unsigned char key[10];
+  unsigned int h;
+  t_atcache *e;
+
+  memcpy(key, addr, 8);
+  key[8] = cmd[0];
+  key[9] = cmd[1];
+  h = xbee_hash(key, 10) & (XBEE_ATCACHE_HASH - 1);
+
+  for (e = xbee->atcache[h]; e; e = e->next) {
+    if (!memcmp(e->key, key, 10)) {
+      if (create) e->used = xbee_clock_ns();
+      return e;
+    }
+  }
+  if (!create) return NULL;
+
+  if (xbee->atcachecount >= XBEE_ATCACHE_MAX) {
+    /* the cache is full, so replace the entry that was looked up longest ago
+       (empty ones first)... unless all of them are being requested */
+    if ((e = xbee_atcache_evict(xbee)) == NULL) return NULL;
+    memset(e, 0, sizeof(t_atcache));
+  } else {
+    if ((e = Xcalloc(sizeof(t_atcache))) == NULL) return NULL;
+    xbee->atcachecount++;
+  }
+  memcpy(e->key, key, 10);
+  e->used = xbee_clock_ns();
+  e->next = xbee->atcache[h];
+  xbee->atcache[h] = e;
+
+  return e;
+}
+
+/* #################################################################
+   xbee_atcache_evict - INTERNAL
+   unlinks the entry that is best replaced, and returns it (or NULL if every
+   entry is in use). atcachemutex must be held */
+static t_atcache *xbee_atcache_evict(xbee_hnd xbee) {
+  t_atcache *e, **l, **best;
+  int i;
+
+  best = NULL;
+  for (i = 0; i < XBEE_ATCACHE_HASH; i++) {
+    for (l = &xbee->atcache[i]; (e = *l) != NULL; l = &e->next) {
+      if (e->state == XBEE_ATC_PENDING || e->users) continue;
+      if (!best ||
+          (e->state == XBEE_ATC_EMPTY && (*best)->state != XBEE_ATC_EMPTY) ||
+          ((e->state == XBEE_ATC_EMPTY) == ((*best)->state == XBEE_ATC_EMPTY) && e->used < (*best)->used)) {
+        best = l;
+      }
+    }
+  }
+  if (!best) return NULL;
+
+  e = *best;
+  *best = e->next;
+  return e;
+}
+
+/* #################################################################
+   xbee_atcache_response - INTERNAL
+   completes a pending request with the remote AT response
+   returns 1 if the packet was for the cache, else 0 */
+static int xbee_atcache_response(xbee_hnd xbee, xbee_pkt *p) {
+  t_atcache *e;
+
+  xbee_mutex_lock(xbee->atcachemutex);
+  if ((e = xbee_atcache_find(xbee, p->Addr64, p->atCmd, 0)) == NULL ||
+      e->state != XBEE_ATC_PENDING) {
+    xbee_mutex_unlock(xbee->atcachemutex);
+    return 0;
+  }
+  e->status = p->status;
+  e->len = p->datalen;
+  memcpy(e->value, p->data, p->datalen);
+  e->fetched = xbee_clock_ns();
+  /* if the parameter was written while this was in flight, the value may be out of date */
+  e->state = ((!p->status && !e->stale)?XBEE_ATC_VALID:XBEE_ATC_EMPTY);
+  e->seq++;
+  xbee_cond_broadcast(xbee->atcachecond);
+  xbee_mutex_unlock(xbee->atcachemutex);
+
+  return 1;
+}
+
+/* #################################################################
+   xbee_atcache_written - INTERNAL
+   called whenever a remote AT command is sent, if it sets a parameter then
+   the cached value is thrown away (RE throws away all of the node's values) */
+static void xbee_atcache_written(xbee_hnd xbee, xbee_con *con, char *data, int length) {
+  xbee_node node;
+  unsigned char *addr;
+  t_atcache *e;
+  int i, all;
+
+  all = (data[0] == 'R' && data[1] == 'E');
+  if (length <= 2 && !all) return;
+
+  /* the cache is keyed by 64-bit address, so try to find it for a 16-bit connection */
+  addr = NULL;
+  if (con->tAddr64) {
+    addr = con->tAddr;
+  } else if (!_xbee_getnode16(xbee, con->tAddr, &node)) {
+    addr = node.Addr64;
+  }
+
+  xbee_mutex_lock(xbee->atcachemutex);
+  for (i = 0; i < XBEE_ATCACHE_HASH; i++) {
+    for (e = xbee->atcache[i]; e; e = e->next) {
+      /* if the node isn't known, the parameter is thrown away for every node */
+      if (addr && memcmp(e->key, addr, 8)) continue;
+      if (!all && (e->key[8] != data[0] || e->key[9] != data[1])) continue;
+      if (e->state == XBEE_ATC_PENDING) {
+        e->stale = 1;
+      } else {
+        e->state = XBEE_ATC_EMPTY;
+      }
+    }
+  }
+  xbee_mutex_unlock(xbee->atcachemutex);
+}
+
+/* ################################################################# */
+/* ### Frame Filters ############################################### */
+/* ################################################################# */
+
+/* #################################################################
+   xbee_setfilter
+   sets the rules that recieved data and I/O frames are checked against
+   before they are decoded. the first rule that matches a frame decides
+   if it is accepted or rejected, if none match defaultAction is used.
+   rejected frames are dropped without being decoded or allocated.
+   giving no rules removes the filter. returns 0 on success or -1 if a
+   rule is invalid */
+int xbee_setfilter(xbee_filter *rules, int count, int defaultAction) {
+  return _xbee_setfilter(default_xbee, rules, count, defaultAction);
+}
+int _xbee_setfilter(xbee_hnd xbee, xbee_filter *rules, int count, int defaultAction) {
+  unsigned char buf[64];
+  t_filterset *f, *o;
+  int i;
+  ISREADYR(-1);
+  if (xbee_filter_compile(xbee, rules, count, defaultAction, &f)) return -1;
+
+  /* the listen thread picks the new set up before the next frame */
+  xbee_mutex_lock(xbee->filtermutex);
+  o = xbee->filternext;
+  xbee->filternext = f;
+  xbee->filterchanged = 1;
+  xbee_mutex_unlock(xbee->filtermutex);
+  xbee_filter_setfree(o);
+
+  /* a frame server checks the rules too, so that it only sends what is wanted.
+     if there are too many for it, it sends everything */
+  if (xbee->client) {
+    if (count > XBEE_SERVE_MAXRULES) {
+      count = 0;
+      defaultAction = XBEE_FILTER_ACCEPT;
+    }
+    buf[0] = XBEE_SERVE_SETFILTER;
+    i = 0;
+    do {
+      _xbee_send_pkt(xbee, xbee_make_pkt(xbee, buf, 1 + xbee_serve_putrule(&buf[1], rules, count, defaultAction, i)), NULL);
+    } while (++i < count);
+  }
+
+  return 0;
+}
+
+/* #################################################################
+   xbee_filter_rejected
+   returns the number of frames that have been rejected by the filter */
+unsigned long xbee_filter_rejected(void) {
+  return _xbee_filter_rejected(default_xbee);
+}
+unsigned long _xbee_filter_rejected(xbee_hnd xbee) {
+  ISREADYR(0);
+  return xbee->filterrejected;
+}
+
+/* #################################################################
+   xbee_filter_apitype - INTERNAL
+   returns the API identifier for a filter type index */
+static int xbee_filter_apitype(int k) {
+  static const unsigned char types[XBEE_FILTER_TYPES] = {
+    XBEE_64BIT_DATARX, XBEE_16BIT_DATARX, XBEE_64BIT_IO, XBEE_16BIT_IO,
+    XBEE2_DATARX, XBEE2_EXPLICITRX, XBEE2_IO
+  };
+  return types[k];
+}
+
+/* #################################################################
+   xbee_filter_type - INTERNAL
+   returns the filter type index for an API identifier, or -1 if that type is
+   never filtered. the offsets of the 16-bit address, RSSI and payload in the
+   frame (after the API identifier) are given if the pointers aren't NULL
+   (-1 if the frame doesn't have that field) */
+static int xbee_filter_type(unsigned char t, int *addr16, int *rssi, int *payload) {
+  int k, a, r, p;
+  switch (t) {
+  case XBEE_64BIT_DATARX: k = 0; a = -1; r = 8;  p = 10; break;
+  case XBEE_16BIT_DATARX: k = 1; a = 0;  r = 2;  p = 4;  break;
+  case XBEE_64BIT_IO:     k = 2; a = -1; r = 8;  p = 10; break;
+  case XBEE_16BIT_IO:     k = 3; a = 0;  r = 2;  p = 4;  break;
+  case XBEE2_DATARX:      k = 4; a = 8;  r = -1; p = 11; break;
+  case XBEE2_EXPLICITRX:  k = 5; a = 8;  r = -1; p = 17; break;
+  case XBEE2_IO:          k = 6; a = 8;  r = -1; p = 11; break;
+  default: return -1;
+  }
+  if (addr16) *addr16 = a;
+  if (rssi) *rssi = r;
+  if (payload) *payload = p;
+  return k;
+}
+
+/* #################################################################
+   xbee_filter_compile - INTERNAL
+   checks the rules given to xbee_setfilter(), and works out where the fields of
+   each are in the frame types they can match. set is given NULL if nothing would
+   be filtered. returns 0 on success or -1 if a rule is invalid (or memory ran out) */
+static int xbee_filter_compile(xbee_hnd xbee, xbee_filter *rules, int count, int defaultAction, t_filterset **set) {
+  t_filterset *f;
+  t_filterrule *r;
+  int i, k, addr16, rssi, payload;
+  if (count < 0 || (count && !rules)) return -1;
+  if (defaultAction != XBEE_FILTER_ACCEPT && defaultAction != XBEE_FILTER_REJECT) return -1;
+  for (i = 0; i < count; i++) {
+    if (rules[i].action != XBEE_FILTER_ACCEPT && rules[i].action != XBEE_FILTER_REJECT) return -1;
+    if (rules[i].apiType < -1 || rules[i].apiType > 0xFF) return -1;
+    if (rules[i].addrLen != 0 && rules[i].addrLen != 2 && rules[i].addrLen != 8) return -1;
+    if (rules[i].RSSI < 0 || rules[i].RSSI > 0xFF) return -1;
+    if (rules[i].offset < 0 || rules[i].offset > 0xFFFF) return -1;
+    if (rules[i].matchLen < 0 || rules[i].matchLen > (int)sizeof(rules[i].match)) return -1;
+  }
+
+  f = NULL;
+  if (count || defaultAction != XBEE_FILTER_ACCEPT) {
+    /* each frame type gets the rules that can match it, with the offsets of the fields worked out */
+    if ((f = Xcalloc(sizeof(t_filterset))) == NULL) return -1;
+    f->defaultAction = defaultAction;
+    for (k = 0; k < XBEE_FILTER_TYPES; k++) {
+      if ((f->rules[k] = Xcalloc(sizeof(t_filterrule) * (count?count:1))) == NULL) {
+        xbee_filter_setfree(f);
+        return -1;
+      }
+    }
+    for (i = 0; i < count; i++) {
+      for (k = 0; k < XBEE_FILTER_TYPES; k++) {
+        int t = xbee_filter_apitype(k);
+        if (rules[i].apiType != -1 && rules[i].apiType != t) continue;
+        xbee_filter_type(t, &addr16, &rssi, &payload);
+        /* a rule can't match a frame that doesn't have the field it wants */
+        if (rules[i].addrLen == 2 && addr16 == -1) continue;
+        if (rules[i].addrLen == 8 && (t == XBEE_16BIT_DATARX || t == XBEE_16BIT_IO)) continue;
+        if (rules[i].RSSI && rssi == -1) continue;
+
+        r = &f->rules[k][f->count[k]++];
+        r->action = rules[i].action;
+        r->addrLen = rules[i].addrLen;
+        r->addrOff = ((rules[i].addrLen == 2)?addr16:0);
+        memcpy(r->addrLo, rules[i].addrLo, sizeof(r->addrLo));
+        memcpy(r->addrHi, rules[i].addrHi, sizeof(r->addrHi));
+        r->rssiOff = (rules[i].RSSI?rssi:-1);
+        r->RSSI = rules[i].RSSI;
+        r->matchOff = payload + rules[i].offset;
+        r->matchLen = rules[i].matchLen;
+        memcpy(r->match, rules[i].match, rules[i].matchLen);
+      }
+    }
+  }
+
+  *set = f;
+  return 0;
+}
+
+/* #################################################################
+   xbee_filter_setfree - INTERNAL
+   frees a compiled set of filter rules */
+static void xbee_filter_setfree(t_filterset *f) {
+  int k;
+  if (!f) return;
+  for (k = 0; k < XBEE_FILTER_TYPES; k++) {
+    free(f->rules[k]);
+  }
+  free(f);
+}
+
+/* #################################################################
+   xbee_filter_swap - INTERNAL
+   the listen thread picks up the set left by xbee_setfilter() */
+static void xbee_filter_swap(xbee_hnd xbee) {
+  t_filterset *o;
+  xbee_mutex_lock(xbee->filtermutex);
+  o = xbee->filters;
+  xbee->filters = xbee->filternext;
+  xbee->filternext = NULL;
+  xbee->filterchanged = 0;
+  xbee_mutex_unlock(xbee->filtermutex);
+  xbee_filter_setfree(o);
+}
+
+/* #################################################################
+   xbee_filter_run - INTERNAL
+   checks a raw frame against the filter, d is the frame after the API identifier
+   (and must be at least xbee_pkt_minlen() long). returns XBEE_FILTER_ACCEPT or
+   XBEE_FILTER_REJECT */
+static int xbee_filter_run(t_filterset *f, unsigned char t, unsigned char *d, int len) {
+  t_filterrule *r;
+  int k, n;
+  if ((k = xbee_filter_type(t, NULL, NULL, NULL)) == -1) return XBEE_FILTER_ACCEPT;
+  for (r = f->rules[k], n = f->count[k]; n; r++, n--) {
+    /* the addresses are MSB first, so memcmp() orders them */
+    if (r->addrLen &&
+        (memcmp(&d[r->addrOff], r->addrLo, r->addrLen) < 0 ||
+         memcmp(&d[r->addrOff], r->addrHi, r->addrLen) > 0)) continue;
+    if (r->rssiOff != -1 && d[r->rssiOff] < r->RSSI) continue;
+    if (r->matchLen &&
+        (r->matchOff + r->matchLen > len ||
+         memcmp(&d[r->matchOff], r->match, r->matchLen))) continue;
+    return r->action;
+  }
+  return f->defaultAction;
+}
+
+/* ################################################################# */
+/* ### Duplicate Suppression ####################################### */
+/* ################################################################# */
+
+/* #################################################################
+   xbee_dedup
+   drops recieved data frames that are the same as one seen from the same node
+   within the last window milliseconds (a retry when the ACK was lost).
+   the RSSI and options aren't compared. up to entries frames are remembered
+   (rounded up to a power of 2). a window of 0 disables it.
+   returns 0 on success or -1 on error */
+int xbee_dedup(int window, int entries) {
+  return _xbee_dedup(default_xbee, window, entries);
+}
+int _xbee_dedup(xbee_hnd xbee, int window, int entries) {
+  t_dedup *dd, *o;
+  unsigned int sets;
+  ISREADYR(-1);
+  if (window < 0 || entries < 0 || entries > XBEE_DEDUP_MAX) return -1;
+
+  dd = NULL;
+  if (window) {
+    if (entries < XBEE_DEDUP_WAYS) entries = XBEE_DEDUP_WAYS;
+    for (sets = 1; sets * XBEE_DEDUP_WAYS < (unsigned int)entries; sets <<= 1);
+    if ((dd = Xcalloc(sizeof(t_dedup))) == NULL) return -1;
+    dd->window = (unsigned long long)window * 1000000ULL;
+    dd->sets = sets;
+    if ((dd->ents = Xcalloc(sizeof(t_dedupent) * sets * XBEE_DEDUP_WAYS)) == NULL) {
+      xbee_dedup_free(dd);
+      return -1;
+    }
+  }
+
+  /* the listen thread picks the new table up before the next frame */
+  xbee_mutex_lock(xbee->dedupmutex);
+  o = xbee->dedupnext;
+  xbee->dedupnext = dd;
+  xbee->dedupchanged = 1;
+  xbee_mutex_unlock(xbee->dedupmutex);
+  xbee_dedup_free(o);
+
+  return 0;
+}
+
+/* #################################################################
+   xbee_dedup_suppressed
+   returns the number of duplicate frames that have been dropped */
+unsigned long xbee_dedup_suppressed(void) {
+  return _xbee_dedup_suppressed(default_xbee);
+}
+unsigned long _xbee_dedup_suppressed(xbee_hnd xbee) {
+  ISREADYR(0);
+  return xbee->dedupsuppressed;
+}
+
+/* #################################################################
+   xbee_dedup_free - INTERNAL */
+static void xbee_dedup_free(t_dedup *dd) {
+  if (!dd) return;
+  free(dd->ents);
+  free(dd);
+}
+
+/* #################################################################
+   xbee_dedup_swap - INTERNAL
+   the listen thread picks up the table left by xbee_dedup() */
+static void xbee_dedup_swap(xbee_hnd xbee) {
+  t_dedup *o;
+  xbee_mutex_lock(xbee->dedupmutex);
+  o = xbee->dedup;
+  xbee->dedup = xbee->dedupnext;
+  xbee->dedupnext = NULL;
+  xbee->dedupchanged = 0;
+  xbee_mutex_unlock(xbee->dedupmutex);
+  xbee_dedup_free(o);
+}
+
+/* #################################################################
+   xbee_dedup_seen - INTERNAL
+   returns 1 if the raw frame (d is after the API identifier) is a duplicate,
+   else it is remembered and 0 is returned. only the listen thread uses this */
+static int xbee_dedup_seen(t_dedup *dd, unsigned char t, unsigned char *d, int len) {
+  unsigned int h1, h2;
+  unsigned long long now;
+  t_dedupent *e, *oldest;
+  int i, rssi, payload;
+
+  /* only data frames - I/O samples of an input that hasn't changed are rightly the same */
+  if (t != XBEE_64BIT_DATARX && t != XBEE_16BIT_DATARX && t != XBEE2_DATARX && t != XBEE2_EXPLICITRX) return 0;
+  if (xbee_filter_type(t, NULL, &rssi, &payload) == -1) return 0;
+
+  /* hash everything but the RSSI and options, they can change between retries.
+     h1 is FNV-1a and h2 is Jenkins' one-at-a-time hash, so that frames which
+     collide in one are unlikely to collide in the other */
+  h1 = 2166136261u ^ t;
+  h2 = t;
+  for (i = 0; i < len; i++) {
+    if (i == rssi || i == payload - 1) continue;
+    h1 = (h1 ^ d[i]) * 16777619u;
+    h2 += d[i];
+    h2 += h2 << 10;
+    h2 ^= h2 >> 6;
+  }
+  h2 += len;
+  h2 += h2 << 3;
+  h2 ^= h2 >> 11;
+  h2 += h2 << 15;
+
+  now = xbee_clock_ns();
+  e = &dd->ents[(h1 & (dd->sets - 1)) * XBEE_DEDUP_WAYS];
+  oldest = e;
+  for (i = 0; i < XBEE_DEDUP_WAYS; i++, e++) {
+    if (e->seen && e->h1 == h1 && e->h2 == h2) {
+      /* the window isn't extended by the duplicate, so a node that keeps
+         sending the same thing isn't dropped forever */
+      if (now - e->seen <= dd->window) return 1;
+      oldest = e;
+      break;
+    }
+    if (e->seen < oldest->seen) oldest = e;
+  }
+  oldest->h1 = h1;
+  oldest->h2 = h2;
+  oldest->seen = now;
+  return 0;
+}
+
+/* ################################################################# */
+/* ### Gateways #################################################### */
+/* ################################################################# */
+
+/* #################################################################
+   xbee_gw_new
+   uses several XBees on the same network as one. everything the nodes send to any
+   of them is given to the callback (from a thread of its own, the packet is free'd
+   when it returns) or is collected with xbee_gw_getpacket(), and sends go to the least loaded radio, or the one that
+   hears the destination best if XBEE_GW_LASTHEARD is given. a radio whose sends
+   keep getting no answer is left out for a while. a radio may only be in one
+   gateway, and the gateway must be freed before its radios are ended.
+   returns the gateway, or NULL on error */
+xbee_gw *xbee_gw_new(xbee_hnd *radios, int count, int policy,
+                     void (*callback)(xbee_gw *gw, int radio, xbee_pkt *pkt)) {
+  xbee_hnd xbee;
+  xbee_gw *gw;
+  int i, j;
+
+  if (!radios || count < 1 || count > XBEE_GW_MAXRADIOS) return NULL;
+  for (i = 0; i < count; i++) {
+    xbee = radios[i];
+    ISREADYR(NULL);
+    if (xbee->gw) return NULL;
+    for (j = 0; j < i; j++) {
+      if (radios[j] == xbee) return NULL;
+    }
+  }
+
+  xbee = radios[0];
+  if ((gw = Xcalloc(sizeof(xbee_gw))) == NULL) return NULL;
+  gw->count = count;
+  gw->policy = policy;
+  gw->callback = callback;
+  for (i = 0; i < count; i++) {
+    gw->radios[i].xbee = radios[i];
+  }
+  xbee_mutex_init(gw->mutex);
+  xbee_cond_init(gw->cond);
+
+  if (callback) {
+    gw->run = 1;
+    if (xbee_thread_create(gw->thread, xbee_gw_thread, gw)) {
+      xbee_log("Unable to start the gateway's callback thread");
+      xbee_cond_destroy(gw->cond);
+      xbee_mutex_destroy(gw->mutex);
+      Xfree(gw);
+      return NULL;
+    }
+  }
+
+  /* from here on the listen threads give it a copy of what they recieve */
+  for (i = 0; i < count; i++) {
+    xbee = radios[i];
+    xbee_mutex_lock(xbee->conmutex);
+    xbee->gwradio = i;
+    xbee->gw = gw;
+    xbee_mutex_unlock(xbee->conmutex);
+  }
+
+  return gw;
+}
+
+/* #################################################################
+   xbee_gw_free
+   detaches the gateway from its radios, and frees it along with any
+   packets that haven't been collected */
+void xbee_gw_free(xbee_gw *gw) {
+  xbee_hnd xbee;
+  t_gwpkt *l, *n;
+  t_gwnode *e, *f;
+  int i;
+
+  if (!gw) return;
+  for (i = 0; i < gw->count; i++) {
+    xbee = gw->radios[i].xbee;
+    xbee_mutex_lock(xbee->conmutex);
+    xbee->gw = NULL;
+    xbee_mutex_unlock(xbee->conmutex);
+  }
+
+  if (gw->callback) {
+    xbee_mutex_lock(gw->mutex);
+    gw->run = 0;
+    xbee_cond_broadcast(gw->cond);
+    xbee_mutex_unlock(gw->mutex);
+    xbee_thread_join(gw->thread);
+  }
+
+  for (l = gw->rxlist; l; l = n) {
+    n = l->next;
+    xbee_mem_add(gw->radios[l->radio].xbee, xbee_mem_pkt, -1, sizeof(t_gwpkt) + xbee_pkt_size(l->pkt));
+    Xfree(l->pkt);
+    Xfree(l);
+  }
+  for (i = 0; i < XBEE_GW_HASH; i++) {
+    for (e = gw->nodes[i]; e; e = f) {
+      f = e->next;
+      Xfree(e);
+    }
+  }
+  xbee_cond_destroy(gw->cond);
+  xbee_mutex_destroy(gw->mutex);
+  Xfree(gw);
+}
+
+/* #################################################################
+   xbee_gw_getpacket
+   returns the oldest packet recieved by any of the radios (which must be free'd),
+   or NULL if there isn't one (or the gateway has a callback). if radio isn't NULL
+   it is given the index of the radio that recieved it */
+xbee_pkt *xbee_gw_getpacket(xbee_gw *gw, int *radio) {
+  xbee_pkt *p;
+  t_gwpkt *l;
+
+  if (!gw || gw->callback) return NULL;
+  xbee_mutex_lock(gw->mutex);
+  if ((l = gw->rxlist) != NULL) {
+    gw->rxlist = l->next;
+    if (!gw->rxlist) gw->rxlast = NULL;
+  }
+  xbee_mutex_unlock(gw->mutex);
+  if (!l) return NULL;
+
+  p = l->pkt;
+  if (radio) *radio = l->radio;
+  xbee_mem_add(gw->radios[l->radio].xbee, xbee_mem_pkt, -1, sizeof(t_gwpkt) + xbee_pkt_size(p));
+  Xfree(l);
+  return p;
+}
+
+/* #################################################################
+   xbee_gw_nsenddata
+   sends data to a node through one of the gateway's radios. the type may be
+   xbee_16bitData (the address is given in addrL), xbee_64bitData or xbee2_data.
+   if the write fails, or XBEE_GW_ACK was given and the send isn't acknowledged,
+   the next radio is tried.
+   returns 0 on success, 1 if no radio could send it or -1 on error */
+int xbee_gw_nsenddata(xbee_gw *gw, xbee_types type, unsigned int addrH, unsigned int addrL,
+                      char *data, int length) {
+  unsigned char buf[128];
+  unsigned char addr[8];
+  int order[XBEE_GW_MAXRADIOS];
+  int i, n, o, addr64, ret;
+
+  if (!gw || !data || length < 0) return -1;
+
+  addr[0] = (addrH >> 24) & 0xFF;
+  addr[1] = (addrH >> 16) & 0xFF;
+  addr[2] = (addrH >>  8) & 0xFF;
+  addr[3] = (addrH      ) & 0xFF;
+  addr[4] = (addrL >> 24) & 0xFF;
+  addr[5] = (addrL >> 16) & 0xFF;
+  addr[6] = (addrL >>  8) & 0xFF;
+  addr[7] = (addrL      ) & 0xFF;
+
+  /* the frame ID (buf[1]) is filled in for each radio */
+  switch (type) {
+  case xbee_16bitData:
+    if (length > 100) return -1;
+    addr[0] = addr[6];
+    addr[1] = addr[7];
+    addr64 = 0;
+    buf[0] = XBEE_16BIT_DATATX;
+    memcpy(&buf[2], addr, 2);
+    buf[4] = 0x00;
+    o = 5;
+    break;
+  case xbee_64bitData:
+    if (length > 100) return -1;
+    addr64 = 1;
+    buf[0] = XBEE_64BIT_DATATX;
+    memcpy(&buf[2], addr, 8);
+    buf[10] = 0x00;
+    o = 11;
+    break;
+  case xbee2_data:
+    if (length > 72) return -1;
+    addr64 = 1;
+    buf[0] = XBEE2_DATATX;
+    memcpy(&buf[2], addr, 8);
+    buf[10] = 0xFF;
+    buf[11] = 0xFE;
+    buf[12] = 0x00;
+    buf[13] = 0x00;
+    o = 14;
+    break;
+  default:
+    return -1;
+  }
+  memcpy(&buf[o], data, length);
+
+  n = xbee_gw_order(gw, addr, addr64, order);
+  ret = 1;
+  for (i = 0; i < n && ret; i++) {
+    ret = xbee_gw_send(gw, order[i], buf, o + length);
+  }
+  return ret;
+}
+
+/* #################################################################
+   xbee_gw_radiostate
+   returns 1 if the radio is being used, 0 if it has been left out
+   because its sends weren't answered, or -1 on error */
+int xbee_gw_radiostate(xbee_gw *gw, int radio) {
+  int ret;
+  if (!gw || radio < 0 || radio >= gw->count) return -1;
+  xbee_mutex_lock(gw->mutex);
+  ret = (gw->radios[radio].downUntil <= xbee_clock_ns());
+  xbee_mutex_unlock(gw->mutex);
+  return ret;
+}
+
+/* #################################################################
+   xbee_gw_rx - INTERNAL
+   takes a copy of a data or I/O packet for the gateway, and notes which radio
+   hears the node best. this is called by the listen thread with the connection
+   mutex (and log mutex) held, so it mustn't log */
+static void xbee_gw_rx(xbee_hnd xbee, xbee_pkt *p) {
+  xbee_gw *gw = xbee->gw;
+  unsigned long long now;
+  t_gwpkt *l;
+  t_gwnode *e;
+  unsigned int h;
+  int addr64;
+
+  /* the gateway's copy is dropped if it would take the radio over its memory limit,
+     but the node is still tracked */
+  l = NULL;
+  if (xbee_mem_full(xbee, sizeof(t_gwpkt) + xbee_pkt_size(p)) ||
+      (l = Xcalloc(sizeof(t_gwpkt))) == NULL ||
+      (l->pkt = xbee_pkt_alloc2(xbee, p)) == NULL) {
+    xbee_atomic_inc(xbee->memDropped);
+    Xfree(l);
+  } else {
+    l->pkt->next = NULL;
+    l->pkt->refs = 0;
+    l->radio = xbee->gwradio;
+    xbee_mem_add(xbee, xbee_mem_pkt, 1, sizeof(t_gwpkt) + xbee_pkt_size(l->pkt));
+  }
+
+  addr64 = p->sAddr64;
+  now = xbee_clock_ns();
+  xbee_mutex_lock(gw->mutex);
+  if ((e = xbee_gw_node(gw, (addr64?p->Addr64:p->Addr16), addr64)) == NULL &&
+      gw->nodecount < XBEE_GW_MAXNODES) {
+    if ((e = Xcalloc(sizeof(t_gwnode))) != NULL) {
+      memcpy(e->addr, (addr64?p->Addr64:p->Addr16), (addr64?8:2));
+      e->addr64 = addr64;
+      e->radio = -1;
+      h = xbee_hash(e->addr, (addr64?8:2)) & (XBEE_GW_HASH - 1);
+      e->next = gw->nodes[h];
+      gw->nodes[h] = e;
+      gw->nodecount++;
+    }
+  }
+  /* move to this radio if it hears the node better (a lower RSSI), or if the
+     radio that used to hear it hasn't for a while. frames without an RSSI
+     just go with whichever radio heard the node last */
+  if (e && (e->radio == -1 || e->radio == xbee->gwradio ||
+            now - e->heard > XBEE_GW_STALE * 1000000ULL ||
+            !p->RSSI || !e->RSSI || p->RSSI < e->RSSI)) {
+    e->radio = xbee->gwradio;
+    e->RSSI = p->RSSI;
+    e->heard = now;
+  }
+
+  if (l) {
+    if (gw->rxlast) {
+      gw->rxlast->next = l;
+    } else {
+      gw->rxlist = l;
+    }
+    gw->rxlast = l;
+    if (gw->callback) xbee_cond_signal(gw->cond);
+  }
+  xbee_mutex_unlock(gw->mutex);
+}
+
+/* #################################################################
+   xbee_gw_node - INTERNAL
+   finds a node that the gateway has heard, the gateway's mutex must be held */
+static t_gwnode *xbee_gw_node(xbee_gw *gw, unsigned char *addr, int addr64) {
+  t_gwnode *e;
+  for (e = gw->nodes[xbee_hash(addr, (addr64?8:2)) & (XBEE_GW_HASH - 1)]; e; e = e->next) {
+    if (e->addr64 == addr64 && !memcmp(e->addr, addr, (addr64?8:2))) return e;
+  }
+  return NULL;
+}
+
+/* #################################################################
+   xbee_gw_order - INTERNAL
+   fills order with the radios to try a send on: the one that heard the destination
+   (for XBEE_GW_LASTHEARD), then the rest from the least loaded, then any that are
+   out of use as a last resort. returns the number of radios */
+static int xbee_gw_order(xbee_gw *gw, unsigned char *addr, int addr64, int *order) {
+  unsigned long long now;
+  t_gwnode *e;
+  int i, j, k, n, r, up, heard;
+
+  now = xbee_clock_ns();
+  xbee_mutex_lock(gw->mutex);
+  heard = -1;
+  if ((gw->policy & XBEE_GW_LASTHEARD) && (e = xbee_gw_node(gw, addr, addr64)) != NULL &&
+      e->radio != -1 && gw->radios[e->radio].downUntil <= now) {
+    heard = e->radio;
+  }
+
+  n = 0;
+  if (heard != -1) order[n++] = heard;
+
+  /* the radios that are up, by how many sends they have in progress. they are
+     taken in turn from a different place each time so that ties are spread out */
+  up = n;
+  r = gw->rotate++;
+  for (k = 0; k < gw->count; k++) {
+    i = (r + k) % gw->count;
+    if (i == heard || gw->radios[i].downUntil > now) continue;
+    for (j = n; j > up && gw->radios[order[j - 1]].inflight > gw->radios[i].inflight; j--) {
+      order[j] = order[j - 1];
+    }
+    order[j] = i;
+    n++;
+  }
+
+  /* the rest, soonest back first */
+  up = n;
+  for (i = 0; i < gw->count; i++) {
+    if (gw->radios[i].downUntil <= now) continue;
+    for (j = n; j > up && gw->radios[order[j - 1]].downUntil > gw->radios[i].downUntil; j--) {
+      order[j] = order[j - 1];
+    }
+    order[j] = i;
+    n++;
+  }
+  xbee_mutex_unlock(gw->mutex);
+
+  return n;
+}
+
+/* #################################################################
+   xbee_gw_send - INTERNAL
+   sends a data frame (without its frame ID) on one of the gateway's radios,
+   waiting for the Tx status if XBEE_GW_ACK was given. a radio that fails to
+   write, or doesn't answer XBEE_GW_FAILS times in a row, is left out for
+   XBEE_GW_RETRY ms. returns 0 on success or 1 on failure */
+static int xbee_gw_send(xbee_gw *gw, int radio, unsigned char *buf, int len) {
+  t_gwradio *r = &gw->radios[radio];
+  xbee_hnd xbee = r->xbee;
+  xbee_pkt *p;
+  int id, ret, written, answered;
+
+  xbee_mutex_lock(gw->mutex);
+  r->inflight++;
+  xbee_mutex_unlock(gw->mutex);
+
+  id = 0;
+  if ((gw->policy & XBEE_GW_ACK) && (id = xbee_frame_alloc(xbee)) == -1) {
+    xbee_log("No frame IDs are free!");
+    id = 0;
+  }
+  buf[1] = id;
+  ret = _xbee_send_pkt(xbee, xbee_make_pkt(xbee, buf, len), NULL);
+  written = answered = !ret;
+
+  if (!ret && id) {
+    /* a NAK or CCA failure is still an answer, another radio may do better
+       but this one isn't at fault */
+    if ((p = xbee_frame_wait(xbee, id, XBEE_GW_TIMEOUT)) != NULL) {
+      ret = !!p->status;
+      Xfree(p);
+    } else {
+      ret = 1;
+      answered = 0;
+    }
+  }
+  if (id) xbee_frame_free(xbee, id);
+
+  xbee_mutex_lock(gw->mutex);
+  r->inflight--;
+  if (answered) {
+    r->fails = 0;
+    r->downUntil = 0;
+  } else if (++r->fails >= XBEE_GW_FAILS || !written) {
+    /* a failed write means the radio has gone, so it is left out straight away */
+    r->downUntil = xbee_clock_ns() + (XBEE_GW_RETRY * 1000000ULL);
+  }
+  xbee_mutex_unlock(gw->mutex);
+
+  if (!answered) xbee_log("Gateway radio %d didn't send the frame",radio);
+  return ret;
+}
+
+/* #################################################################
+   xbee_gw_thread - INTERNAL
+   gives the packets to the gateway's callback */
+static void xbee_gw_thread(xbee_gw *gw) {
+  t_gwpkt *l, *n;
+
+  xbee_mutex_lock(gw->mutex);
+  while (gw->run) {
+    if (!gw->rxlist) {
+      xbee_cond_wait(gw->cond, gw->mutex);
+      continue;
+    }
+    l = gw->rxlist;
+    gw->rxlist = gw->rxlast = NULL;
+    xbee_mutex_unlock(gw->mutex);
+
+    for (; l; l = n) {
+      n = l->next;
+      xbee_mem_add(gw->radios[l->radio].xbee, xbee_mem_pkt, -1, sizeof(t_gwpkt) + xbee_pkt_size(l->pkt));
+      gw->callback(gw, l->radio, l->pkt);
+      Xfree(l->pkt);
+      Xfree(l);
+    }
+
+    xbee_mutex_lock(gw->mutex);
+  }
+  xbee_mutex_unlock(gw->mutex);
+}
+
+/* ################################################################# */
+/* ### Frame Server ################################################ */
+/* ################################################################# */
+
+/* #################################################################
+   xbee_serve
+   shares the XBee with other processes. the address is "unix:<path>" or
+   "tcp:<port>" (localhost only), and other processes give the same address to
+   xbee_setup() in place of the serial port. frames from the XBee are sent to
+   every client that wants them (see xbee_setfilter()) as well as being used here,
+   except for responses to a client's own requests which only go to that client.
+   frames from the clients are sent on to the XBee with their frame IDs changed
+   so that they can't clash. returns 0 on success or -1 on error */
+int xbee_serve(char *addr) {
+  return _xbee_serve(default_xbee, addr);
+}
+int _xbee_serve(xbee_hnd xbee, char *addr) {
+#ifdef __GNUC__ /* ---- */
+  t_serve *s;
+  int running;
+  ISREADYR(-1);
+  if (!addr || xbee->client) return -1;
+
+  xbee_mutex_lock(xbee->servemutex);
+  running = (xbee->serve != NULL);
+  xbee_mutex_unlock(xbee->servemutex);
+  if (running) return -1;
+
+  if ((s = Xcalloc(sizeof(t_serve))) == NULL) return -1;
+  s->xbee = xbee;
+  if ((s->fd = xbee_socket(xbee, addr, 1)) < 0) {
+    xbee_log("Unable to serve frames on '%s'",addr);
+    Xfree(s);
+    return -1;
+  }
+  if (pipe(s->wake) == -1) {
+    xbee_perror("xbee_serve():pipe()");
+    close(s->fd);
+    Xfree(s);
+    return -1;
+  }
+  fcntl(s->wake[0], F_SETFL, fcntl(s->wake[0], F_GETFL) | O_NONBLOCK);
+  fcntl(s->wake[1], F_SETFL, fcntl(s->wake[1], F_GETFL) | O_NONBLOCK);
+  if (!strncmp(addr, "unix:", 5)) {
+    if ((s->path = Xmalloc(strlen(&addr[5]) + 1)) != NULL) strcpy(s->path, &addr[5]);
+  }
+
+  s->run = 1;
+  if (xbee_thread_create(s->thread, xbee_serve_thread, s)) {
+    xbee_perror("xbee_serve():xbee_thread_create()");
+    close(s->fd);
+    close(s->wake[0]);
+    close(s->wake[1]);
+    if (s->path) {
+      unlink(s->path);
+      Xfree(s->path);
+    }
+    Xfree(s);
+    return -1;
+  }
+
+  /* from here on the listen thread gives the clients their frames */
+  xbee_mutex_lock(xbee->servemutex);
+  xbee->serve = s;
+  xbee_mutex_unlock(xbee->servemutex);
+
+  xbee_log("Serving frames on '%s'",addr);
+  return 0;
+#else /* -------------- */
+  ISREADYR(-1);
+  xbee_log("Frame servers aren't supported on Win32");
+  return -1;
+#endif /* ------------- */
+}
+
+/* #################################################################
+   xbee_serve_stop
+   stops the frame server, disconnecting any clients */
+void xbee_serve_stop(void) {
+  _xbee_serve_stop(default_xbee);
+}
+void _xbee_serve_stop(xbee_hnd xbee) {
+#ifdef __GNUC__ /* ---- */
+  t_serve *s;
+  ISREADYP();
+
+  xbee_mutex_lock(xbee->servemutex);
+  s = xbee->serve;
+  xbee->serve = NULL;
+  xbee_mutex_unlock(xbee->servemutex);
+  if (!s) return;
+
+  s->run = 0;
+  if (write(s->wake[1], "", 1) == -1) { /* it will notice within 100ms anyway */ }
+  xbee_thread_join(s->thread);
+
+  while (s->clients) {
+    xbee_serve_drop(s, s->clients);
+  }
+  close(s->fd);
+  close(s->wake[0]);
+  close(s->wake[1]);
+  if (s->path) {
+    unlink(s->path);
+    Xfree(s->path);
+  }
+  Xfree(s);
+  xbee_log("Stopped serving frames");
+#endif /* ------------- */
+}
+
+#ifdef __GNUC__ /* ---- */
+/* #################################################################
+   xbee_serve_rx - INTERNAL
+   queues a raw frame (d is after the API identifier) for the clients that want
+   it. this is called by the listen thread (maybe with the log mutex held), so it
+   mustn't log. returns 1 if it was the response to a client's request, which
+   isn't used by anything else, or 0 */
+static int xbee_serve_rx(xbee_hnd xbee, unsigned char t, unsigned char *d, int len) {
+  t_servemap *m;
+  t_serveclient *c;
+  t_serve *s;
+  int id = -1;
+
+  xbee_mutex_lock(xbee->servemutex);
+  if ((s = xbee->serve) == NULL) {
+    xbee_mutex_unlock(xbee->servemutex);
+    return 0;
+  }
+
+  if ((t == XBEE_LOCAL_AT || t == XBEE_REMOTE_AT || t == XBEE_TX_STATUS || t == XBEE2_TX_STATUS) &&
+      (m = &s->map[d[0]])->client) {
+    c = m->client;
+    d[0] = m->frameID;
+    xbee_serve_queue(s, c, t, d, len);
+    /* every node answers an ND, so that frame ID is kept until it times out */
+    if (!m->multi) {
+      m->client = NULL;
+      id = m - s->map;
+    }
+    xbee_mutex_unlock(xbee->servemutex);
+    if (id != -1) xbee_frame_free(xbee, id);
+    return 1;
+  }
+
+  for (c = s->clients; c; c = c->next) {
+    if (c->filters && xbee_filter_run(c->filters, t, d, len) == XBEE_FILTER_REJECT) continue;
+    xbee_serve_queue(s, c, t, d, len);
+  }
+  xbee_mutex_unlock(xbee->servemutex);
+
+  return 0;
+}
+
+/* #################################################################
+   xbee_serve_queue - INTERNAL
+   frames a packet for a client (in API mode 1, nothing is escaped) and wakes the
+   server thread to send it. the serve mutex must be held */
+static void xbee_serve_queue(t_serve *s, t_serveclient *c, unsigned char t, unsigned char *d, int len) {
+  unsigned char *o, chksum;
+  int i;
+
+  if (c->outlen + len + 5 > XBEE_SERVE_QUEUE) {
+    c->dropped++;
+    return;
+  }
+  o = &c->out[c->outlen];
+  o[0] = 0x7E;
+  o[1] = ((len + 1) >> 8) & 0xFF;
+  o[2] = (len + 1) & 0xFF;
+  o[3] = t;
+  chksum = t;
+  for (i = 0; i < len; i++) {
+    o[4 + i] = d[i];
+    chksum += d[i];
+  }
+  o[4 + len] = 0xFF - chksum;
+  if (!c->outlen && write(s->wake[1], "", 1) == -1) {
+    /* the pipe is full, so the server thread is already awake */
+  }
+  c->outlen += len + 5;
+}
+
+/* #################################################################
+   xbee_serve_thread - INTERNAL
+   accepts clients, reads the frames that they send, and sends them what has been
+   queued for them */
+static void xbee_serve_thread(t_serve *s) {
+  xbee_hnd xbee = s->xbee;
+  struct pollfd fds[2 + XBEE_SERVE_MAXCLIENTS];
+  t_serveclient *cl[XBEE_SERVE_MAXCLIENTS], *c;
+  unsigned char junk[64];
+  int i, n, fd, ret;
+
+  while (s->run) {
+    fds[0].fd = s->fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = s->wake[0];
+    fds[1].events = POLLIN;
+    xbee_mutex_lock(xbee->servemutex);
+    for (n = 0, c = s->clients; c && n < XBEE_SERVE_MAXCLIENTS; c = c->next, n++) {
+      cl[n] = c;
+      fds[2 + n].fd = c->fd;
+      fds[2 + n].events = POLLIN | (c->outlen?POLLOUT:0);
+    }
+    xbee_mutex_unlock(xbee->servemutex);
+
+    if ((ret = poll(fds, 2 + n, 100)) == -1 && errno != EINTR) {
+      xbee_perror("xbee_serve_thread():poll()");
+      usleep(100000);
+    }
+    if (!s->run) break;
+    xbee_serve_expire(s);
+    if (ret <= 0) continue;
+
+    if (fds[1].revents & POLLIN) {
+      while (read(s->wake[0], junk, sizeof(junk)) > 0);
+    }
+
+    if ((fds[0].revents & POLLIN) && (fd = accept(s->fd, NULL, NULL)) != -1) {
+      if (s->nclients >= XBEE_SERVE_MAXCLIENTS) {
+        xbee_log("Too many frame server clients, refusing one");
+        close(fd);
+      } else if ((c = Xcalloc(sizeof(t_serveclient))) == NULL ||
+                 (c->out = Xmalloc(XBEE_SERVE_QUEUE)) == NULL) {
+        xbee_log("Out of memory, refusing a frame server client");
+        Xfree(c);
+        close(fd);
+      } else {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        c->fd = fd;
+        xbee_mutex_lock(xbee->servemutex);
+        c->next = s->clients;
+        s->clients = c;
+        s->nclients++;
+        xbee_mutex_unlock(xbee->servemutex);
+        xbee_log("Frame server client connected (%d)",s->nclients);
+      }
+    }
+
+    for (i = 0; i < n; i++) {
+      c = cl[i];
+      if (fds[2 + i].revents & POLLOUT) {
+        xbee_mutex_lock(xbee->servemutex);
+        if ((ret = send(c->fd, c->out, c->outlen, MSG_NOSIGNAL)) > 0) {
+          c->outlen -= ret;
+          memmove(c->out, &c->out[ret], c->outlen);
+        }
+        xbee_mutex_unlock(xbee->servemutex);
+      }
+      if ((fds[2 + i].revents & (POLLIN | POLLHUP | POLLERR)) && xbee_serve_input(s, c)) {
+        xbee_serve_drop(s, c);
+      }
+    }
+  }
+}
+
+/* #################################################################
+   xbee_serve_input - INTERNAL
+   reads what a client has sent, acting on each complete frame
+   returns 0, or -1 if the client has gone */
+static int xbee_serve_input(t_serve *s, t_serveclient *c) {
+  unsigned char chksum;
+  int ret, i, len, used;
+
+  if ((ret = read(c->fd, &c->in[c->inlen], sizeof(c->in) - c->inlen)) == 0) return -1;
+  if (ret == -1) return ((errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)?0:-1);
+  c->inlen += ret;
+
+  used = 0;
+  while (c->inlen - used >= 4) {
+    /* look for the start, a bad frame is skipped one byte at a time */
+    if (c->in[used] != 0x7E) {
+      used++;
+      continue;
+    }
+    len = (c->in[used + 1] << 8) | c->in[used + 2];
+    if (!len || len + 4 > (int)sizeof(c->in)) {
+      used++;
+      continue;
+    }
+    if (c->inlen - used < len + 4) break;
+    for (chksum = 0, i = 0; i <= len; i++) {
+      chksum += c->in[used + 3 + i];
+    }
+    if (chksum != 0xFF) {
+      used++;
+      continue;
+    }
+    xbee_serve_frame(s, c, &c->in[used + 3], len);
+    used += len + 4;
+  }
+  c->inlen -= used;
+  memmove(c->in, &c->in[used], c->inlen);
+
+  return 0;
+}
+
+/* #################################################################
+   xbee_serve_frame - INTERNAL
+   acts on a frame from a client (f is the API identifier and its data), either
+   its filter rules or something to send to the XBee */
+static void xbee_serve_frame(t_serve *s, t_serveclient *c, unsigned char *f, int len) {
+  xbee_hnd xbee = s->xbee;
+  t_filterset *fs, *o;
+  unsigned char *r;
+  int i, n, id, defaultAction;
+
+  /* the rules come one per frame, they are used once the last has arrived */
+  if (f[0] == XBEE_SERVE_SETFILTER) {
+    if (len < 4 || (n = f[3]) > XBEE_SERVE_MAXRULES || (n && (len < 44 || f[2] >= n))) return;
+    defaultAction = f[1];
+    if (n) {
+      r = &f[4];
+      i = f[2];
+      memset(&c->rules[i], 0, sizeof(xbee_filter));
+      c->rules[i].action = r[0];
+      c->rules[i].apiType = ((r[1] == 0xFF && r[2] == 0xFF)?-1:r[2]);
+      c->rules[i].addrLen = r[3];
+      memcpy(c->rules[i].addrLo, &r[4], 8);
+      memcpy(c->rules[i].addrHi, &r[12], 8);
+      c->rules[i].RSSI = r[20];
+      c->rules[i].offset = (r[21] << 8) | r[22];
+      c->rules[i].matchLen = r[23];
+      memcpy(c->rules[i].match, &r[24], 16);
+      if (i != n - 1) return;
+    }
+    if (xbee_filter_compile(xbee, c->rules, n, defaultAction, &fs)) return;
+    xbee_mutex_lock(xbee->servemutex);
+    o = c->filters;
+    c->filters = fs;
+    xbee_mutex_unlock(xbee->servemutex);
+    xbee_filter_setfree(o);
+    return;
+  }
+
+  /* the XBee doesn't take anything larger */
+  if (len > 100 + 12) return;
+
+  /* requests that are answered get a frame ID of our own, so that the answer
+     comes back to this client (and nothing else that is waiting for one) */
+  id = -1;
+  if (len >= 2 && f[1] &&
+      (f[0] == XBEE_LOCAL_ATREQ || f[0] == XBEE_LOCAL_ATQUE || f[0] == XBEE_REMOTE_ATREQ ||
+       f[0] == XBEE_64BIT_DATATX || f[0] == XBEE_16BIT_DATATX ||
+       f[0] == XBEE2_DATATX || f[0] == XBEE2_EXPLICITTX)) {
+    if ((id = xbee_frame_alloc(xbee)) == -1) {
+      xbee_log("No frame IDs are free, a client's request has been dropped");
+      return;
+    }
+    xbee_mutex_lock(xbee->servemutex);
+    s->map[id].client = c;
+    s->map[id].frameID = f[1];
+    s->map[id].multi = ((f[0] == XBEE_LOCAL_ATREQ || f[0] == XBEE_LOCAL_ATQUE) && len >= 4 &&
+                        f[2] == 'N' && f[3] == 'D');
+    s->map[id].sent = xbee_clock_ns();
+    xbee_mutex_unlock(xbee->servemutex);
+    f[1] = id;
+  }
+
+  if (_xbee_send_pkt(xbee, xbee_make_pkt(xbee, f, len), NULL) && id != -1) {
+    xbee_mutex_lock(xbee->servemutex);
+    s->map[id].client = NULL;
+    xbee_mutex_unlock(xbee->servemutex);
+    xbee_frame_free(xbee, id);
+  }
+}
+
+/* #################################################################
+   xbee_serve_drop - INTERNAL
+   disconnects a client, releasing the frame IDs it was waiting on */
+static void xbee_serve_drop(t_serve *s, t_serveclient *c) {
+  xbee_hnd xbee = s->xbee;
+  t_serveclient **l;
+  unsigned char ids[256];
+  int i, n;
+
+  xbee_mutex_lock(xbee->servemutex);
+  for (l = &s->clients; *l && *l != c; l = &(*l)->next);
+  if (*l) {
+    *l = c->next;
+    s->nclients--;
+  }
+  for (n = 0, i = 0; i < 256; i++) {
+    if (s->map[i].client != c) continue;
+    s->map[i].client = NULL;
+    ids[n++] = i;
+  }
+  xbee_mutex_unlock(xbee->servemutex);
+
+  for (i = 0; i < n; i++) {
+    xbee_frame_free(xbee, ids[i]);
+  }
+  if (c->dropped) xbee_log("%lu frames were dropped for a slow client",c->dropped);
+  xbee_log("Frame server client disconnected (%d)",s->nclients);
+  close(c->fd);
+  xbee_filter_setfree(c->filters);
+  Xfree(c->out);
+  Xfree(c);
+}
+
+/* #################################################################
+   xbee_serve_expire - INTERNAL
+   releases the frame IDs of requests that haven't been answered */
+static void xbee_serve_expire(t_serve *s) {
+  xbee_hnd xbee = s->xbee;
+  unsigned char ids[256];
+  unsigned long long now;
+  int i, n;
+
+  now = xbee_clock_ns();
+  xbee_mutex_lock(xbee->servemutex);
+  for (n = 0, i = 0; i < 256; i++) {
+    if (!s->map[i].client ||
+        now - s->map[i].sent < (s->map[i].multi?XBEE_DISCOVER_TIMEOUT:XBEE_SERVE_TIMEOUT) * 1000000ULL) continue;
+    s->map[i].client = NULL;
+    ids[n++] = i;
+  }
+  xbee_mutex_unlock(xbee->servemutex);
+
+  for (i = 0; i < n; i++) {
+    xbee_frame_free(xbee, ids[i]);
+  }
+}
+#else /* -------------- */
+static int xbee_serve_rx(xbee_hnd xbee, unsigned char t, unsigned char *d, int len) {
+  return 0;
+}
+#endif /* ------------- */
+
+/* #################################################################
+   xbee_serve_putrule - INTERNAL
+   packs filter rule i of count into the frame that a client sends to its frame
+   server (the rules must already have been checked). returns the number of bytes */
+static int xbee_serve_putrule(unsigned char *buf, xbee_filter *rules, int count, int defaultAction, int i) {
+  unsigned char *r;
+
+  buf[0] = defaultAction;
+  buf[1] = i;
+  buf[2] = count;
+  if (!count) return 3;
+  r = &buf[3];
+  r[0] = rules[i].action;
+  r[1] = ((rules[i].apiType == -1)?0xFF:0x00);
+  r[2] = rules[i].apiType & 0xFF;
+  r[3] = rules[i].addrLen;
+  memcpy(&r[4], rules[i].addrLo, 8);
+  memcpy(&r[12], rules[i].addrHi, 8);
+  r[20] = rules[i].RSSI;
+  r[21] = (rules[i].offset >> 8) & 0xFF;
+  r[22] = rules[i].offset & 0xFF;
+  r[23] = rules[i].matchLen;
+  memcpy(&r[24], rules[i].match, 16);
+  return 3 + 40;
+}
+
+/* ################################################################# */
+/* ### Packet Rings ################################################ */
+/* ################################################################# */
+
+/* #################################################################
+   xbee_ring_publish
+   copies every packet that is decoded into a ring of shared memory (a POSIX
+   shared memory object called name, e.g. "/xbee"), so that other processes can
+   read them with xbee_ring_attach() without any copying through sockets or
+   system calls. the ring holds the last 'slots' packets (rounded up to a power
+   of 2, 0 for XBEE_RING_SLOTS), and readers that fall further behind than that
+   lose the oldest. returns 0 on success or -1 on error */
+int xbee_ring_publish(const char *name, int slots) {
+  return _xbee_ring_publish(default_xbee, name, slots);
+}
+int _xbee_ring_publish(xbee_hnd xbee, const char *name, int slots) {
+#ifdef __GNUC__ /* ---- */
+  t_ring *r;
+  int fd, n, running;
+  ISREADYR(-1);
+  if (!name || slots < 0 || slots > XBEE_RING_MAXSLOTS) return -1;
+  if (!slots) slots = XBEE_RING_SLOTS;
+  for (n = 2; n < slots; n <<= 1);
+  slots = n;
+
+  xbee_mutex_lock(xbee->ringmutex);
+  running = (xbee->ring != NULL);
+  xbee_mutex_unlock(xbee->ringmutex);
+  if (running) return -1;
+
+  if ((r = Xcalloc(sizeof(t_ring))) == NULL) return -1;
+  if ((r->name = Xmalloc(strlen(name) + 1)) == NULL) {
+    Xfree(r);
+    return -1;
+  }
+  strcpy(r->name, name);
+  r->size = sizeof(t_ringhdr) + (XBEE_RING_SLOTSIZE * slots);
+
+  /* a ring left by a process that died is replaced, not reused - its readers
+     keep the old one and see that it has stopped */
+  shm_unlink(name);
+  if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644)) == -1) {
+    xbee_perror("xbee_ring_publish():shm_open()");
+    Xfree(r->name);
+    Xfree(r);
+    return -1;
+  }
+  if (ftruncate(fd, r->size) == -1 ||
+      (r->hdr = mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    xbee_perror("xbee_ring_publish():mmap()");
+    close(fd);
+    shm_unlink(name);
+    Xfree(r->name);
+    Xfree(r);
+    return -1;
+  }
+  close(fd);
+
+  /* the object is zeroed by ftruncate(), so every slot's seq is 0. the header is
+     filled in last, a reader won't attach until the magic is there */
+  r->hdr->version = XBEE_RING_VERSION;
+  r->hdr->pktsize = sizeof(xbee_pkt);
+  r->hdr->slots = slots;
+  r->hdr->slotsize = XBEE_RING_SLOTSIZE;
+  r->hdr->open = 1;
+  xbee_barrier();
+  r->hdr->magic = XBEE_RING_MAGIC;
+
+  /* from here on the listen thread publishes the packets it decodes */
+  xbee_mutex_lock(xbee->ringmutex);
+  xbee->ring = r;
+  xbee_mutex_unlock(xbee->ringmutex);
+
+  xbee_log("Publishing packets to '%s' (%d slots, %d bytes)",name,slots,(int)r->size);
+  return 0;
+#else /* -------------- */
+  ISREADYR(-1);
+  xbee_log("Packet rings aren't supported on Win32");
+  return -1;
+#endif /* ------------- */
+}
+
+/* #################################################################
+   xbee_ring_stop
+   stops publishing packets. the shared memory is removed, but readers that are
+   still attached can read what is left in it */
+void xbee_ring_stop(void) {
+  _xbee_ring_stop(default_xbee);
+}
+void _xbee_ring_stop(xbee_hnd xbee) {
+#ifdef __GNUC__ /* ---- */
+  t_ring *r;
+  ISREADYP();
+
+  xbee_mutex_lock(xbee->ringmutex);
+  r = xbee->ring;
+  xbee->ring = NULL;
+  xbee_mutex_unlock(xbee->ringmutex);
+  if (!r) return;
+
+  r->hdr->open = 0;
+  xbee_barrier();
+  munmap(r->hdr, r->size);
+  shm_unlink(r->name);
+  xbee_log("Stopped publishing packets to '%s'",r->name);
+  Xfree(r->name);
+  Xfree(r);
+#endif /* ------------- */
+}
+
+/* #################################################################
+   xbee_ring_put - INTERNAL
+   publishes a packet decoded by the listen thread. this is called with the log
+   mutex held, so it mustn't log */
+static void xbee_ring_put(xbee_hnd xbee, xbee_pkt *p) {
+#ifdef __GNUC__ /* ---- */
+  t_ringslot *slot;
+  t_ringhdr *hdr;
+  xbee_pkt *q;
+  size_t iolen;
+  unsigned int n;
+
+  xbee_mutex_lock(xbee->ringmutex);
+  if (!xbee->ring) {
+    xbee_mutex_unlock(xbee->ringmutex);
+    return;
+  }
+  hdr = xbee->ring->hdr;
+  n = hdr->head;
+  slot = (t_ringslot *)((unsigned char *)&hdr[1] + ((size_t)(n & (hdr->slots - 1)) * hdr->slotsize));
+
+  /* mark the slot as being written, readers of the packet it held will notice */
+  slot->seq = n;
+  xbee_barrier();
+
+  q = (xbee_pkt *)&slot[1];
+  iolen = sizeof(xbee_sample) * p->samples;
+  memcpy(q, p, sizeof(xbee_pkt));
+  q->IOdata = NULL;
+  q->data = NULL;
+  q->next = NULL;
+  if (iolen) memcpy(&q[1], p->IOdata, iolen);
+  if (p->datalen) memcpy((unsigned char *)&q[1] + iolen, p->data, p->datalen);
+  slot->len = sizeof(xbee_pkt) + iolen + p->datalen;
+
+  xbee_barrier();
+  slot->seq = n + 1;
+  xbee_barrier();
+  hdr->head = n + 1;
+  xbee_mutex_unlock(xbee->ringmutex);
+#endif /* ------------- */
+}
+
+/* #################################################################
+   xbee_ring_attach
+   attaches to a packet ring published by xbee_ring_publish() in this or another
+   process. the memory is mapped read-only, and reading it doesn't need any system
+   calls. this doesn't need xbee_setup() to have been called. the first packet read
+   is the oldest one still in the ring. returns NULL on error */
+xbee_ring *xbee_ring_attach(const char *name) {
+#ifdef __GNUC__ /* ---- */
+  const t_ringhdr *hdr;
+  struct stat st;
+  xbee_ring *ring;
+  unsigned int head;
+  int fd;
+
+  if (!name) return NULL;
+  if ((fd = shm_open(name, O_RDONLY, 0)) == -1) return NULL;
+  if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(t_ringhdr) ||
+      (hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    close(fd);
+    return NULL;
+  }
+  close(fd);
+
+  /* the ring must have been made by a compatible libxbee */
+  if (hdr->magic != XBEE_RING_MAGIC) goto bad;
+  xbee_barrier();
+  if (hdr->version != XBEE_RING_VERSION ||
+      hdr->pktsize != sizeof(xbee_pkt) ||
+      hdr->slotsize != XBEE_RING_SLOTSIZE ||
+      hdr->slots < 2 || (hdr->slots & (hdr->slots - 1)) ||
+      sizeof(t_ringhdr) + ((size_t)hdr->slots * hdr->slotsize) > (size_t)st.st_size) goto bad;
+
+  if ((ring = calloc(1, sizeof(xbee_ring))) == NULL) goto bad;
+  if ((ring->pkt = malloc(XBEE_RING_SLOTSIZE)) == NULL) {
+    free(ring);
+    goto bad;
+  }
+  ring->hdr = hdr;
+  ring->size = st.st_size;
+  head = hdr->head;
+  ring->next = head - ((head < hdr->slots)?head:hdr->slots);
+  return ring;
+
+bad:
+  munmap((void *)hdr, st.st_size);
+  return NULL;
+#else /* -------------- */
+  return NULL;
+#endif /* ------------- */
+}
+
+/* #################################################################
+   xbee_ring_read
+   returns the next packet from a packet ring, or NULL if there isn't a new one.
+   the packet belongs to the ring and is only valid until the next call - it must
+   not be free()'d. its sequence number is put in seq (if it isn't NULL), they
+   count up from 0 and any that are skipped were lost, see xbee_ring_lost() */
+xbee_pkt *xbee_ring_read(xbee_ring *ring, unsigned long long *seq) {
+#ifdef __GNUC__ /* ---- */
+  const t_ringslot *slot;
+  const t_ringhdr *hdr;
+  unsigned int head, n, want, len;
+  xbee_pkt *p;
+
+  if (!ring) return NULL;
+  hdr = ring->hdr;
+  p = ring->pkt;
+  for (;;) {
+    head = hdr->head;
+    xbee_barrier();
+    n = (unsigned int)ring->next;
+    if (head == n) return NULL;
+
+    /* the publisher has lapped us, skip to the oldest packet that is left */
+    if (head - n > hdr->slots) {
+      ring->lost += (head - n) - hdr->slots;
+      ring->next += (head - n) - hdr->slots;
+      continue;
+    }
+
+    slot = (const t_ringslot *)((const unsigned char *)&hdr[1] + ((size_t)(n & (hdr->slots - 1)) * hdr->slotsize));
+    want = n + 1;
+    if (slot->seq == want) {
+      xbee_barrier();
+      len = slot->len;
+      if (len >= sizeof(xbee_pkt) && len <= hdr->slotsize - sizeof(t_ringslot)) {
+        memcpy(p, &slot[1], len);
+      } else {
+        len = 0;
+      }
+      xbee_barrier();
+      /* make sure that it wasn't overwritten while it was being copied */
+      if (len && slot->seq == want &&
+          sizeof(xbee_pkt) + (sizeof(xbee_sample) * p->samples) + p->datalen == len) break;
+    }
+
+    /* the slot has been given to a newer packet */
+    ring->lost++;
+    ring->next++;
+  }
+
+  p->IOdata = (xbee_sample *)&p[1];
+  p->data = (unsigned char *)&p->IOdata[p->samples];
+  p->next = NULL;
+  if (seq) *seq = ring->next;
+  ring->next++;
+  return p;
+#else /* -------------- */
+  return NULL;
+#endif /* ------------- */
+}
+
+/* #################################################################
+   xbee_ring_pending
+   returns the number of packets waiting to be read (more than the ring holds
+   if some have been lost), or -1 if there are none and the publisher has stopped */
+int xbee_ring_pending(xbee_ring *ring) {
+#ifdef __GNUC__ /* ---- */
+  unsigned int head;
+  if (!ring) return -1;
+  head = ring->hdr->head;
+  if (head == (unsigned int)ring->next && !ring->hdr->open) return -1;
+  return head - (unsigned int)ring->next;
+#else /* -------------- */
+  return -1;
+#endif /* ------------- */
+}
+
+/* #################################################################
+   xbee_ring_lost
+   returns the number of packets that were overwritten before they were read */
+unsigned long xbee_ring_lost(xbee_ring *ring) {
+  if (!ring) return 0;
+  return ring->lost;
+}
+
+/* #################################################################
+   xbee_ring_detach
+   detaches from a packet ring */
+void xbee_ring_detach(xbee_ring *ring) {
+  if (!ring) return;
+#ifdef __GNUC__ /* ---- */
+  munmap((void *)ring->hdr, ring->size);
+#endif /* ------------- */
+  free(ring->pkt);
+  free(ring);
+}
+
+/* ################################################################# */
+/* ### AT Batches ################################################## */
+/* ################################################################# */
+
+/* #################################################################
+   xbee_at_batch
+   sends all of the commands to con (a local or remote AT connection) as
+   queued commands, without waiting for each response before sending the next.
+   if they all succeed, they are applied together with AC (and saved with WR
+   if write is set). the status (and value) of each command is given in cmds
+   if any command fails, nothing is applied - the commands that succeeded
+   will stay queued in the module until something else applies them
+   returns the number of commands that failed (including AC / WR), or -1 on error */
+int xbee_at_batch(xbee_con *con, xbee_atcmd *cmds, int n, int write) {
+  return _xbee_at_batch(default_xbee, con, cmds, n, write);
+}
+int _xbee_at_batch(xbee_hnd xbee, xbee_con *con, xbee_atcmd *cmds, int n, int write) {
+  int ids[XBEE_ATBATCH_WINDOW];
+  xbee_pkt *pkt;
+  int i, sent, failed, id;
+  ISREADYR(-1);
+  if (!con || !cmds || n < 0) return -1;
+  if (con->type != xbee_localAT &&
+      con->type != xbee_16bitRemoteAT &&
+      con->type != xbee_64bitRemoteAT) return -1;
+  for (i = 0; i < n; i++) {
+    if (cmds[i].paramlen < 0 || cmds[i].paramlen > (int)sizeof(cmds[i].param)) return -1;
+    cmds[i].status = -1;
+    cmds[i].valuelen = 0;
+  }
+
+  xbee_log("Sending a batch of %d AT commands...",n);
+
+  /* keep up to XBEE_ATBATCH_WINDOW requests in flight, collecting the responses in order */
+  failed = 0;
+  for (sent = 0, i = 0; i < n; i++) {
+    while (sent < n && sent - i < XBEE_ATBATCH_WINDOW) {
+      if ((id = xbee_frame_alloc(xbee)) == -1) {
+        if (sent > i) break; /* wait for some to come back */
+        xbee_log("No frame IDs are free!");
+        break;
+      }
+      ids[sent % XBEE_ATBATCH_WINDOW] = id;
+      xbee_at_request(xbee, con, id, 1, cmds[sent].cmd, cmds[sent].param, cmds[sent].paramlen);
+      sent++;
+    }
+    if (sent == i) {
+      /* couldn't send it */
+      failed += n - i;
+      break;
+    }
+
+    id = ids[i % XBEE_ATBATCH_WINDOW];
+    if ((pkt = xbee_frame_wait(xbee, id, XBEE_ATBATCH_TIMEOUT)) != NULL) {
+      cmds[i].status = pkt->status;
+      cmds[i].valuelen = ((pkt->datalen < sizeof(cmds[i].value))?pkt->datalen:sizeof(cmds[i].value));
+      memcpy(cmds[i].value, pkt->data, cmds[i].valuelen);
+      Xfree(pkt);
+    }
+    xbee_frame_free(xbee, id);
+    if (cmds[i].status) failed++;
+  }
+
+  if (failed) {
+    xbee_log("%d of the AT commands failed, not applying them",failed);
+    return failed;
+  }
+
+  /* apply them all in one go, then save them if asked to */
+  for (i = 0; i < 1 + !!write; i++) {
+    if ((id = xbee_frame_alloc(xbee)) == -1) return 1;
+    xbee_at_request(xbee, con, id, 0, (i?"WR":"AC"), NULL, 0);
+    pkt = xbee_frame_wait(xbee, id, XBEE_ATBATCH_TIMEOUT);
+    xbee_frame_free(xbee, id);
+    if (!pkt || pkt->status) {
+      xbee_log("%s failed!",(i?"WR":"AC"));
+      if (pkt) Xfree(pkt);
+      return 1;
+    }
+    Xfree(pkt);
+  }
+
+  xbee_log("Batch of %d AT commands applied",n);
+  return 0;
+}
+
+/* #################################################################
+   xbee_at_request - INTERNAL
+   sends an AT command to con (a local or remote AT connection) using the
+   given frame ID. if queue is set, it isn't applied until AC is sent */
+static int xbee_at_request(xbee_hnd xbee, xbee_con *con, int frameID, int queue,
+                           char *cmd, unsigned char *param, int paramlen) {
+  unsigned char buf[64];
+  int o;
+
+  if (con->type == xbee_localAT) {
+    buf[0] = ((!queue)?XBEE_LOCAL_ATREQ:XBEE_LOCAL_ATQUE);
+    buf[1] = frameID;
+    o = 2;
+  } else {
+    buf[0] = XBEE_REMOTE_ATREQ;
+    buf[1] = frameID;
+    if (con->tAddr64) {
+      memcpy(&buf[2],con->tAddr,8);
+      buf[10] = 0xFF;
+      buf[11] = 0xFE;
+    } else {
+      memset(&buf[2],0,8);
+      memcpy(&buf[10],con->tAddr,2);
+    }
+    buf[12] = ((!queue)?0x02:0x00);
+    o = 13;
+  }
+  buf[o++] = cmd[0];
+  buf[o++] = cmd[1];
+  if (paramlen) {
+    memcpy(&buf[o], param, paramlen);
+    o += paramlen;
+  }
+
+  /* if this changes a remote parameter, the cached value is no longer any good */
+  if (con->type != xbee_localAT) {
+    xbee_atcache_written(xbee, con, (char *)&buf[o - 2 - paramlen], 2 + paramlen);
+  }
+
+  return _xbee_send_pkt(xbee, xbee_make_pkt(xbee, buf, o), con);
+}
+
+/* #################################################################
+   xbee_frame_alloc - INTERNAL
+   reserves a frame ID that isn't used by any connection (or by the
+   discovery / AT cache), so that the response can be waited for with
+   xbee_frame_wait(). returns the frame ID, or -1 if they are all in use */
+static int xbee_frame_alloc(xbee_hnd xbee) {
+  unsigned char inuse[256];
+  xbee_con *con;
+  int i, id = -1;
+
+  memset(inuse, 0, sizeof(inuse));
+  inuse[0] = 1; /* 0 means 'no response' */
+  inuse[XBEE_ATCACHE_FRAMEID] = 1;
+  xbee_mutex_lock(xbee->conmutex);
+  for (con = xbee->conlist; con; con = con->next) {
+    inuse[con->frameID] = 1;
+  }
+  xbee_mutex_unlock(xbee->conmutex);
+
+  xbee_mutex_lock(xbee->framemutex);
+  for (i = 0; i < 256; i++) {
+    xbee->framenext = (xbee->framenext + 1) & 0xFF;
+    if (inuse[xbee->framenext] || xbee->frames[xbee->framenext].used) continue;
+    id = xbee->framenext;
+    xbee->frames[id].used = 1;
+    xbee->frames[id].pkt = NULL;
+    break;
+  }
+  xbee_mutex_unlock(xbee->framemutex);
+
+  return id;
+}
+
+/* #################################################################
+   xbee_frame_wait - INTERNAL
+   waits up to timeout ms for the response to a reserved frame ID
+   returns the response (which must be free'd), or NULL */
+static xbee_pkt *xbee_frame_wait(xbee_hnd xbee, int frameID, int timeout) {
+  unsigned long long now, end;
+  xbee_pkt *p;
+
+  end = xbee_clock_ns() + (timeout * 1000000ULL);
+  xbee_mutex_lock(xbee->framemutex);
+  while (!xbee->frames[frameID].pkt && (now = xbee_clock_ns()) < end) {
+    xbee_cond_timedwait(xbee->framecond, xbee->framemutex, (int)((end - now) / 1000000) + 1);
+  }
+  p = xbee->frames[frameID].pkt;
+  xbee->frames[frameID].pkt = NULL;
+  xbee_mutex_unlock(xbee->framemutex);
+
+  return p;
+}
+
+/* #################################################################
+   xbee_frame_free - INTERNAL
+   releases a reserved frame ID */
+static void xbee_frame_free(xbee_hnd xbee, int frameID) {
+  xbee_pkt *p;
+
+  xbee_mutex_lock(xbee->framemutex);
+  p = xbee->frames[frameID].pkt;
+  xbee->frames[frameID].pkt = NULL;
+  xbee->frames[frameID].used = 0;
+  xbee_mutex_unlock(xbee->framemutex);
+
+  /* a response that arrived too late */
+  if (p) Xfree(p);
+}
+
+/* #################################################################
+   xbee_frame_response - INTERNAL
+   if the packet is the response to a reserved frame ID, it is kept for the
+   thread waiting on it. returns 1 if it was kept, else 0 */
+static int xbee_frame_response(xbee_hnd xbee, xbee_pkt *p) {
+  int ret = 0;
+
+  xbee_mutex_lock(xbee->framemutex);
+  if (xbee->frames[p->frameID].used && !xbee->frames[p->frameID].pkt) {
+    xbee->frames[p->frameID].pkt = p;
+    xbee_cond_broadcast(xbee->framecond);
+    ret = 1;
+  }
+  xbee_mutex_unlock(xbee->framemutex);
+
+  return ret;
+}
+
+/* #################################################################
+   xbee_matchpktcon - INTERNAL
+   checks if the packet matches the connection */
+static int xbee_matchpktcon(xbee_hnd xbee, xbee_pkt *pkt, xbee_con *con) {
+  /* if: the connection type matches the packet type OR
+     the connection is 16/64bit remote AT, and the packet is a remote AT response */
+  if ((pkt->type == con->type) || /* -- */
+      ((pkt->type == xbee_remoteAT) && /* -- */
+       ((con->type == xbee_16bitRemoteAT) ||
+        (con->type == xbee_64bitRemoteAT)))) {
+
+    
+    /* if: is a modem status (there can only be 1 modem status connection) */
+    if (pkt->type == xbee_modemStatus) return 1;
+
+    /* if: the packet is a txStatus or localAT and the frameIDs match */
+    if ((pkt->type == xbee_txStatus) ||
+        (pkt->type == xbee_localAT)) {
+      if (pkt->frameID == con->frameID) {
+        return 1;
+      }
+    /* if: the packet was sent as a 16bit remoteAT, and the 16bit addresss match */
+    } else if ((pkt->type == xbee_remoteAT) &&
+               (con->type == xbee_16bitRemoteAT) &&
+               !memcmp(pkt->Addr16,con->tAddr,2)) {
+      return 1;
+    /* if: the packet was sent as a 64bit remoteAT, and the 64bit addresss match */
+    } else if ((pkt->type == xbee_remoteAT) &&
+               (con->type == xbee_64bitRemoteAT) &&
+               !memcmp(pkt->Addr64,con->tAddr,8)) {
+      return 1;
+    /* if: the packet is explicitly addressed, both endpoints, the cluster and the profile
+       must match too (a connection to FF:FF:FF:FF:FF:FF:FF:FF accepts packets from any node) */
+    } else if (pkt->type == xbee2_explicit) {
+      unsigned char t[8] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+      if ((pkt->dstEndpoint == con->srcEndpoint) &&
+          (pkt->srcEndpoint == con->dstEndpoint) &&
+          (pkt->clusterID == con->clusterID) &&
+          (pkt->profileID == con->profileID) &&
+          (!memcmp(pkt->Addr64,con->tAddr,8) || !memcmp(con->tAddr,t,8))) {
+        return 1;
+      }
+    /* if: the packet is 64bit addressed, and the addresses match */
+    } else if (pkt->sAddr64 && !memcmp(pkt->Addr64,con->tAddr,8)) {
+      return 1;
+    /* if: the packet is 16bit addressed, and the addresses match */
+    } else if (!pkt->sAddr64 && !memcmp(pkt->Addr16,con->tAddr,2)) {
+      return 1;
+    } else if (con->type == pkt->type && 
+               (con->type == xbee_16bitData || con->type == xbee_64bitData) && 
+               (pkt->isBroadcastADR || pkt->isBroadcastPAN)) {
+      unsigned char t[8] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+      if ((con->tAddr64 && !memcmp(con->tAddr,t,8)) ||
+          (!con->tAddr64 && !memcmp(con->tAddr,t,2))) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/* #################################################################
+   xbee_pkt_minlen - INTERNAL
+   returns the number of bytes (after the API identifier) that a packet
+   must have to hold all of the fixed fields for its type */
+static int xbee_pkt_minlen(unsigned char t) {
+  switch (t) {
+  case XBEE_MODEM_STATUS: return 1;  /* status */
+  case XBEE_LOCAL_AT:     return 4;  /* frameID, command, status */
+  case XBEE_REMOTE_AT:    return 14; /* frameID, 64-bit, 16-bit, command, status */
+  case XBEE_TX_STATUS:    return 2;  /* frameID, status */
+  case XBEE_64BIT_DATARX: return 10; /* 64-bit, RSSI, options */
+  case XBEE_16BIT_DATARX: return 4;  /* 16-bit, RSSI, options */
+  case XBEE_64BIT_IO:     return 13; /* 64-bit, RSSI, options, samples, mask */
+  case XBEE_16BIT_IO:     return 7;  /* 16-bit, RSSI, options, samples, mask */
+  case XBEE2_TX_STATUS:   return 6;  /* frameID, 16-bit, retries, delivery, discovery */
+  case XBEE2_DATARX:      return 11; /* 64-bit, 16-bit, options */
+  case XBEE2_IO:          return 15; /* 64-bit, 16-bit, options, samples, digital mask, analog mask */
+  case XBEE2_EXPLICITRX:  return 17; /* 64-bit, 16-bit, endpoints, cluster, profile, options */
+  case XBEE2_NODEIDENT:   return 30; /* 64-bit, 16-bit, options, remote 16-bit, 64-bit, NI, parent, type, event, profile, manufacturer */
+  }
+  return 0;
+}
+
+/* #################################################################
+   xbee_pkt_alloc2 - INTERNAL
+   copies the packet decoded by the listen thread into an allocation that is
+   only as big as its data and samples need */
+static xbee_pkt *xbee_pkt_alloc2(xbee_hnd xbee, xbee_pkt *rx) {
+  xbee_pkt *p;
+  size_t iolen;
+
+  iolen = sizeof(xbee_sample) * rx->samples;
+  if ((p = Xmalloc(sizeof(xbee_pkt) + iolen + rx->datalen)) == NULL) return NULL;
+  memcpy(p, rx, sizeof(xbee_pkt));
+  p->held = 0;
+  p->IOdata = (xbee_sample *)&p[1];
+  p->data = (unsigned char *)p->IOdata + iolen;
+  if (iolen) memcpy(p->IOdata, rx->IOdata, iolen);
+  if (rx->datalen) memcpy(p->data, rx->data, rx->datalen);
+  return p;
+}
+
+/* #################################################################
+   xbee_subscribe_add - INTERNAL
+   gives a subscription its reference to a packet, starting its callback
+   thread if it has a callback function. this is called by the listen thread
+   with the connection mutex (and log mutex) held, so it mustn't log with anything
+   but xbee_logI(). returns 0 on success, or -1 if the callback thread couldn't
+   be started (the packet is still queued for the next one) */
+static int xbee_subscribe_add(xbee_hnd xbee, xbee_con *con, xbee_pkt *p) {
+  t_callback_list *l, *q;
+  t_threadList *t, *u;
+  t_CBinfo *info;
+  xbee_thread_t thread;
+
+  if (xbee_mem_full(xbee, sizeof(t_callback_list)) ||
+      (l = Xcalloc(sizeof(t_callback_list))) == NULL) {
+    xbee_atomic_inc(xbee->memDropped);
+    xbee_mem_pktrelease(xbee, p);
+    xbee_pkt_unref(p);
+    return -1;
+  }
+  l->pkt = p;
+  xbee_mem_add(xbee, xbee_mem_callback, 1, sizeof(t_callback_list));
 
-  /* copy in the I/O data mask */
-  s->IOmask = (((d[maskOffset]<<8) | d[maskOffset + 1]) & 0x7FFF);
+  xbee_mutex_lock(con->callbackListmutex);
+  if ((q = ((con->callback || con->batchCallback)?con->callbackList:con->subList)) == NULL) {
+    if (con->callback || con->batchCallback) {
+      con->callbackList = l;
+    } else {
+      con->subList = l;
+    }
+  } else {
+    while (q->next) q = q->next;
+    q->next = l;
+  }
+  if (con->batchCallback) xbee_cond_signal(con->batchcond);
+  xbee_mutex_unlock(con->callbackListmutex);
 
-  /* copy in the digital I/O data */
-  s->IOdigital = (((d[sampleOffset]<<8) | d[sampleOffset+1]) & 0x01FF);
+  xbee_logI("Subscription @ 0x%08X given packet @ 0x%08X",con,p);
+  if (!con->callback && !con->batchCallback) return 0;
 
-  /* advance over the digital data, if its there */
-  sampleOffset += ((s->IOmask & 0x01FF)?2:0);
+  /* if the callback thread is still running, it will get to the packet */
+  if (xbee_mutex_trylock(con->callbackmutex)) return 0;
 
-  /* copy in the analog I/O data */
-  if (s->IOmask & 0x0200) {
-    s->IOanalog[0] = (((d[sampleOffset]<<8) | d[sampleOffset+1]) & 0x03FF);
-    sampleOffset+=2;
+  /* the callback thread free()s this */
+  if ((info = Xcalloc(sizeof(t_CBinfo))) == NULL) {
+    xbee_mutex_unlock(con->callbackmutex);
+    xbee_logI("Out of memory starting the subscription's callback thread");
+    return -1;
+  }
+  info->xbee = xbee;
+  info->con = con;
+  xbee_mem_add(xbee, xbee_mem_callback, 1, sizeof(t_CBinfo));
+  if (xbee_thread_create(thread,xbee_callbackWrapper,info) != 0) {
+    xbee_mem_add(xbee, xbee_mem_callback, -1, sizeof(t_CBinfo));
+    Xfree(info);
+    xbee_mutex_unlock(con->callbackmutex);
+    xbee_sem_post(xbee->threadsem);
+    xbee_logI("An error occured while starting the subscription's callback thread");
+    return -1;
   }
-  if (s->IOmask & 0x0400) {
-    s->IOanalog[1] = (((d[sampleOffset]<<8) | d[sampleOffset+1]) & 0x03FF);
-    sampleOffset+=2;
+  /* without a place in the list the thread can't be joined, so it is detached */
+  if ((t = Xcalloc(sizeof(t_threadList))) == NULL) {
+    xbee_thread_detach(thread);
+    return 0;
   }
-  if (s->IOmask & 0x0800) {
-    s->IOanalog[2] = (((d[sampleOffset]<<8) | d[sampleOffset+1]) & 0x03FF);
-    sampleOffset+=2;
+  t->thread = thread;
+  xbee_mem_add(xbee, xbee_mem_callback, 1, sizeof(t_threadList));
+  xbee_mutex_lock(xbee->threadmutex);
+  if ((u = xbee->threadList) == NULL) {
+    xbee->threadList = t;
+  } else {
+    while (u->next) u = u->next;
+    u->next = t;
+  }
+  xbee_mutex_unlock(xbee->threadmutex);
+  return 0;
+}
+
+/* #################################################################
+   xbee_copydata - INTERNAL
+   copies a packet's data into the packet, truncating it if it won't fit */
+static void xbee_copydata(xbee_hnd xbee, xbee_pkt *p, unsigned char *d, int len) {
+  if (len < 0) len = 0;
+  if (len > XBEE_PKT_MAXDATA) {
+    xbee_logI("Data too long for packet! Truncating %d bytes to %d...",len,XBEE_PKT_MAXDATA);
+    len = XBEE_PKT_MAXDATA;
   }
-  if (s->IOmask & 0x1000) {
-    s->IOanalog[3] = (((d[sampleOffset]<<8) | d[sampleOffset+1]) & 0x03FF);
-    sampleOffset+=2;
+  memcpy(p->data, d, len);
+  p->datalen = len;
+}
+
+/* #################################################################
+   xbee_io_layout - INTERNAL
+   returns the layout of each sample with the given I/O mask
+   the last layout is kept, as a node will normally always send the same mask */
+static t_iolayout *xbee_io_layout(xbee_hnd xbee, int mask) {
+  t_iolayout *l = &xbee->iolayout;
+  int i;
+
+  mask &= 0x7FFF;
+  if (l->mask == mask) return l;
+
+  l->mask = mask;
+  l->len = 0;
+  /* all of the digital inputs share 2 bytes */
+  if ((l->digital = !!(mask & 0x01FF)) != 0) l->len += 2;
+  /* then each analog input uses 2 bytes */
+  l->nanalog = 0;
+  for (i = 0; i < 6; i++) {
+    if (!(mask & (0x0200 << i))) continue;
+    l->analog[l->nanalog++] = i;
+    l->len += 2;
   }
-  if (s->IOmask & 0x2000) {
-    s->IOanalog[4] = (((d[sampleOffset]<<8) | d[sampleOffset+1]) & 0x03FF);
-    sampleOffset+=2;
+  return l;
+}
+
+/* #################################################################
+   xbee2_io_layout - INTERNAL
+   fills in the layout of a Series 2 (0x92) sample, mapping its inputs onto
+   the Series 1 mask that xbee_sample uses:
+     DIO0-DIO8 -> D0-D8 (DIO10-DIO12 don't fit, but are still in the packet's data)
+     AD0-AD3   -> A0-A3
+     supply    -> A5 */
+static t_iolayout *xbee2_io_layout(t_iolayout *l, int dmask, int amask) {
+  int i;
+
+  l->mask = dmask & 0x01FF;
+  l->len = 0;
+  /* the digital word is sent if any digital input is enabled, even if we can't show it */
+  if ((l->digital = !!(dmask & 0x1FFF)) != 0) l->len += 2;
+  l->nanalog = 0;
+  for (i = 0; i < 8; i++) {
+    if (!(amask & (0x01 << i))) continue;
+    if (i < 4) {
+      l->analog[l->nanalog++] = i;
+      l->mask |= 0x0200 << i;
+    } else if (i == 7) {
+      l->analog[l->nanalog++] = 5;
+      l->mask |= 0x4000;
+    } else {
+      /* not a real input... skip it, and hope that the module didn't send it */
+      continue;
+    }
+    l->len += 2;
   }
-  if (s->IOmask & 0x4000) {
-    s->IOanalog[5] = (((d[sampleOffset]<<8) | d[sampleOffset+1]) & 0x03FF);
-    sampleOffset+=2;
+  return l;
+}
+
+/* #################################################################
+   xbee_parse_io - INTERNAL
+   parses count samples, all with the layout given, into the packet's io information
+   returns the offset of the byte after the last sample */
+static int xbee_parse_io(xbee_hnd xbee, xbee_pkt *p, unsigned char *d,
+                         t_iolayout *l, int sampleOffset, int count) {
+  xbee_sample *s;
+  int o, j;
+
+  for (o = 0, s = p->IOdata; o < count; o++, s++) {
+    /* the sample may be in realloc'd memory... */
+    memset(s, 0, sizeof(xbee_sample));
+    s->IOmask = l->mask;
+
+    if (l->digital) {
+      s->IOdigital = (((d[sampleOffset]<<8) | d[sampleOffset+1]) & 0x01FF);
+      sampleOffset += 2;
+    }
+    for (j = 0; j < l->nanalog; j++) {
+      s->IOanalog[l->analog[j]] = (((d[sampleOffset]<<8) | d[sampleOffset+1]) & 0x03FF);
+      sampleOffset += 2;
+    }
   }
 
   if (xbee->log) {
-    if (s->IOmask & 0x0001)
-      xbee_logI("Digital 0: %c",((s->IOdigital & 0x0001)?'1':'0'));
-    if (s->IOmask & 0x0002)
-      xbee_logI("Digital 1: %c",((s->IOdigital & 0x0002)?'1':'0'));
-    if (s->IOmask & 0x0004)
-      xbee_logI("Digital 2: %c",((s->IOdigital & 0x0004)?'1':'0'));
-    if (s->IOmask & 0x0008)
-      xbee_logI("Digital 3: %c",((s->IOdigital & 0x0008)?'1':'0'));
-    if (s->IOmask & 0x0010)
-      xbee_logI("Digital 4: %c",((s->IOdigital & 0x0010)?'1':'0'));
-    if (s->IOmask & 0x0020)
-      xbee_logI("Digital 5: %c",((s->IOdigital & 0x0020)?'1':'0'));
-    if (s->IOmask & 0x0040)
-      xbee_logI("Digital 6: %c",((s->IOdigital & 0x0040)?'1':'0'));
-    if (s->IOmask & 0x0080)
-      xbee_logI("Digital 7: %c",((s->IOdigital & 0x0080)?'1':'0'));
-    if (s->IOmask & 0x0100)
-      xbee_logI("Digital 8: %c",((s->IOdigital & 0x0100)?'1':'0'));
-    if (s->IOmask & 0x0200)
-      xbee_logI("Analog  0: %d (~%.2fv)",s->IOanalog[0],(3.3/1023)*s->IOanalog[0]);
-    if (s->IOmask & 0x0400)
-      xbee_logI("Analog  1: %d (~%.2fv)",s->IOanalog[1],(3.3/1023)*s->IOanalog[1]);
-    if (s->IOmask & 0x0800)
-      xbee_logI("Analog  2: %d (~%.2fv)",s->IOanalog[2],(3.3/1023)*s->IOanalog[2]);
-    if (s->IOmask & 0x1000)
-      xbee_logI("Analog  3: %d (~%.2fv)",s->IOanalog[3],(3.3/1023)*s->IOanalog[3]);
-    if (s->IOmask & 0x2000)
-      xbee_logI("Analog  4: %d (~%.2fv)",s->IOanalog[4],(3.3/1023)*s->IOanalog[4]);
-    if (s->IOmask & 0x4000)
-      xbee_logI("Analog  5: %d (~%.2fv)",s->IOanalog[5],(3.3/1023)*s->IOanalog[5]);
+    for (o = 0, s = p->IOdata; o < count; o++, s++) {
+      if (count > 1) {
+        xbee_logI("--- Sample %3d -------------", o);
+      } else {
+        xbee_logI("--- Sample -----------------");
+      }
+      for (j = 0; j < 9; j++) {
+        if (!(s->IOmask & (0x0001 << j))) continue;
+        xbee_logI("Digital %d: %c",j,((s->IOdigital & (0x0001 << j))?'1':'0'));
+      }
+      for (j = 0; j < 6; j++) {
+        if (!(s->IOmask & (0x0200 << j))) continue;
+        xbee_logI("Analog  %d: %d (~%.2fv)",j,s->IOanalog[j],(3.3/1023)*s->IOanalog[j]);
+      }
+    }
+    xbee_logI("----------------------------");
   }
 
   return sampleOffset;
@@ -1528,9 +5070,15 @@ static void xbee_listen_wrapper(xbee_hnd xbee) {
   int ret;
 
   /* just falls out if the proper 'go-ahead' isn't given */
-  if (xbee->xbee_ready != -1) return;
+  xbee_mutex_lock(xbee->readymutex);
+  if (xbee->xbee_ready != -1) {
+    xbee_mutex_unlock(xbee->readymutex);
+    return;
+  }
   /* now allow the parent to continue */
   xbee->xbee_ready = -2;
+  xbee_cond_signal(xbee->readycond);
+  xbee_mutex_unlock(xbee->readymutex);
   
 #ifdef _WIN32 /* ---- */
   /* win32 requires this delay... no idea why */
@@ -1550,24 +5098,29 @@ static void xbee_listen_wrapper(xbee_hnd xbee) {
    reads data from the xbee and puts it into a linked list to keep the xbee buffers free */
 static int xbee_listen(xbee_hnd xbee) {
 #define LISTEN_BUFLEN 1024
-  unsigned char c, t, d[LISTEN_BUFLEN];
-  unsigned int l, i, chksum, o;
+  unsigned char c, t, d[LISTEN_BUFLEN], r[XBEE_RXBACKLEN];
+  unsigned int l, i, chksum, o, flen;
   int j;
+  t_iolayout *io;
   xbee_pkt *p = NULL, *q;
-  xbee_con *con;
-  int hasCon;
+  xbee_con *con, *scon;
+  int hasCon, subs;
+  unsigned long long rxTime;
+
+  /* packets are decoded into rx, then copied into an allocation of the right size */
+  xbee_pkt rx;
+  unsigned char rxdata[XBEE_PKT_MAXDATA];
+  xbee_sample rxio[256];
 
   /* do this forever :) */
   while (xbee->run) {
-    /* clean up any undesired storage */
-    if (p) Xfree(p);
-    
     /* wait for a valid start byte */
     if ((c = xbee_getrawbyte(xbee)) != 0x7E) {
       if (xbee->log) xbee_log("***** Unexpected byte (0x%02X)... *****",c);
       continue;
     }
     if (!xbee->run) return 0;
+    rxTime = xbee_clock_ns();
 
     xbee_logSf();
     if (xbee->log) {
@@ -1580,11 +5133,12 @@ static int xbee_listen(xbee_hnd xbee) {
     /* get the length */
     l = xbee_getbyte(xbee) << 8;
     l += xbee_getbyte(xbee);
+    flen = l;
 
     /* check it is a valid length... */
     if (!l) {
       if (xbee->log) {
-        xbee_logI("Recived zero length packet!");
+        xbee_logE("Recived zero length packet!");
       }
       continue;
     }
@@ -1595,7 +5149,13 @@ static int xbee_listen(xbee_hnd xbee) {
     }
     if (l > LISTEN_BUFLEN) {
       if (xbee->log) {
-        xbee_logI("Recived packet larger than buffer! Discarding...");
+        xbee_logE("Recived packet larger than buffer! Discarding...");
+      }
+      /* in API mode 1 that 0x7E may have been data, so look again after it */
+      if (xbee->apimode == 1) {
+        r[0] = (flen >> 8) & 0xFF;
+        r[1] = flen & 0xFF;
+        xbee_ungetbytes(xbee, r, 2);
       }
       continue;
     }
@@ -1643,7 +5203,8 @@ static int xbee_listen(xbee_hnd xbee) {
     i--; /* it went up too many times!... */
 
     /* add the checksum */
-    chksum += xbee_getbyte(xbee);
+    c = xbee_getbyte(xbee);
+    chksum += c;
 
     /* check if the whole packet was recieved, or something else occured... unlikely... */
     if (l>1) {
@@ -1659,13 +5220,57 @@ static int xbee_listen(xbee_hnd xbee) {
         chksum &= 0xFF;
         xbee_logE("Invalid Checksum: 0x%02X",chksum);
       }
+      /* in API mode 1 that 0x7E may have been data, so look again after it */
+      if (xbee->apimode == 1) {
+        r[0] = (flen >> 8) & 0xFF;
+        r[1] = flen & 0xFF;
+        r[2] = t;
+        memcpy(&r[3], d, flen - 1);
+        r[flen + 2] = c;
+        xbee_ungetbytes(xbee, r, flen + 3);
+      }
+      continue;
+    }
+
+    /* check the packet is long enough to hold the fields for its type
+       (i is the index of the last byte, and will have wrapped if there is no data) */
+    if ((int)(i + 1) < xbee_pkt_minlen(t)) {
+      if (xbee->log) {
+        xbee_logE("Packet too short for its type! Type: 0x%02X Length: %d",t,i + 1);
+      }
+      continue;
+    }
+
+    /* the clients of a frame server get their copy before anything is filtered
+       here, and the responses to their own requests aren't used here at all */
+    if (xbee->serve && xbee_serve_rx(xbee, t, d, i + 1)) {
+      xbee_logE("Response given to a frame server client (type 0x%02X)",t);
+      continue;
+    }
+
+    /* pick up any new filter rules, then check the raw frame against them */
+    if (xbee->filterchanged) xbee_filter_swap(xbee);
+    if (xbee->filters && xbee_filter_run(xbee->filters, t, d, i + 1) == XBEE_FILTER_REJECT) {
+      xbee->filterrejected++;
+      xbee_logE("Frame rejected by the filter (type 0x%02X)",t);
+      continue;
+    }
+
+    /* drop retries of a frame that has already been recieved */
+    if (xbee->dedupchanged) xbee_dedup_swap(xbee);
+    if (xbee->dedup && xbee_dedup_seen(xbee->dedup, t, d, i + 1)) {
+      xbee->dedupsuppressed++;
+      xbee_logE("Duplicate frame suppressed (type 0x%02X)",t);
       continue;
     }
 
-    /* make a new packet */
-    p = Xcalloc(sizeof(xbee_pkt));
+    /* start a new packet */
+    p = &rx;
+    memset(p, 0, sizeof(xbee_pkt));
+    p->data = rxdata;
+    p->IOdata = rxio;
+    p->rxTime = rxTime;
     q = NULL;
-    p->datalen = 0;
 
     /* ########################################## */
     /* if: modem status */
@@ -1729,8 +5334,27 @@ static int xbee_listen(xbee_hnd xbee) {
       p->status = d[3];
 
       /* copy in the data */
-      p->datalen = i-3;
-      for (;i>3;i--) p->data[i-4] = d[i];
+      xbee_copydata(xbee, p, &d[4], i-3);
+
+      /* if: a node discovery response, update the node table
+         (the empty response marks the end of the discovery) */
+      if (p->atCmd[0] == 'N' && p->atCmd[1] == 'D' && !p->status && p->datalen) {
+        xbee_node n;
+        if (!xbee_node_parse(&n, p->data, p->datalen, 0)) {
+          xbee_node_update(xbee, &n);
+        } else {
+          xbee_logI("Couldn't parse the node discovery response!");
+        }
+      }
+
+      /* if: it is a response to the background discovery, it isn't given to any connection */
+      if (xbee->discoverrun && p->frameID == xbee->discoverframe &&
+          p->atCmd[0] == 'N' && p->atCmd[1] == 'D') {
+        if (!p->datalen) xbee->discoverdone = 1;
+        xbee_sem_post(xbee->discoversem);
+        xbee_logE("Background discovery response");
+        continue;
+      }
 
       /* ########################################## */
       /* if: remote AT response */
@@ -1786,17 +5410,20 @@ static int xbee_listen(xbee_hnd xbee) {
 
       p->status = d[13];
 
-      p->samples = 1;
-
-      if (p->status == 0x00 && p->atCmd[0] == 'I' && p->atCmd[1] == 'S') {
-        /* parse the io data */
-        xbee_logI("--- Sample -----------------");
-        xbee_parse_io(xbee, p, d, 15, 17, 0);
-        xbee_logI("----------------------------");
+      if (p->status == 0x00 && p->atCmd[0] == 'I' && p->atCmd[1] == 'S' && i >= 16 &&
+          i + 1 >= 17 + (io = xbee_io_layout(xbee, (d[15]<<8) | d[16]))->len) {
+        /* parse the io data (anything else has no samples, rxio may hold an earlier frame's) */
+        p->samples = 1;
+        xbee_parse_io(xbee, p, d, io, 17, 1);
       } else {
         /* copy in the data */
-        p->datalen = i-13;
-        for (;i>13;i--) p->data[i-14] = d[i];
+        xbee_copydata(xbee, p, &d[14], i-13);
+      }
+
+      /* if: it is a response to a request made by the AT cache, it isn't given to any connection */
+      if (p->frameID == XBEE_ATCACHE_FRAMEID && xbee_atcache_response(xbee, p)) {
+        xbee_logE("AT cache response");
+        continue;
       }
 
       /* ########################################## */
@@ -1906,8 +5533,7 @@ static int xbee_listen(xbee_hnd xbee) {
       p->status = d[offset + 1];
 
       /* copy in the data */
-      p->datalen = i-(offset + 1);
-      for (;i>offset + 1;i--) p->data[i-(offset + 2)] = d[i];
+      xbee_copydata(xbee, p, &d[offset + 2], i-(offset + 1));
 
       /* ########################################## */
       /* if: 16 / 64bit I/O recieve */
@@ -1941,9 +5567,6 @@ static int xbee_listen(xbee_hnd xbee) {
         offset = 2;
         p->samples = d[4];
       }
-      if (p->samples > 1) {
-        p = Xrealloc(p, sizeof(xbee_pkt) + (sizeof(xbee_sample) * (p->samples - 1)));
-      }
       if (xbee->log) {
         xbee_logI("Packet type: %d-bit RX I/O Data (0x%02X)",((t == XBEE_64BIT_IO)?64:16),t);
         xbee_logIc("%d-bit Address: ",((t == XBEE_64BIT_IO)?64:16));
@@ -1972,20 +5595,24 @@ static int xbee_listen(xbee_hnd xbee) {
 
       p->status = d[offset + 1];
 
-      /* each sample is split into its own packet here, for simplicity */
-      for (o = 0; o < p->samples; o++) {
-        if (i2 >= i) {
-          xbee_logI("Invalid I/O data! Actually contained %d samples...",o);
-          p = Xrealloc(p, sizeof(xbee_pkt) + (sizeof(xbee_sample) * ((o>1)?o:1)));
-          p->samples = o;
-          break;
-        }
-        xbee_logI("--- Sample %3d -------------", o);
+      /* every sample in the frame has the same layout */
+      io = xbee_io_layout(xbee, (d[offset + 3]<<8) | d[offset + 4]);
+
+      /* make sure that the frame actually holds all of the samples */
+      if (io->len && i2 + (io->len * p->samples) > i + 1) {
+        o = (i + 1 - i2) / io->len;
+        xbee_logI("Invalid I/O data! Actually contained %d samples...",o);
+        p->samples = o;
+      }
+
+      /* parse the io data */
+      xbee_parse_io(xbee, p, d, io, i2, p->samples);
 
-        /* parse the io data */
-        i2 = xbee_parse_io(xbee, p, d, offset + 3, i2, o);
+      /* record the samples in the I/O sink, which may keep the packet to itself */
+      if (!xbee_iosink_add(xbee, p)) {
+        xbee_logE("Samples recorded by the I/O sink");
+        continue;
       }
-      xbee_logI("----------------------------");
 
       /* ########################################## */
       /* if: Series 2 Transmit status */
@@ -2081,19 +5708,202 @@ static int xbee_listen(xbee_hnd xbee) {
       p->status = d[offset];
 
       /* copy in the data */
-      p->datalen = i - (offset + 1);
-      for (;i>offset;i--) {
-        p->data[i-(offset + 1)] = d[i];
+      xbee_copydata(xbee, p, &d[offset + 1], i - offset);
+
+      /* ########################################## */
+      /* if: Series 2 explicit recieve */
+    } else if (t == XBEE2_EXPLICITRX) {
+      if (xbee->log) {
+        xbee_logI("Packet type: Series 2 Explicit Rx (0x%02X)", t);
+
+        xbee_logIc("64-bit Address: ");
+        for (j=0;j<8;j++) {
+          fprintf(xbee->log,(j?":%02X":"%02X"),d[j]);
+        }
+        xbee_logIcf();
+
+        xbee_logIc("16-bit Address: ");
+        for (j=0;j<2;j++) {
+          fprintf(xbee->log,(j?":%02X":"%02X"),d[j+8]);
+        }
+        xbee_logIcf();
+
+        xbee_logI("Endpoint: 0x%02X -> 0x%02X",d[10],d[11]);
+        xbee_logI("Cluster ID: 0x%04X",((d[12]<<8) | d[13]));
+        xbee_logI("Profile ID: 0x%04X",((d[14]<<8) | d[15]));
+        if (d[16] & 0x01) xbee_logI("Options: Packet Acknowledged");
+        if (d[16] & 0x02) xbee_logI("Options: Packet was a broadcast packet");
+      }
+      p->dataPkt = TRUE;
+      p->txStatusPkt = FALSE;
+      p->modemStatusPkt = FALSE;
+      p->remoteATPkt = FALSE;
+      p->IOPkt = FALSE;
+      p->type = xbee2_explicit;
+      p->sAddr64 = TRUE;
+
+      p->Addr64[0] = d[0];
+      p->Addr64[1] = d[1];
+      p->Addr64[2] = d[2];
+      p->Addr64[3] = d[3];
+      p->Addr64[4] = d[4];
+      p->Addr64[5] = d[5];
+      p->Addr64[6] = d[6];
+      p->Addr64[7] = d[7];
+
+      p->Addr16[0] = d[8];
+      p->Addr16[1] = d[9];
+
+      p->srcEndpoint = d[10];
+      p->dstEndpoint = d[11];
+      p->clusterID = (d[12] << 8) | d[13];
+      p->profileID = (d[14] << 8) | d[15];
+
+      p->status = d[16];
+
+      /* copy in the data */
+      xbee_copydata(xbee, p, &d[17], i - 16);
+
+      /* ########################################## */
+      /* if: Series 2 I/O recieve */
+    } else if (t == XBEE2_IO) {
+      t_iolayout l2;
+      if (xbee->log) {
+        xbee_logI("Packet type: Series 2 I/O Data Rx (0x%02X)", t);
+
+        xbee_logIc("64-bit Address: ");
+        for (j=0;j<8;j++) {
+          fprintf(xbee->log,(j?":%02X":"%02X"),d[j]);
+        }
+        xbee_logIcf();
+
+        xbee_logIc("16-bit Address: ");
+        for (j=0;j<2;j++) {
+          fprintf(xbee->log,(j?":%02X":"%02X"),d[j+8]);
+        }
+        xbee_logIcf();
+
+        if (d[10] & 0x01) xbee_logI("Options: Packet Acknowledged");
+        if (d[10] & 0x02) xbee_logI("Options: Packet was a broadcast packet");
+        xbee_logI("Samples: %d",d[11]);
+        xbee_logI("Digital Mask: 0x%04X",((d[12]<<8) | d[13]));
+        xbee_logI("Analog Mask: 0x%02X",d[14]);
+      }
+      p->dataPkt = FALSE;
+      p->txStatusPkt = FALSE;
+      p->modemStatusPkt = FALSE;
+      p->remoteATPkt = FALSE;
+      p->IOPkt = TRUE;
+      p->type = xbee2_IO;
+      p->sAddr64 = TRUE;
+
+      p->Addr64[0] = d[0];
+      p->Addr64[1] = d[1];
+      p->Addr64[2] = d[2];
+      p->Addr64[3] = d[3];
+      p->Addr64[4] = d[4];
+      p->Addr64[5] = d[5];
+      p->Addr64[6] = d[6];
+      p->Addr64[7] = d[7];
+
+      p->Addr16[0] = d[8];
+      p->Addr16[1] = d[9];
+
+      p->status = d[10];
+      p->samples = d[11];
+
+      /* keep the raw masks and samples, for the inputs that xbee_sample can't hold */
+      xbee_copydata(xbee, p, &d[12], i - 11);
+
+      /* every sample in the frame has the same layout */
+      io = xbee2_io_layout(&l2, (d[12]<<8) | d[13], d[14]);
+
+      /* make sure that the frame actually holds all of the samples */
+      if (io->len && 15 + (io->len * p->samples) > i + 1) {
+        o = (i + 1 - 15) / io->len;
+        xbee_logI("Invalid I/O data! Actually contained %d samples...",o);
+        p->samples = o;
       }
 
+      /* parse the io data */
+      xbee_parse_io(xbee, p, d, io, 15, p->samples);
+
+      /* record the samples in the I/O sink, which may keep the packet to itself */
+      if (!xbee_iosink_add(xbee, p)) {
+        xbee_logE("Samples recorded by the I/O sink");
+        continue;
+      }
+
+      /* ########################################## */
+      /* if: Series 2 node identification */
+    } else if (t == XBEE2_NODEIDENT) {
+      xbee_node n;
+      if (xbee->log) {
+        xbee_logI("Packet type: Series 2 Node Identification (0x%02X)", t);
+
+        xbee_logIc("64-bit Address: ");
+        for (j=0;j<8;j++) {
+          fprintf(xbee->log,(j?":%02X":"%02X"),d[j]);
+        }
+        xbee_logIcf();
+
+        xbee_logIc("16-bit Address: ");
+        for (j=0;j<2;j++) {
+          fprintf(xbee->log,(j?":%02X":"%02X"),d[j+8]);
+        }
+        xbee_logIcf();
+      }
+
+      /* the remote node's description follows the options byte */
+      if (xbee_node_parse(&n, &d[11], i - 10, 1)) {
+        xbee_logE("Couldn't parse the node identification!");
+        continue;
+      }
+      if (xbee->log) {
+        xbee_logI("Node: %s (type %d, parent 0x%02X%02X)",n.NI,n.deviceType,n.parent[0],n.parent[1]);
+      }
+      xbee_node_update(xbee, &n);
+
+      /* there are no connections for these, the node table is all that is kept */
+      xbee_logE("Node identification recorded");
+      continue;
+
       /* ########################################## */
       /* if: Unknown */
     } else {
       xbee_logE("Packet type: Unknown (0x%02X)",t);
       continue;
     }
+
+    /* readers of the packet ring get everything that was decoded */
+    if (xbee->ring) xbee_ring_put(xbee, &rx);
+
+    /* move the packet into an allocation of the right size */
+    if ((p = xbee_pkt_alloc2(xbee, &rx)) == NULL) {
+      xbee_atomic_inc(xbee->memDropped);
+      xbee_logE("Out of memory, frame dropped");
+      continue;
+    }
+
+    /* if: something is waiting on the frame ID, it gets the packet */
+    if ((p->type == xbee_localAT || p->type == xbee_remoteAT ||
+         p->type == xbee_txStatus || p->type == xbee2_txStatus) && xbee_frame_response(xbee, p)) {
+      xbee_logE("Response to a reserved frame ID");
+      p = NULL;
+      continue;
+    }
     p->next = NULL;
 
+    /* anything else is shed while the handle holds as much memory as it is allowed */
+    if (xbee_mem_full(xbee, xbee_pkt_size(p))) {
+      xbee_atomic_inc(xbee->memDropped);
+      xbee_logE("Memory limit reached, frame dropped");
+      Xfree(p);
+      continue;
+    }
+    /* this reference is handed to the connection's queue, or given back below */
+    xbee_mem_pkthold(xbee, p);
+
     /* lock the connection mutex */
     xbee_mutex_lock(xbee->conmutex);
 
@@ -2103,7 +5913,8 @@ static int xbee_listen(xbee_hnd xbee) {
       /* if the packet was broadcast, search for a broadcast accepting connection */
       con = xbee->conlist;
       while (con) {
-        if (con->type == p->type && 
+        if (!con->subscribe &&
+            con->type == p->type && 
             (con->type == xbee_16bitData || con->type == xbee_64bitData) &&
             ((con->tAddr64 && !memcmp(con->tAddr,t,8)) ||
              (!con->tAddr64 && !memcmp(con->tAddr,t,2)))) {
@@ -2117,7 +5928,7 @@ static int xbee_listen(xbee_hnd xbee) {
     if (!hasCon || !con) {
       con = xbee->conlist;
       while (con) {
-        if (xbee_matchpktcon(xbee, p, con)) {
+        if (!con->subscribe && xbee_matchpktcon(xbee, p, con)) {
           hasCon = 1;
           break;
         }
@@ -2125,12 +5936,55 @@ static int xbee_listen(xbee_hnd xbee) {
       }
     }
 
+    /* the copy given to subscriptions is stamped too */
+    p->queueTime = xbee_clock_ns();
+
+    /* a gateway gets its own copy of anything a node sent, before the
+       subscriptions can get hold of (and free) the packet */
+    if (xbee->gw && (p->dataPkt || p->IOPkt)) xbee_gw_rx(xbee, p);
+
+    /* every subscription that matches shares one packet. if a connection was found
+       above it keeps the packet to itself (it may be free()'d), and the subscriptions
+       share a copy */
+    subs = 0;
+    for (scon = (xbee->subscriptions?xbee->conlist:NULL); scon; scon = scon->next) {
+      if (scon->subscribe && xbee_matchpktcon(xbee, p, scon)) subs++;
+    }
+    if (subs && hasCon && xbee_mem_full(xbee, xbee_pkt_size(p))) {
+      xbee_atomic_inc(xbee->memDropped);
+      subs = 0;
+    } else if (subs && (q = (hasCon?xbee_pkt_alloc2(xbee, p):p)) == NULL) {
+      xbee_atomic_inc(xbee->memDropped);
+      subs = 0;
+    }
+    if (subs) {
+      q->refs = subs - 1;
+      /* the packet is counted once, with a reference for each subscription (without a
+         connection, the listen thread's own reference is handed to the first of them) */
+      for (j = ((q == p)?1:0); j < subs; j++) xbee_mem_pkthold(xbee, q);
+      /* q may be gone once the last subscription has it, so stop there */
+      for (j = 0, scon = xbee->conlist; scon && j < subs; scon = scon->next) {
+        if (scon->subscribe && xbee_matchpktcon(xbee, q, scon)) {
+          j++;
+          xbee_subscribe_add(xbee, scon, q);
+        }
+      }
+      q = NULL;
+    }
+
     /* unlock the connection mutex */
     xbee_mutex_unlock(xbee->conmutex);
 
     /* if the packet doesn't have a connection, don't add it! */
     if (!hasCon) {
+      if (subs) {
+        xbee_logE("Packet given to %d subscription(s)",subs);
+        p = NULL;
+        continue;
+      }
       xbee_logE("Connectionless packet... discarding!");
+      xbee_mem_pktrelease(xbee, p);
+      Xfree(p);
       continue;
     }
     if (con->sleeping) {
@@ -2140,7 +5994,7 @@ static int xbee_listen(xbee_hnd xbee) {
 
     /* if the connection has a callback function then it is passed the packet
        and the packet is not added to the list */
-    if (con && con->callback) {
+    if (con && (con->callback || con->batchCallback)) {
       t_callback_list *l, *q;
 
       xbee_mutex_lock(con->callbackListmutex);
@@ -2150,13 +6004,24 @@ static int xbee_listen(xbee_hnd xbee) {
         q = l;
         l = l->next;
       }
-      l = Xcalloc(sizeof(t_callback_list));
+      if (xbee_mem_full(xbee, sizeof(t_callback_list)) ||
+          (l = Xcalloc(sizeof(t_callback_list))) == NULL) {
+        xbee_mutex_unlock(con->callbackListmutex);
+        xbee_atomic_inc(xbee->memDropped);
+        xbee_logE("Out of memory, packet dropped");
+        xbee_mem_pktrelease(xbee, p);
+        Xfree(p);
+        continue;
+      }
       l->pkt = p;
+      xbee_mem_add(xbee, xbee_mem_callback, 1, sizeof(t_callback_list));
       if (!con->callbackList || q == NULL) {
         con->callbackList = l;
       } else {
         q->next = l;
       }
+      /* a batch that is lingering may now be full */
+      if (con->batchCallback) xbee_cond_signal(con->batchcond);
       xbee_mutex_unlock(con->callbackListmutex);
 
       xbee_logI("Using callback function!");
@@ -2170,16 +6035,28 @@ static int xbee_listen(xbee_hnd xbee) {
         xbee_thread_t t;
         int ret;
         t_threadList *p, *q;
-        t_CBinfo info;
-        info.xbee = xbee;
-        info.con = con;
+        t_CBinfo *info;
+        /* the callback thread free()s this, it can't live on our stack */
+        if ((info = Xcalloc(sizeof(t_CBinfo))) == NULL) {
+          xbee_mutex_unlock(con->callbackmutex);
+          xbee_logE("Out of memory starting the callback thread, the packet will wait for the next one");
+          p = NULL;
+          continue;
+        }
+        info->xbee = xbee;
+        info->con = con;
+        xbee_mem_add(xbee, xbee_mem_callback, 1, sizeof(t_CBinfo));
         xbee_log("Starting new callback thread!");
-        if ((ret = xbee_thread_create(t,xbee_callbackWrapper,&info)) != 0) {
+        if ((ret = xbee_thread_create(t,xbee_callbackWrapper,info)) != 0) {
+          xbee_mem_add(xbee, xbee_mem_callback, -1, sizeof(t_CBinfo));
+          Xfree(info);
           xbee_mutex_unlock(con->callbackmutex);
           /* this MAY help with future attempts... */
           xbee_sem_post(xbee->threadsem);
           xbee_logS("An error occured while starting thread (%d)... Out of resources?", ret);
           xbee_logE("This packet has been lost!");
+          /* it is still in the callback list though, so it isn't free'd */
+          p = NULL;
           continue;
         }
         xbee_log("Started thread 0x%08X!", t);
@@ -2190,14 +6067,19 @@ static int xbee_listen(xbee_hnd xbee) {
           q = p;
           p = p->next;
         }
-        p = Xcalloc(sizeof(t_threadList));
-        if (q == NULL) {
-          xbee->threadList = p;
+        if ((p = Xcalloc(sizeof(t_threadList))) == NULL) {
+          /* it can't be joined without a place in the list */
+          xbee_thread_detach(t);
         } else {
-          q->next = p;
+          if (q == NULL) {
+            xbee->threadList = p;
+          } else {
+            q->next = p;
+          }
+          p->thread = t;
+          p->next = NULL;
+          xbee_mem_add(xbee, xbee_mem_callback, 1, sizeof(t_threadList));
         }
-        p->thread = t;
-        p->next = NULL;
         xbee_mutex_unlock(xbee->threadmutex);
       } else {
         xbee_logE("Using existing callback thread... callback has been scheduled.");
@@ -2246,12 +6128,24 @@ static void xbee_callbackWrapper(t_CBinfo *info) {
   xbee_hnd xbee;
   xbee_con *con;
   xbee_pkt *pkt;
+  xbee_pkt **batch;
+  int batchLen;
   t_callback_list *temp;
   xbee = info->xbee;
   con = info->con;
+  xbee_mem_add(xbee, xbee_mem_callback, -1, sizeof(t_CBinfo));
+  Xfree(info);
+  batch = NULL;
+  batchLen = 0;
   /* dont forget! the callback mutex is already locked... by the parent thread :) */
   xbee_mutex_lock(con->callbackListmutex);
   while (con->callbackList) {
+    /* a batch callback is given everything that is waiting in one go */
+    if (con->batchCallback) {
+      xbee_callbackBatch(xbee, con, &batch, &batchLen);
+      continue;
+    }
+
     /* shift the list along 1 */
     temp = con->callbackList;
     con->callbackList = temp->next;
@@ -2264,11 +6158,33 @@ static void xbee_callbackWrapper(t_CBinfo *info) {
     xbee_logI("  function   @ 0x%08X",con->callback);
     xbee_logI("  connection @ 0x%08X",con);
     xbee_logE("  packet     @ 0x%08X",pkt);
+    xbee_mem_add(xbee, xbee_mem_callback, -1, sizeof(t_callback_list));
+    xbee_mem_pktrelease(xbee, pkt);
     Xfree(temp);
     if (con->callback) {
       con->callback(con,pkt);
       xbee_log("Callback complete!");
-      if (!con->noFreeAfterCB) Xfree(pkt);
+      if (!con->noFreeAfterCB) xbee_pkt_unref(pkt);
+    } else if (con->subscribe) {
+      t_callback_list *l, *q;
+      xbee_log("Callback function was removed! Appending packet to the subscription's list...");
+      if ((l = Xcalloc(sizeof(t_callback_list))) == NULL) {
+        xbee_atomic_inc(xbee->memDropped);
+        xbee_pkt_unref(pkt);
+        xbee_mutex_lock(con->callbackListmutex);
+        continue;
+      }
+      l->pkt = pkt;
+      xbee_mem_add(xbee, xbee_mem_callback, 1, sizeof(t_callback_list));
+      xbee_mem_pkthold(xbee, pkt);
+      xbee_mutex_lock(con->callbackListmutex);
+      if ((q = con->subList) == NULL) {
+        con->subList = l;
+      } else {
+        while (q->next) q = q->next;
+        q->next = l;
+      }
+      xbee_mutex_unlock(con->callbackListmutex);
     } else {
       xbee_pkt *q;
       int i;
@@ -2296,6 +6212,7 @@ static void xbee_callbackWrapper(t_CBinfo *info) {
       }
       xbee->pktlast = pkt;
       xbee->pktcount++;
+      xbee_mem_pkthold(xbee, pkt);
 
       /* unlock the packet mutex */
       xbee_mutex_unlock(xbee->pktmutex);
@@ -2304,6 +6221,7 @@ static void xbee_callbackWrapper(t_CBinfo *info) {
     xbee_mutex_lock(con->callbackListmutex);
   }
   xbee_mutex_unlock(con->callbackListmutex);
+  if (batch) Xfree(batch);
 
   xbee_log("Callback thread ending...");
   /* releasing the thread mutex is the last thing we do! */
@@ -2315,6 +6233,70 @@ static void xbee_callbackWrapper(t_CBinfo *info) {
   xbee_sem_post(xbee->threadsem);
 }
 
+/* #################################################################
+   xbee_callbackBatch - INTERNAL
+   gives the packets waiting for a connection to its batch callback, up to
+   batchMax of them, once there are that many or the oldest has lingered for long
+   enough. this is called by the callback thread with callbackListmutex held, and
+   returns with it held again. batch is the array the packets are passed in, it is
+   grown as needed and free()'d when the thread ends */
+static void xbee_callbackBatch(xbee_hnd xbee, xbee_con *con, xbee_pkt ***batch, int *batchLen) {
+  void (*callback)(xbee_con*,xbee_pkt**,int);
+  t_callback_list *l, *n;
+  unsigned long long waited;
+  xbee_pkt *one, **pkts;
+  int i, max;
+
+  /* wait for the batch to fill, or for the oldest packet to have lingered */
+  while (con->callbackList && con->batchCallback && con->batchLinger > 0) {
+    max = con->batchMax;
+    for (i = 0, l = con->callbackList; l && i < max; l = l->next) i++;
+    if (i >= max) break;
+    waited = (xbee_clock_ns() - ((t_callback_list *)con->callbackList)->pkt->queueTime) / 1000000ULL;
+    if (waited >= (unsigned long long)con->batchLinger) break;
+    xbee_cond_timedwait(con->batchcond, con->callbackListmutex, con->batchLinger - (int)waited);
+  }
+  if (!con->callbackList || (callback = con->batchCallback) == NULL) return;
+
+  /* take the batch off of the front of the list */
+  if ((max = con->batchMax) < 1) max = XBEE_BATCH_MAX;
+  if (*batchLen < max) {
+    xbee_mutex_unlock(con->callbackListmutex);
+    if (*batch) Xfree(*batch);
+    *batch = Xmalloc(sizeof(xbee_pkt *) * max);
+    *batchLen = (*batch?max:0);
+    xbee_mutex_lock(con->callbackListmutex);
+  }
+  /* without room for a batch the packets are given one at a time */
+  if ((pkts = *batch) == NULL) {
+    pkts = &one;
+    max = 1;
+  }
+  l = con->callbackList;
+  for (i = 1, n = l; i < max && n->next; i++) n = n->next;
+  con->callbackList = n->next;
+  n->next = NULL;
+  xbee_mutex_unlock(con->callbackListmutex);
+
+  for (i = 0; l; i++) {
+    pkts[i] = l->pkt;
+    xbee_mem_add(xbee, xbee_mem_callback, -1, sizeof(t_callback_list));
+    xbee_mem_pktrelease(xbee, l->pkt);
+    n = l->next;
+    Xfree(l);
+    l = n;
+  }
+
+  xbee_log("Starting batch callback function with %d packet(s)...",i);
+  callback(con,pkts,i);
+  if (!con->noFreeAfterCB) {
+    for (max = 0; max < i; max++) {
+      xbee_pkt_unref(pkts[max]);
+    }
+  }
+  xbee_mutex_lock(con->callbackListmutex);
+}
+
 /* #################################################################
    xbee_thread_watch - INTERNAL
    watches for dead threads and tidies up */
@@ -2341,6 +6323,7 @@ static void xbee_thread_watch(xbee_hnd xbee) {
         } else if (q) {
           q->next = t->next;
         }
+        xbee_mem_add(xbee, xbee_mem_callback, -1, sizeof(t_threadList));
         free(t);
       } else {
         q = t;
@@ -2362,19 +6345,35 @@ static unsigned char xbee_getbyte(xbee_hnd xbee) {
 
   /* take a byte */
   c = xbee_getrawbyte(xbee);
-  /* if its escaped, take another and un-escape */
-  if (c == 0x7D) c = xbee_getrawbyte(xbee) ^ 0x20;
+  /* if its escaped, take another and un-escape (API mode 1 has no escapes) */
+  if (c == 0x7D && xbee->apimode == 2) c = xbee_getrawbyte(xbee) ^ 0x20;
 
   return (c & 0xFF);
 }
 
 /* #################################################################
    xbee_getrawbyte - INTERNAL
-   waits for a raw byte of data */
+   waits for a raw byte of data (reads are buffered in xbee->rxstore) */
 static unsigned char xbee_getrawbyte(xbee_hnd xbee) {
   int ret;
   unsigned char c = 0x00;
 
+  /* anything given back by the listen thread comes first */
+  if (xbee->rxbackpos < xbee->rxbacklen) {
+    return xbee->rxback[xbee->rxbackpos++];
+  }
+
+  /* if there is still data in the buffer, then use that */
+  if (xbee->rxbufpos < xbee->rxbuflen) {
+    return xbee->rxbuf[xbee->rxbufpos++];
+  }
+
+  /* if reading from memory, then there is nothing left... stop listening */
+  if (!xbee->tty) {
+    xbee->run = 0;
+    return c;
+  }
+
   /* the loop is just incase there actually isnt a byte there to be read... */
   do {
     /* wait for a read to be possible */
@@ -2385,8 +6384,8 @@ static unsigned char xbee_getrawbyte(xbee_hnd xbee) {
     if (!xbee->run) break;
     if (ret == 0) continue;
 
-    /* read 1 character */
-    if (xbee_read(xbee,&c,1) == 0) {
+    /* read as many characters as are avaliable */
+    if ((ret = xbee_read(xbee,xbee->rxstore,sizeof(xbee->rxstore))) == 0) {
       /* for some reason no characters were read... */
       if (xbee_ferror(xbee)) {
         if (xbee_feof(xbee)) {
@@ -2407,32 +6406,73 @@ static unsigned char xbee_getrawbyte(xbee_hnd xbee) {
           continue;
         }
       }
+      /* a frame server that has gone away reads as EOF, don't spin on it */
+      if (xbee->client && xbee_feof(xbee)) {
+        usleep(100000);
+        continue;
+      }
       /* no error... try again */
       usleep(10);
       continue;
     }
+
+    /* take the first character, and keep the rest for later */
+    xbee->rxbuf = xbee->rxstore;
+    xbee->rxbuflen = ret;
+    xbee->rxbufpos = 1;
+    c = xbee->rxbuf[0];
   } while (0);
 
   return (c & 0xFF);
 }
 
+/* #################################################################
+   xbee_ungetbytes - INTERNAL
+   gives bytes back so that they are read again before anything else
+   used in API mode 1 to look for a frame inside one that turned out to be bad */
+static void xbee_ungetbytes(xbee_hnd xbee, const unsigned char *buf, int len) {
+  int rest;
+
+  if (len > XBEE_RXBACKLEN) len = XBEE_RXBACKLEN;
+  rest = xbee->rxbacklen - xbee->rxbackpos;
+  if (rest > XBEE_RXBACKLEN - len) rest = XBEE_RXBACKLEN - len;
+
+  /* anything not read yet goes after the returned bytes */
+  memmove(&xbee->rxback[len], &xbee->rxback[xbee->rxbackpos], rest);
+  memcpy(xbee->rxback, buf, len);
+  xbee->rxbackpos = 0;
+  xbee->rxbacklen = len + rest;
+}
+
 /* #################################################################
    _xbee_send_pkt - INTERNAL
    sends a complete packet of data */
 static int _xbee_send_pkt(xbee_hnd xbee, t_data *pkt, xbee_con *con) {
   int retval = 0;
+  int ret;
+
+  /* xbee_make_pkt() gives NULL if the frame was too long, or memory ran out */
+  if (!pkt) return 1;
 
-  /* lock connection mutex */
-  xbee_mutex_lock(con->Txmutex);
+  /* lock connection mutex (frames sent by a gateway don't have a connection) */
+  if (con) xbee_mutex_lock(con->Txmutex);
+  /* waiting from before the write, the status can arrive before it returns */
+  if (con && con->waitforACK &&
+      ((con->type == xbee_16bitData) ||
+       (con->type == xbee_64bitData))) {
+    con->ACKstatus = 0xFF;
+  }
   /* lock the send mutex */
   xbee_mutex_lock(xbee->sendmutex);
   
   /* write and flush the data */
-  xbee_write(xbee,pkt->data,pkt->length);
+  if ((ret = xbee_write_all(xbee,pkt->data,pkt->length)) != pkt->length) retval = 1;
 
   /* unlock the mutex */
   xbee_mutex_unlock(xbee->sendmutex);
 
+  if (retval) xbee_log("TX: only %d of %d bytes were written...",ret,pkt->length);
+
   xbee_logSf();
   if (xbee->log) {
     int i,x,y;
@@ -2453,10 +6493,9 @@ static int _xbee_send_pkt(xbee_hnd xbee, t_data *pkt, xbee_con *con) {
   }
   xbee_logEf();
   
-  if (con->waitforACK &&
+  if (!retval && con && con->waitforACK &&
       ((con->type == xbee_16bitData) ||
        (con->type == xbee_64bitData))) {
-    con->ACKstatus = 0xFF; /* waiting */
     xbee_log("Waiting for ACK/NAK response...");
     xbee_sem_wait1sec(con->waitforACKsem);
     switch (con->ACKstatus) {
@@ -2470,9 +6509,10 @@ static int _xbee_send_pkt(xbee_hnd xbee, t_data *pkt, xbee_con *con) {
   }
   
   /* unlock connection mutex */
-  xbee_mutex_unlock(con->Txmutex);
+  if (con) xbee_mutex_unlock(con->Txmutex);
 
   /* free the packet */
+  xbee_mem_add(xbee, xbee_mem_tx, -1, sizeof(t_data));
   Xfree(pkt);
   
   return retval;
@@ -2497,7 +6537,8 @@ static t_data *xbee_make_pkt(xbee_hnd xbee, unsigned char *data, int length) {
   l = 3 + length + 1;
 
   /* prepare memory */
-  pkt = Xcalloc(sizeof(t_data));
+  if ((pkt = Xcalloc(sizeof(t_data))) == NULL) return NULL;
+  xbee_mem_add(xbee, xbee_mem_tx, 1, sizeof(t_data));
 
   /* put start byte on */
   pkt->data[0] = 0x7E;
@@ -2514,11 +6555,12 @@ static t_data *xbee_make_pkt(xbee_hnd xbee, unsigned char *data, int length) {
     else if (m > 2) d = data[i];
 
     x = 0;
-    /* check for any escapes needed */
-    if ((d == 0x11) || /* XON */
+    /* check for any escapes needed (API mode 1 has none) */
+    if (xbee->apimode == 2 &&
+       ((d == 0x11) || /* XON */
         (d == 0x13) || /* XOFF */
         (d == 0x7D) || /* Escape */
-        (d == 0x7E)) { /* Frame Delimiter */
+        (d == 0x7E))) { /* Frame Delimiter */
       l++;
       pkt->data[o++] = 0x7D;
       x = 1;
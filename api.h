@@ -31,6 +31,15 @@
 #ifdef __GNUC__ /* ---- */
 #include <unistd.h>
 #include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #define __USE_GNU
 #include <pthread.h>
 #undef __USE_GNU
@@ -42,6 +51,12 @@
 #include <sys/timeb.h>
 #endif /* ------------- */
 
+/* SSE2 is used for bulk analog conversion when the compiler has it enabled */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define XBEE_SSE2
+#include <emmintrin.h>
+#endif
+
 #ifdef __UMAKEFILE
   #define HOST_OS "Embedded"
 #elif defined(__GNUC__)
@@ -57,6 +72,88 @@
 
 #define M8(x) (x & 0xFF)
 
+/* number of bytes read from the serial port at a time */
+#define XBEE_RXBUFLEN 256
+
+/* in API mode 1 the bytes of a bad frame are read again to find the real start,
+   so this holds the largest frame the listen thread takes, with its length and checksum */
+#define XBEE_RXBACKLEN (1024 + 3)
+
+/* I/O sample sink - number of hash buckets (must be a power of 2) and
+   the most nodes that will be tracked */
+#define XBEE_IOSINK_HASH     64
+#define XBEE_IOSINK_MAXNODES 1024
+
+/* node table - number of hash buckets (must be a power of 2) and
+   the most nodes that will be tracked */
+#define XBEE_NODE_HASH       64
+#define XBEE_NODE_MAXNODES   1024
+
+/* background node discovery - the longest a round may take (NT can be up to
+   25.5 seconds), and the number of rounds a node may miss before it is removed */
+#define XBEE_DISCOVER_TIMEOUT 30000
+#define XBEE_DISCOVER_MISSES  3
+
+/* remote AT cache - the frame ID used for its requests, how long a request may
+   take, the number of hash buckets (must be a power of 2) and the most
+   parameters that will be held (after that the least recently used is replaced) */
+#define XBEE_ATCACHE_FRAMEID  0xFC
+#define XBEE_ATCACHE_TIMEOUT  5000
+#define XBEE_ATCACHE_HASH     256
+#define XBEE_ATCACHE_MAX      4096
+
+/* AT batches - the most requests that are sent before waiting for a response,
+   and how long each response may take */
+#define XBEE_ATBATCH_WINDOW   16
+#define XBEE_ATBATCH_TIMEOUT  5000
+
+/* API mode probes (used to find the baud rate, and to skip command mode) - the
+   frame ID used (these are only sent before the listen thread starts) and how
+   long the XBee is given to answer */
+#define XBEE_AUTOBAUD_FRAMEID 0x01
+#define XBEE_AUTOBAUD_TIMEOUT 250
+
+/* transmit - how long a write may go without making progress before it is
+   abandoned, and the most bytes left in the driver's output queue when using
+   hardware flow control (so that a deasserted CTS stops us promptly) */
+#define XBEE_TX_TIMEOUT       5000
+#define XBEE_TX_OUTQ          256
+
+/* batched callbacks - the most packets given to each call if no limit is set */
+#define XBEE_BATCH_MAX        64
+
+/* gateways - the most radios in one, how long a Tx status is waited for, how many
+   sends a radio may time out in a row before it is taken out of use, how long it
+   is out of use for, how long the radio that heard a node is kept even if another
+   hears it better, the number of hash buckets for the nodes heard (must be a
+   power of 2) and the most nodes that will be tracked */
+#define XBEE_GW_MAXRADIOS     32
+#define XBEE_GW_TIMEOUT       2000
+#define XBEE_GW_FAILS         3
+#define XBEE_GW_RETRY         5000
+#define XBEE_GW_STALE         2000
+#define XBEE_GW_HASH          64
+#define XBEE_GW_MAXNODES      1024
+
+/* frame server - the most clients, the bytes queued for a client before frames
+   to it are dropped, the most filter rules a client may give, how long the frame
+   ID given to a client's request is kept for its response, and the API identifier
+   that clients send their filter rules with, one per frame (no XBee uses it) */
+#define XBEE_SERVE_MAXCLIENTS 32
+#define XBEE_SERVE_QUEUE      65536
+#define XBEE_SERVE_MAXRULES   16
+#define XBEE_SERVE_TIMEOUT    10000
+#define XBEE_SERVE_SETFILTER  0xF0
+
+/* packet rings - the number of slots used if none is given, and the most */
+#define XBEE_RING_SLOTS       256
+#define XBEE_RING_MAXSLOTS    65536
+#define XBEE_RING_MAGIC       0x58425247 /* "XBRG" */
+#define XBEE_RING_VERSION     1
+/* a slot holds the largest packet that the listen thread can decode */
+#define XBEE_RING_SLOTSIZE    (((sizeof(t_ringslot) + sizeof(xbee_pkt) + \
+                                 (sizeof(xbee_sample) * 255) + XBEE_PKT_MAXDATA) + 63) & ~63)
+
 /* various connection types */
 #define XBEE_LOCAL_AT     0x88
 #define XBEE_LOCAL_ATREQ  0x08
@@ -79,7 +176,11 @@
 /* XBee Series 2 stuff */
 #define XBEE2_DATATX      0x10
 #define XBEE2_DATARX      0x90
+#define XBEE2_EXPLICITTX  0x11
+#define XBEE2_EXPLICITRX  0x91
 #define XBEE2_TX_STATUS   0x8B
+#define XBEE2_IO          0x92
+#define XBEE2_NODEIDENT   0x95
 
 typedef struct xbee_hnd* xbee_hnd;
 
@@ -92,6 +193,240 @@ struct t_threadList {
   t_threadList *next;
 };
 
+/* a node's I/O samples, held as a ring buffer of columns
+   the columns are all allocated in one block, starting at time */
+typedef struct t_ionode t_ionode;
+struct t_ionode {
+  int addr64;
+  unsigned char addr[8];
+  int head;                   /* where the next sample will be written */
+  int count;                  /* number of samples held */
+  unsigned long total;        /* number of samples ever recorded */
+  unsigned long long *time;
+  unsigned short *mask;
+  unsigned short *digital;
+  unsigned short *analog[6];
+  t_ionode *next;
+};
+
+/* an entry in the node table, linked into a hash chain for each key
+   (it is only in the 16-bit / NI chains if it has one, see in16 and inNI) */
+typedef struct t_node t_node;
+struct t_node {
+  xbee_node info;
+  int in16;
+  int inNI;
+  int announced;              /* TRUE once the join has been given to the discovery callback */
+  int missed;                 /* discovery rounds in a row that the node hasn't answered */
+  t_node *next64;
+  t_node *next16;
+  t_node *nextNI;
+};
+
+/* a cached remote AT parameter, keyed by the node's 64-bit address and the command */
+typedef struct t_atcache t_atcache;
+struct t_atcache {
+  unsigned char key[10];
+  int state;                  /* one of XBEE_ATC_* */
+  int stale;                  /* set if the parameter was written while a read was pending */
+  unsigned long seq;          /* incremented each time a request completes */
+  unsigned char status;
+  unsigned char value[128];
+  int len;
+  unsigned long long fetched; /* when the value was recieved */
+  unsigned long long used;    /* when it was last looked up, the oldest is replaced first */
+  int users;                  /* threads in xbee_atcache_get() using the entry, it can't be replaced */
+  t_atcache *next;
+};
+#define XBEE_ATC_EMPTY    0
+#define XBEE_ATC_PENDING  1
+#define XBEE_ATC_VALID    2
+
+/* a frame ID that an internal request is waiting on, see xbee_frame_alloc() */
+typedef struct t_framewait t_framewait;
+struct t_framewait {
+  int used;
+  xbee_pkt *pkt;              /* the response, once it has arrived */
+};
+
+/* a filter rule with its offsets resolved for one API type, see xbee_setfilter() */
+typedef struct t_filterrule t_filterrule;
+struct t_filterrule {
+  int action;
+  int addrOff;                /* where the address is in the frame, addrLen = 0 for any */
+  int addrLen;
+  unsigned char addrLo[8];
+  unsigned char addrHi[8];
+  int rssiOff;                /* -1 for any */
+  int RSSI;
+  int matchOff;               /* where the payload match starts in the frame */
+  int matchLen;               /* 0 for any */
+  unsigned char match[16];
+};
+
+/* the frame types that can be filtered, see xbee_filter_type() */
+#define XBEE_FILTER_TYPES 7
+
+typedef struct t_filterset t_filterset;
+struct t_filterset {
+  int defaultAction;
+  int count[XBEE_FILTER_TYPES];
+  t_filterrule *rules[XBEE_FILTER_TYPES];
+};
+
+/* a frame that has been seen recently, see xbee_dedup() */
+typedef struct t_dedupent t_dedupent;
+struct t_dedupent {
+  unsigned int h1;            /* two different hashes of the frame, so that */
+  unsigned int h2;            /* a collision doesn't drop a frame that is wanted */
+  unsigned long long seen;    /* 0 if the entry is unused */
+};
+
+/* each hash picks a set of XBEE_DEDUP_WAYS entries, the oldest is replaced */
+#define XBEE_DEDUP_WAYS  4
+#define XBEE_DEDUP_MAX   65536
+
+typedef struct t_dedup t_dedup;
+struct t_dedup {
+  unsigned long long window;  /* nanoseconds */
+  unsigned int sets;          /* a power of 2 */
+  t_dedupent *ents;           /* sets * XBEE_DEDUP_WAYS */
+};
+
+/* a node that a gateway has heard from, and the radio that heard it best */
+typedef struct t_gwnode t_gwnode;
+struct t_gwnode {
+  unsigned char addr[8];      /* 64-bit 0-7   16-bit 0-1 */
+  int addr64;
+  int radio;
+  int RSSI;                   /* -dBm, 0 if the frame doesn't carry it */
+  unsigned long long heard;
+  t_gwnode *next;
+};
+
+typedef struct t_gwradio t_gwradio;
+struct t_gwradio {
+  xbee_hnd xbee;
+  int inflight;               /* sends in progress */
+  int fails;                  /* sends in a row that got no answer */
+  unsigned long long downUntil; /* not used until then, 0 if it is up */
+};
+
+/* a packet waiting to be collected from a gateway */
+typedef struct t_gwpkt t_gwpkt;
+struct t_gwpkt {
+  xbee_pkt *pkt;
+  int radio;
+  t_gwpkt *next;
+};
+
+struct xbee_gw {
+  t_gwradio radios[XBEE_GW_MAXRADIOS];
+  int count;
+  int policy;                 /* XBEE_GW_* given to xbee_gw_new() */
+  unsigned int rotate;        /* spreads ties in load across the radios */
+
+  xbee_mutex_t mutex;         /* taken after a handle's conmutex, never log while it is held */
+  xbee_cond_t cond;
+  t_gwpkt *rxlist;
+  t_gwpkt *rxlast;
+  int nodecount;
+  t_gwnode *nodes[XBEE_GW_HASH];
+
+  void (*callback)(xbee_gw *gw, int radio, xbee_pkt *pkt);
+  xbee_thread_t thread;
+  volatile int run;
+};
+
+/* a process sharing the XBee through the frame server, see xbee_serve() */
+typedef struct t_serveclient t_serveclient;
+struct t_serveclient {
+  int fd;
+  unsigned char in[XBEE_RXBACKLEN + 1]; /* a partly recieved frame */
+  int inlen;
+  unsigned char *out;         /* XBEE_SERVE_QUEUE bytes waiting to be sent to it */
+  int outlen;
+  t_filterset *filters;       /* NULL to be given everything */
+  xbee_filter rules[XBEE_SERVE_MAXRULES]; /* the rules recieved so far, see xbee_serve_frame() */
+  unsigned long dropped;      /* frames that didn't fit in out */
+  t_serveclient *next;
+};
+
+/* the client that a frame ID was given out for, and its own frame ID */
+typedef struct t_servemap t_servemap;
+struct t_servemap {
+  t_serveclient *client;      /* NULL if the frame ID isn't in use */
+  unsigned char frameID;
+  int multi;                  /* TRUE if more than one response is expected (ND) */
+  unsigned long long sent;
+};
+
+typedef struct t_serve t_serve;
+struct t_serve {
+  xbee_hnd xbee;
+  int fd;                     /* the listening socket */
+  int wake[2];                /* a pipe, written to when a client's output is queued */
+  char *path;                 /* a unix socket, removed when the server stops */
+  int nclients;
+  t_serveclient *clients;
+  t_servemap map[256];
+  xbee_thread_t thread;
+  volatile int run;
+};
+
+/* the start of a packet ring's shared memory, it is followed by the slots.
+   everything is written by the publisher alone - packet n goes into slot
+   (n % slots), and then head is moved on to n + 1. the counters are 32 bits so
+   that they are read in one go everywhere, and they are allowed to wrap */
+typedef struct t_ringhdr t_ringhdr;
+struct t_ringhdr {
+  unsigned int magic;         /* XBEE_RING_MAGIC */
+  unsigned int version;       /* XBEE_RING_VERSION */
+  unsigned int pktsize;       /* sizeof(xbee_pkt) - readers built with another xbee.h are turned away */
+  unsigned int slots;         /* a power of 2 */
+  unsigned int slotsize;
+  volatile unsigned int open; /* cleared when the publisher stops */
+  volatile unsigned int head; /* the number of packets published */
+  unsigned char pad[36];      /* keeps the slots on their own cache lines */
+};
+
+/* seq is n while packet n is being written into the slot, and n + 1 once it has
+   been. a reader checks that it is n + 1 before and after copying the packet out,
+   so it never uses one that was overwritten underneath it. the packet is laid out
+   as xbee_pkt_alloc2() does it, with the samples and then the data after it */
+typedef struct t_ringslot t_ringslot;
+struct t_ringslot {
+  volatile unsigned int seq;
+  unsigned int len;
+};
+
+/* the publishing end of a packet ring, see xbee_ring_publish() */
+typedef struct t_ring t_ring;
+struct t_ring {
+  char *name;
+  t_ringhdr *hdr;
+  size_t size;
+};
+
+/* the reading end of a packet ring, see xbee_ring_attach() */
+struct xbee_ring {
+  const t_ringhdr *hdr;
+  size_t size;
+  unsigned long long next;    /* the sequence number of the next packet to be read */
+  unsigned long lost;
+  xbee_pkt *pkt;              /* the last packet read, XBEE_RING_SLOTSIZE bytes */
+};
+
+/* the layout of each I/O sample for a mask, see xbee_io_layout() */
+typedef struct t_iolayout t_iolayout;
+struct t_iolayout {
+  int mask;
+  int len;                    /* bytes used by each sample */
+  int digital;                /* TRUE if each sample starts with the digital inputs */
+  int nanalog;
+  unsigned char analog[6];    /* the analog inputs present, in the order they are sent */
+};
+
 struct xbee_hnd {
   xbee_file_t tty;
 #ifdef __GNUC__ /* ---- */
@@ -108,12 +443,30 @@ struct xbee_hnd {
 
   char *path; /* serial port path */
 
+  /* recieve buffer, filled by xbee_getrawbyte()
+     if tty is NULL then rxbuf is an in-memory source, and the listen
+     thread will stop once it has been consumed */
+  const unsigned char *rxbuf;
+  int rxbuflen;
+  int rxbufpos;
+  unsigned char rxstore[XBEE_RXBUFLEN];
+
+  /* bytes given back by the listen thread, these are read before rxbuf */
+  unsigned char rxback[XBEE_RXBACKLEN];
+  int rxbacklen;
+  int rxbackpos;
+
+  /* the last I/O sample layout used by the listen thread
+     (all zeros is the layout for a mask of 0, so it needs no setup) */
+  t_iolayout iolayout;
+
   xbee_mutex_t logmutex;
   FILE *log;
   int logfd;
 
   xbee_mutex_t conmutex;
   xbee_con *conlist;
+  int subscriptions;                /* the number of subscriptions in conlist */
 
   xbee_mutex_t pktmutex;
   xbee_pkt *pktlist;
@@ -122,6 +475,83 @@ struct xbee_hnd {
   
   xbee_mutex_t sendmutex;
 
+  /* I/O sample sink, see xbee_iosink() */
+  xbee_mutex_t iosinkmutex;
+  int iosinkcap;      /* samples held per node, 0 = disabled */
+  int iosinkpass;     /* pass I/O packets on to connections too */
+  int iosinknodes;
+  t_ionode *iosink[XBEE_IOSINK_HASH];
+
+  /* node table, filled from ND responses and 0x95 frames */
+  xbee_mutex_t nodemutex;
+  int nodecount;
+  t_node *nodes64[XBEE_NODE_HASH];
+  t_node *nodes16[XBEE_NODE_HASH];
+  t_node *nodesNI[XBEE_NODE_HASH];
+
+  /* background node discovery, see xbee_discover() */
+  xbee_thread_t discovert;
+  xbee_sem_t discoversem;     /* posted when a round ends or a new node is found */
+  volatile int discoverrun;
+  volatile int discoverdone;  /* set when the end of the current round is seen */
+  int discovermin;            /* milliseconds */
+  int discovermax;
+  int discoverinterval;
+  void (*discovercb)(xbee_node *node, int event);
+  xbee_con *discovercon;      /* private, it isn't in the connection list */
+  volatile int discoverframe; /* the frame ID reserved for the ND requests, see xbee_frame_alloc() */
+
+  /* remote AT parameter cache, see xbee_atcache_get() */
+  xbee_mutex_t atcachemutex;
+  xbee_cond_t atcachecond;    /* broadcast whenever a request completes */
+  int atcachecount;
+  t_atcache *atcache[XBEE_ATCACHE_HASH];
+
+  /* frame IDs reserved by internal requests (e.g. xbee_at_batch())
+     responses with these IDs are held here instead of given to a connection */
+  xbee_mutex_t framemutex;
+  xbee_cond_t framecond;      /* broadcast whenever a response arrives */
+  int framenext;
+  t_framewait frames[256];
+
+  /* frame filters, see xbee_setfilter(). the listen thread only uses 'filters',
+     a new set is left in 'filternext' for it to pick up */
+  xbee_mutex_t filtermutex;
+  t_filterset *filters;
+  t_filterset *filternext;
+  volatile int filterchanged;
+  volatile unsigned long filterrejected;
+
+  /* duplicate frame suppression, see xbee_dedup(). handed over like the filters */
+  xbee_mutex_t dedupmutex;
+  t_dedup *dedup;
+  t_dedup *dedupnext;
+  volatile int dedupchanged;
+  volatile unsigned long dedupsuppressed;
+
+  /* the gateway this radio is part of, see xbee_gw_new(). changed under conmutex */
+  xbee_gw *gw;
+  int gwradio;
+
+  /* the frame server run by xbee_serve() (changed under servemutex), and TRUE
+     if this handle is itself a client of one */
+  xbee_mutex_t servemutex;
+  t_serve *serve;
+  int client;
+
+  /* the packet ring given everything that is decoded, see xbee_ring_publish().
+     changed under ringmutex */
+  xbee_mutex_t ringmutex;
+  t_ring *ring;
+
+  /* memory accounting, see xbee_memstats() - updated with xbee_atomic_add() */
+  volatile long memBytes;
+  volatile long memObjects[xbee_mem_types];
+  volatile long memTypeBytes[xbee_mem_types];
+  unsigned long memLimit;     /* 0 = no limit */
+  volatile long memDropped;   /* frames dropped because of the limit, or a failed allocation */
+  volatile long memFailed;    /* allocations that failed */
+
   xbee_thread_t listent;
   
   xbee_thread_t threadt;
@@ -134,10 +564,15 @@ struct xbee_hnd {
   int oldAPI;
   char cmdSeq;
   int cmdTime;
+  int flags;                  /* XBEE_SETUP_* given to xbee_setupflags() */
+  int apimode;                /* 1 or 2, 2 escapes special bytes */
 
   /* ready flag.
-     needs to be set to -1 so that the listen thread can begin. */
+     needs to be set to -1 so that the listen thread can begin, it then sets
+     it to -2 and signals readycond */
   volatile int xbee_ready;
+  xbee_mutex_t readymutex;
+  xbee_cond_t readycond;
   
   xbee_hnd next;
 };
@@ -170,12 +605,14 @@ struct t_callback_list {
 
 static void *Xmalloc2(xbee_hnd xbee, size_t size);
 static void *Xcalloc2(xbee_hnd xbee, size_t size);
-static void *Xrealloc2(xbee_hnd xbee, void *ptr, size_t size);
 static void Xfree2(void **ptr);
+static void xbee_mem_add(xbee_hnd xbee, int type, int count, size_t size);
+static int xbee_mem_full(xbee_hnd xbee, size_t size);
 #define Xmalloc(x)     Xmalloc2(xbee,(x))
 #define Xcalloc(x)     Xcalloc2(xbee,(x))
-#define Xrealloc(x,y)  Xrealloc2(xbee,(x),(y))
 #define Xfree(x)       Xfree2((void **)&x)
+/* the bytes used by a packet laid out as xbee_pkt_alloc2() does it */
+#define xbee_pkt_size(p) (sizeof(xbee_pkt) + (sizeof(xbee_sample) * (p)->samples) + (p)->datalen)
 
 /* usage:
     xbee_logSf()   lock the log
@@ -213,27 +650,106 @@ static void xbee_logf(xbee_hnd xbee, const char *logformat, const char *file,
   perror(str);
 
 static int xbee_startAPI(xbee_hnd xbee);
+static int xbee_autobaud(xbee_hnd xbee);
+static int xbee_probe(xbee_hnd xbee);
+static int xbee_autobaud_match(unsigned char *buf, int len, int escaped);
 
 static int xbee_sendAT(xbee_hnd xbee, char *command, char *retBuf, int retBuflen);
 static int xbee_sendATdelay(xbee_hnd xbee, int guardTime, char *command, char *retBuf, int retBuflen);
 
+static int xbee_pkt_minlen(unsigned char t);
+static void xbee_copydata(xbee_hnd xbee, xbee_pkt *p, unsigned char *d, int len);
+static t_iolayout *xbee_io_layout(xbee_hnd xbee, int mask);
+static t_iolayout *xbee2_io_layout(t_iolayout *l, int dmask, int amask);
 static int xbee_parse_io(xbee_hnd xbee, xbee_pkt *p, unsigned char *d,
-                         int maskOffset, int sampleOffset, int sample);
+                         t_iolayout *l, int sampleOffset, int count);
+static void xbee_analog_convert(xbee_sample *s, int count, int input, float scale, float *out);
+
+static void xbee_iosink_free(xbee_hnd xbee);
+static t_ionode *xbee_iosink_find(xbee_hnd xbee, int addr64, unsigned char *addr, int create);
+static int xbee_iosink_add(xbee_hnd xbee, xbee_pkt *p);
+
+static unsigned int xbee_hash(const unsigned char *data, int len);
+
+static void xbee_node_free(xbee_hnd xbee);
+static int xbee_node_parse(xbee_node *n, unsigned char *d, int len, int zigbee);
+static void xbee_node_update(xbee_hnd xbee, xbee_node *n);
+static void xbee_node_unlink(xbee_hnd xbee, t_node *n, int all);
+
+static void xbee_atcache_free(xbee_hnd xbee);
+static t_atcache *xbee_atcache_find(xbee_hnd xbee, unsigned char *addr, unsigned char *cmd, int create);
+static t_atcache *xbee_atcache_evict(xbee_hnd xbee);
+static int xbee_atcache_direct(xbee_hnd xbee, xbee_con *con, char *cmd, unsigned char *value, int maxlen);
+static int xbee_atcache_response(xbee_hnd xbee, xbee_pkt *p);
+static void xbee_atcache_written(xbee_hnd xbee, xbee_con *con, char *data, int length);
+
+static int xbee_frame_alloc(xbee_hnd xbee);
+static xbee_pkt *xbee_frame_wait(xbee_hnd xbee, int frameID, int timeout);
+static void xbee_frame_free(xbee_hnd xbee, int frameID);
+static int xbee_frame_response(xbee_hnd xbee, xbee_pkt *p);
+static int xbee_at_request(xbee_hnd xbee, xbee_con *con, int frameID, int queue,
+                           char *cmd, unsigned char *param, int paramlen);
+
+static int xbee_filter_apitype(int k);
+static int xbee_filter_type(unsigned char t, int *addr16, int *rssi, int *payload);
+static int xbee_filter_compile(xbee_hnd xbee, xbee_filter *rules, int count, int defaultAction, t_filterset **set);
+static void xbee_filter_setfree(t_filterset *f);
+static void xbee_filter_swap(xbee_hnd xbee);
+static int xbee_filter_run(t_filterset *f, unsigned char t, unsigned char *d, int len);
+
+static void xbee_dedup_free(t_dedup *dd);
+static void xbee_dedup_swap(xbee_hnd xbee);
+static int xbee_dedup_seen(t_dedup *dd, unsigned char t, unsigned char *d, int len);
+
+static void xbee_gw_rx(xbee_hnd xbee, xbee_pkt *p);
+static t_gwnode *xbee_gw_node(xbee_gw *gw, unsigned char *addr, int addr64);
+static int xbee_gw_order(xbee_gw *gw, unsigned char *addr, int addr64, int *order);
+static int xbee_gw_send(xbee_gw *gw, int radio, unsigned char *buf, int len);
+static void xbee_gw_thread(xbee_gw *gw);
+
+static int xbee_serve_rx(xbee_hnd xbee, unsigned char t, unsigned char *d, int len);
+static void xbee_serve_queue(t_serve *s, t_serveclient *c, unsigned char t, unsigned char *d, int len);
+static void xbee_serve_thread(t_serve *s);
+static int xbee_serve_input(t_serve *s, t_serveclient *c);
+static void xbee_serve_frame(t_serve *s, t_serveclient *c, unsigned char *f, int len);
+static void xbee_serve_drop(t_serve *s, t_serveclient *c);
+static void xbee_serve_expire(t_serve *s);
+static int xbee_serve_putrule(unsigned char *buf, xbee_filter *rules, int count, int defaultAction, int i);
+
+static void xbee_ring_put(xbee_hnd xbee, xbee_pkt *p);
+
+static void xbee_discover_stop(xbee_hnd xbee);
+static void xbee_discover_thread(xbee_hnd xbee);
+static int xbee_discover_events(xbee_hnd xbee, unsigned long long roundStart);
 
 static void xbee_thread_watch(xbee_hnd xbee);
 static void xbee_listen_wrapper(xbee_hnd xbee);
+static xbee_hnd xbee_setup_open(char *path, int baudrate, int logfd, char cmdSeq, int cmdTime, int flags);
+static void xbee_setup_undo(xbee_hnd xbee);
+static void xbee_setup_link(xbee_hnd xbee);
+static void xbee_setup_thread(xbee_setupinfo *info);
 static int xbee_listen(xbee_hnd xbee);
 static unsigned char xbee_getbyte(xbee_hnd xbee);
 static unsigned char xbee_getrawbyte(xbee_hnd xbee);
+static void xbee_ungetbytes(xbee_hnd xbee, const unsigned char *buf, int len);
 static int xbee_matchpktcon(xbee_hnd xbee, xbee_pkt *pkt, xbee_con *con);
 
 static t_data *xbee_make_pkt(xbee_hnd xbee, unsigned char *data, int len);
 static int _xbee_send_pkt(xbee_hnd xbee, t_data *pkt, xbee_con *con);
 static void xbee_callbackWrapper(t_CBinfo *info);
+static void xbee_callbackBatch(xbee_hnd xbee, xbee_con *con, xbee_pkt ***batch, int *batchLen);
+
+static xbee_con *xbee_vnewcon2(xbee_hnd xbee, unsigned char frameID, xbee_types type, va_list ap, int subscribe);
+static int xbee_subscribe_add(xbee_hnd xbee, xbee_con *con, xbee_pkt *p);
+static xbee_pkt *xbee_pkt_alloc2(xbee_hnd xbee, xbee_pkt *rx);
 
 /* these functions can be found in the xsys files */
 static int init_serial(xbee_hnd xbee, int baudrate);
+static int xbee_serial_speed(xbee_hnd xbee, int baudrate);
 static int xbee_select(xbee_hnd xbee, struct timeval *timeout);
+static int xbee_socket(xbee_hnd xbee, const char *addr, int server);
+static int xbee_write_all(xbee_hnd xbee, const unsigned char *data, int len);
+static unsigned long long xbee_clock_ns(void);
 
 #ifdef __GNUC__ /* ---- */
 #include "xsys/linux.c"
@@ -0,0 +1,1498 @@
+/*
+  libxbee - a C library to aid the use of Digi's Series 1 XBee modules
+            running in API mode (AP=2).
+
+  Copyright (C) 2009  Attie Grande (attie@attie.co.uk)
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* this benchmark runs libxbee against a simulated module on a pty, and
+   prints the results as JSON so that they can be compared between versions
+
+   usage: bench [-s scale] [case ...]
+     cases: rx apimode filter getpacket callback tx txflow at atbatch atcache iosink analog pktmem setup gateway ring memlimit serve (default: all) */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <malloc.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "../xbee.h"
+#include "sim.h"
+
+static int scale = 1;
+static int firstCase = 1;
+
+/* ################################################################# */
+/* ### Helpers ##################################################### */
+/* ################################################################# */
+
+static int cmpull(const void *a, const void *b) {
+  unsigned long long x = *(const unsigned long long *)a;
+  unsigned long long y = *(const unsigned long long *)b;
+  return (x < y)?-1:(x > y);
+}
+
+/* prints mean / p50 / p99 of the given latencies (ns) as JSON members in microseconds */
+static void print_latency(unsigned long long *lat, int n) {
+  unsigned long long sum = 0;
+  int i;
+  if (n <= 0) {
+    printf("\"samples\": 0");
+    return;
+  }
+  qsort(lat, n, sizeof(*lat), cmpull);
+  for (i = 0; i < n; i++) sum += lat[i];
+  printf("\"samples\": %d, \"mean_us\": %.2f, \"p50_us\": %.2f, \"p99_us\": %.2f, \"max_us\": %.2f",
+         n, (sum / (double)n) / 1000.0, lat[n / 2] / 1000.0,
+         lat[(n * 99) / 100] / 1000.0, lat[n - 1] / 1000.0);
+}
+
+static void begin_case(const char *name) {
+  printf("%s\n  \"%s\": ", (firstCase?"":","), name);
+  firstCase = 0;
+}
+
+/* builds a 16-bit data frame (0x81) from addr, with the timestamp as the first 8 bytes */
+static int make_rx16(unsigned char *out, int addr, unsigned long long stamp, int payload) {
+  unsigned char api[128];
+  int i;
+  api[0] = 0x81;
+  api[1] = (addr >> 8) & 0xFF;
+  api[2] = addr & 0xFF;
+  api[3] = 0x28; /* RSSI */
+  api[4] = 0x00; /* options */
+  memcpy(&api[5], &stamp, sizeof(stamp));
+  for (i = sizeof(stamp); i < payload; i++) {
+    api[5 + i] = 'a' + (i % 26);
+  }
+  return sim_encode(out, api, 5 + payload);
+}
+
+/* builds a 16-bit I/O frame (0x83) from addr, with D0-D7 and A0-A5 in each sample */
+static int make_io16(unsigned char *out, int addr, int samples) {
+  unsigned char api[512];
+  int i, j, o;
+  api[0] = 0x83;
+  api[1] = (addr >> 8) & 0xFF;
+  api[2] = addr & 0xFF;
+  api[3] = 0x28; /* RSSI */
+  api[4] = 0x00; /* options */
+  api[5] = samples;
+  api[6] = 0x7E; /* A0-A5 */
+  api[7] = 0xFF; /* D0-D7 */
+  o = 8;
+  for (i = 0; i < samples; i++) {
+    api[o++] = 0x00;
+    api[o++] = i & 0xFF;
+    for (j = 0; j < 6; j++) {
+      api[o++] = ((i + j) >> 8) & 0x03;
+      api[o++] = (i + j) & 0xFF;
+    }
+  }
+  return sim_encode(out, api, o);
+}
+
+static xbee_hnd bench_setup(sim **s, int baud) {
+  xbee_hnd xbee;
+  if ((*s = sim_open()) == NULL) {
+    fprintf(stderr, "bench: unable to open a pty\n");
+    exit(1);
+  }
+  if ((xbee = _xbee_setup((*s)->path, baud)) == NULL) {
+    fprintf(stderr, "bench: _xbee_setup(%s, %d) failed\n", (*s)->path, baud);
+    exit(1);
+  }
+  return xbee;
+}
+
+static void bench_teardown(sim *s, xbee_hnd xbee) {
+  _xbee_end(xbee);
+  sim_close(s);
+}
+
+/* spins on _xbee_getpacket() for at most 5 seconds */
+static xbee_pkt *spin_getpacket(xbee_hnd xbee, xbee_con *con) {
+  xbee_pkt *pkt;
+  unsigned long long to = sim_now() + 5000000000ULL;
+  while ((pkt = _xbee_getpacket(xbee, con)) == NULL) {
+    if (sim_now() > to) break;
+    sched_yield();
+  }
+  return pkt;
+}
+
+/* ################################################################# */
+/* ### RX frames/sec ############################################### */
+/* ################################################################# */
+
+struct rx_info {
+  xbee_hnd xbee;
+  xbee_con *con;
+  int want;
+  volatile int got;
+};
+
+static void *rx_consumer(void *arg) {
+  struct rx_info *info = arg;
+  xbee_pkt *pkt;
+  unsigned long long to = sim_now() + 30000000000ULL;
+  while (info->got < info->want && sim_now() < to) {
+    if ((pkt = _xbee_getpacket(info->xbee, info->con)) == NULL) {
+      sched_yield();
+      continue;
+    }
+    free(pkt);
+    info->got++;
+  }
+  return NULL;
+}
+
+/* the pty doesn't run at the baud rate given (every setting gives the same
+   result), so this is how fast libxbee can decode rather than the line rate */
+static void bench_rx(void) {
+  struct rx_info info;
+  unsigned char frame[256];
+  unsigned long long t0, t1;
+  pthread_t t;
+  int flen, i;
+  sim *s;
+
+  begin_case("rx");
+  info.xbee = bench_setup(&s, 57600);
+  info.con = _xbee_newcon(info.xbee, 'I', xbee_16bitData, 0x1234);
+  info.want = 5000 * scale;
+  info.got = 0;
+  flen = make_rx16(frame, 0x1234, 0, 20);
+
+  pthread_create(&t, NULL, rx_consumer, &info);
+  t0 = sim_now();
+  for (i = 0; i < info.want; i++) {
+    sim_sendraw(s, frame, flen);
+  }
+  pthread_join(t, NULL);
+  t1 = sim_now();
+
+  printf("{ \"frames\": %d, \"received\": %d, \"seconds\": %.4f, \"fps\": %.0f }",
+         info.want, info.got, (t1 - t0) / 1e9, info.got / ((t1 - t0) / 1e9));
+  bench_teardown(s, info.xbee);
+}
+
+/* ################################################################# */
+/* ### API mode 1 ################################################## */
+/* ################################################################# */
+
+/* binary payloads where half of the bytes need escaping in API mode 2,
+   received and sent in API mode 2 and in API mode 1 */
+static void bench_apimode(void) {
+  unsigned char api[128], frame[256];
+  char payload[64];
+  unsigned long long t0, t1, t2, to;
+  int flen, i, n, m;
+
+  for (i = 0; i < (int)sizeof(payload); i++) {
+    payload[i] = (i % 2)?0x7E:('a' + i % 26);
+  }
+  api[0] = 0x81;
+  api[1] = 0x12;
+  api[2] = 0x34;
+  api[3] = 0x28; /* RSSI */
+  api[4] = 0x00; /* options */
+  memcpy(&api[5], payload, sizeof(payload));
+
+  begin_case("apimode");
+  printf("[");
+  for (m = 2; m >= 1; m--) {
+    struct rx_info info;
+    pthread_t t;
+    sim *s;
+
+    if ((s = sim_open()) == NULL) {
+      fprintf(stderr, "bench: unable to open a pty\n");
+      exit(1);
+    }
+    s->ap1 = (m == 1);
+    if ((info.xbee = _xbee_setupflags(s->path, 57600, 0, 0, 0, (m == 1)?XBEE_SETUP_AP1:0)) == NULL) {
+      fprintf(stderr, "bench: _xbee_setupflags(%s) failed\n", s->path);
+      exit(1);
+    }
+
+    /* recieve */
+    info.con = _xbee_newcon(info.xbee, 'I', xbee_16bitData, 0x1234);
+    info.want = 20000 * scale;
+    info.got = 0;
+    flen = ((m == 1)?sim_encode1(frame, api, 5 + sizeof(payload)):sim_encode(frame, api, 5 + sizeof(payload)));
+    pthread_create(&t, NULL, rx_consumer, &info);
+    t0 = sim_now();
+    for (i = 0; i < info.want; i++) {
+      sim_sendraw(s, frame, flen);
+    }
+    pthread_join(t, NULL);
+    t1 = sim_now();
+    printf("%s\n    { \"ap\": %d, \"wire_bytes\": %d, \"rx_frames\": %d, \"rx_received\": %d, \"rx_fps\": %.0f, ",
+           ((m == 2)?"":","), m, flen, info.want, info.got, info.got / ((t1 - t0) / 1e9));
+
+    /* send, frameID 0 disables the Tx status response */
+    info.con = _xbee_newcon(info.xbee, 0, xbee_16bitData, 0x1234);
+    n = 20000 * scale;
+    t0 = sim_now();
+    for (i = 0; i < n; i++) {
+      if (_xbee_nsenddata(info.xbee, info.con, payload, sizeof(payload))) break;
+    }
+    t1 = sim_now();
+    t2 = t1;
+    to = t1 + 500000000ULL;
+    while (s->txData < (unsigned long)i && sim_now() < to) {
+      unsigned long last = s->txData;
+      usleep(100);
+      if (s->txData != last) {
+        t2 = sim_now();
+        to = t2 + 500000000ULL;
+      }
+    }
+    if (t2 == t1) t2 = sim_now();
+    printf("\"tx_frames\": %d, \"encode_fps\": %.0f, \"wire_fps\": %.0f, \"delivered\": %lu, \"bad_frames\": %lu }",
+           i, i / ((t1 - t0) / 1e9), s->txData / ((t2 - t0) / 1e9), s->txData, s->badFrames);
+    bench_teardown(s, info.xbee);
+  }
+  printf("\n  ]");
+}
+
+/* ################################################################# */
+/* ### Frame filters ############################################### */
+/* ################################################################# */
+
+/* a stream where 9 in 10 frames are from nodes nobody is listening to, with and
+   without a filter that only accepts the node that is wanted */
+static void bench_filter(void) {
+  unsigned char noise[256], frame[256];
+  int nlen, flen, i, f;
+
+  begin_case("filter");
+  printf("[");
+  for (f = 0; f < 2; f++) {
+    struct rx_info info;
+    xbee_filter rule;
+    struct timespec c0, c1;
+    unsigned long long t0, t1;
+    pthread_t t;
+    sim *s;
+
+    info.xbee = bench_setup(&s, 57600);
+    info.con = _xbee_newcon(info.xbee, 'I', xbee_16bitData, 0x1234);
+    info.want = 2000 * scale;
+    info.got = 0;
+    if (f) {
+      memset(&rule, 0, sizeof(rule));
+      rule.action = XBEE_FILTER_ACCEPT;
+      rule.apiType = -1;
+      rule.addrLen = 2;
+      rule.addrLo[0] = rule.addrHi[0] = 0x12;
+      rule.addrLo[1] = rule.addrHi[1] = 0x34;
+      _xbee_setfilter(info.xbee, &rule, 1, XBEE_FILTER_REJECT);
+    }
+    flen = make_rx16(frame, 0x1234, 0, 20);
+    nlen = make_rx16(noise, 0x4321, 0, 60);
+
+    pthread_create(&t, NULL, rx_consumer, &info);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &c0);
+    t0 = sim_now();
+    for (i = 0; i < info.want * 10; i++) {
+      if (i % 10) {
+        sim_sendraw(s, noise, nlen);
+      } else {
+        sim_sendraw(s, frame, flen);
+      }
+    }
+    pthread_join(t, NULL);
+    t1 = sim_now();
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &c1);
+
+    /* the pty limits the rate, the CPU time shows the work saved */
+    printf("%s\n    { \"filter\": %d, \"frames\": %d, \"received\": %d, \"rejected\": %lu, \"seconds\": %.4f, \"fps\": %.0f, \"cpu_s\": %.4f }",
+           (f?",":""), f, info.want * 10, info.got, _xbee_filter_rejected(info.xbee), (t1 - t0) / 1e9,
+           (info.want * 10) / ((t1 - t0) / 1e9),
+           (c1.tv_sec - c0.tv_sec) + ((c1.tv_nsec - c0.tv_nsec) / 1e9));
+    bench_teardown(s, info.xbee);
+  }
+  printf("\n  ]");
+}
+
+/* ################################################################# */
+/* ### getpacket latency ########################################### */
+/* ################################################################# */
+
+static void bench_getpacket(void) {
+  int counts[] = { 1, 100, 1000 };
+  unsigned char frame[256];
+  int flen, i, c, n;
+
+  begin_case("getpacket");
+  printf("[");
+  for (c = 0; c < (int)(sizeof(counts) / sizeof(counts[0])); c++) {
+    unsigned long long *lat, listen = 0;
+    xbee_con *con = NULL;
+    xbee_hnd xbee;
+    xbee_pkt *pkt;
+    sim *s;
+
+    xbee = bench_setup(&s, 57600);
+    /* the connection we are interested in is created last, so it is the last to be matched */
+    for (i = 1; i <= counts[c]; i++) {
+      con = _xbee_newcon(xbee, 'I', xbee_16bitData, i);
+    }
+
+    n = 500 * scale;
+    lat = calloc(n, sizeof(*lat));
+    for (i = 0; i < n; i++) {
+      unsigned long long t0 = sim_now();
+      flen = make_rx16(frame, counts[c], t0, 20);
+      sim_sendraw(s, frame, flen);
+      if ((pkt = spin_getpacket(xbee, con)) == NULL) break;
+      lat[i] = sim_now() - t0;
+      /* the time spent in the listen thread, from the start byte to the packet being queued */
+      listen += pkt->queueTime - pkt->rxTime;
+      free(pkt);
+    }
+
+    printf("%s\n    { \"connections\": %d, \"listen_us\": %.2f, ", (c?",":""), counts[c],
+           (i?((listen / (double)i) / 1000.0):0));
+    print_latency(lat, i);
+    printf(" }");
+    free(lat);
+    bench_teardown(s, xbee);
+  }
+  printf("\n  ]");
+}
+
+/* ################################################################# */
+/* ### callback dispatch latency ################################### */
+/* ################################################################# */
+
+static unsigned long long *cbLat;
+static volatile int cbCount;
+
+static void bench_cb(xbee_con *con, xbee_pkt *pkt) {
+  unsigned long long now = sim_now(), t0;
+  memcpy(&t0, pkt->data, sizeof(t0));
+  cbLat[cbCount] = now - t0;
+  cbCount++;
+  /* libxbee will free the packet for us */
+}
+
+static volatile int cbBurst, cbCalls, cbHold;
+
+static void bench_cb_burst(xbee_con *con, xbee_pkt *pkt) {
+  while (cbHold) usleep(100);
+  cbBurst++;
+  cbCalls++;
+}
+
+static void bench_cb_batch(xbee_con *con, xbee_pkt **pkts, int n) {
+  while (cbHold) usleep(100);
+  cbBurst += n;
+  cbCalls++;
+}
+
+/* delivers a burst of n frames to the connection's callback, returning frames/sec.
+   the first callback is held until the whole burst is queued, so this is the
+   rate at which they are dispatched rather than the rate they arrive at */
+static double callback_burst(sim *s, xbee_hnd xbee, int n) {
+  unsigned char frame[256];
+  unsigned long long t0, to;
+  xbee_meminfo m;
+  int flen, i;
+
+  cbBurst = 0;
+  cbCalls = 0;
+  cbHold = 1;
+  flen = make_rx16(frame, 0x1234, 0, 20);
+  for (i = 0; i < n; i++) {
+    sim_sendraw(s, frame, flen);
+  }
+  to = sim_now() + 30000000000ULL;
+  do {
+    _xbee_memstats(xbee, &m);
+    if (m.objects[xbee_mem_pkt] >= (unsigned long)n) break;
+    usleep(1000);
+  } while (sim_now() < to);
+
+  t0 = sim_now();
+  cbHold = 0;
+  to = t0 + 30000000000ULL;
+  while (cbBurst < n && sim_now() < to) sched_yield();
+  return cbBurst / ((sim_now() - t0) / 1e9);
+}
+
+static void bench_callback(void) {
+  unsigned char frame[256];
+  xbee_con *con;
+  xbee_hnd xbee;
+  int flen, i, n, singleCalls;
+  double singleFps, batchFps;
+  sim *s;
+
+  begin_case("callback");
+  xbee = bench_setup(&s, 57600);
+  con = _xbee_newcon(xbee, 'I', xbee_16bitData, 0x1234);
+  con->callback = bench_cb;
+
+  n = 500 * scale;
+  cbLat = calloc(n, sizeof(*cbLat));
+  cbCount = 0;
+  for (i = 0; i < n; i++) {
+    unsigned long long to = sim_now() + 5000000000ULL;
+    flen = make_rx16(frame, 0x1234, sim_now(), 20);
+    sim_sendraw(s, frame, flen);
+    /* wait for this callback to complete before sending the next */
+    while (cbCount <= i && sim_now() < to) sched_yield();
+    if (cbCount <= i) break;
+  }
+
+  /* a queued burst of frames, given to the callback one at a time and then in batches */
+  n = 20000 * scale;
+  con->callback = bench_cb_burst;
+  singleFps = callback_burst(s, xbee, n);
+  singleCalls = cbCalls;
+  con->callback = NULL;
+  _xbee_batchcallback(xbee, con, bench_cb_batch, 64, 0);
+  batchFps = callback_burst(s, xbee, n);
+
+  printf("{ ");
+  print_latency(cbLat, cbCount);
+  printf(", \"burst\": %d, \"single_fps\": %.0f, \"single_calls\": %d, \"batch_fps\": %.0f, \"batch_calls\": %d }",
+         n, singleFps, singleCalls, batchFps, cbCalls);
+  _xbee_batchcallback(xbee, con, NULL, 0, 0);
+  bench_teardown(s, xbee);
+  free(cbLat);
+}
+
+/* ################################################################# */
+/* ### TX encode rate ############################################## */
+/* ################################################################# */
+
+static void bench_tx(void) {
+  char payload[64];
+  unsigned long long t0, t1, t2, to;
+  xbee_con *con;
+  xbee_hnd xbee;
+  int i, n;
+  sim *s;
+
+  begin_case("tx");
+  xbee = bench_setup(&s, 57600);
+  /* frameID 0 disables the Tx status response */
+  con = _xbee_newcon(xbee, 0, xbee_16bitData, 0x1234);
+
+  /* include some bytes that need escaping */
+  for (i = 0; i < (int)sizeof(payload); i++) {
+    payload[i] = (i % 8)?('a' + i % 26):0x7E;
+  }
+
+  n = 20000 * scale;
+  t0 = sim_now();
+  for (i = 0; i < n; i++) {
+    if (_xbee_nsenddata(xbee, con, payload, 40)) break;
+  }
+  t1 = sim_now();
+  /* wait for the simulator to see them all (or for it to stop making progress) */
+  t2 = t1;
+  to = t1 + 500000000ULL;
+  while (s->txData < (unsigned long)i && sim_now() < to) {
+    unsigned long last = s->txData;
+    usleep(100);
+    if (s->txData != last) {
+      t2 = sim_now();
+      to = t2 + 500000000ULL;
+    }
+  }
+  if (t2 == t1) t2 = sim_now();
+
+  printf("{ \"frames\": %d, \"payload\": 40, \"encode_fps\": %.0f, \"wire_fps\": %.0f, \"delivered\": %lu, \"bad_frames\": %lu }",
+         i, i / ((t1 - t0) / 1e9), s->txData / ((t2 - t0) / 1e9), s->txData, s->badFrames);
+  bench_teardown(s, xbee);
+}
+
+/* lets CTS go after 200ms */
+static void *txflow_release(void *arg) {
+  sim *s = arg;
+  usleep(200000);
+  s->ctsHold = 0;
+  return NULL;
+}
+
+/* sends a burst to a simulated module that can only take 25000 bytes/sec into a
+   202 byte buffer - with no flow control (the bytes that don't fit are lost),
+   with RTS/CTS, and with RTS/CTS while the module holds CTS for 200ms first */
+static void bench_txflow(void) {
+  static const int flags[] = { 0, XBEE_SETUP_RTSCTS, XBEE_SETUP_RTSCTS };
+  char payload[40];
+  unsigned long long t0, t1, t2, to;
+  xbee_con *con;
+  xbee_hnd xbee;
+  pthread_t t;
+  int f, i, n;
+  sim *s;
+
+  begin_case("txflow");
+  printf("[");
+  memset(payload, 'a', sizeof(payload));
+  n = 1000 * scale;
+  for (f = 0; f < 3; f++) {
+    if ((s = sim_open()) == NULL) {
+      fprintf(stderr, "bench: unable to open a pty\n");
+      exit(1);
+    }
+    s->bufSize = 202;
+    s->drainRate = 25000;
+    s->rtscts = ((flags[f] & XBEE_SETUP_RTSCTS)?1:0);
+    if ((xbee = _xbee_setupflags(s->path, 921600, 0, 0, 0, flags[f])) == NULL) {
+      fprintf(stderr, "bench: _xbee_setupflags(%s) failed\n", s->path);
+      exit(1);
+    }
+    con = _xbee_newcon(xbee, 0, xbee_16bitData, 0x1234);
+    if (f == 2) {
+      s->ctsHold = 1;
+      pthread_create(&t, NULL, txflow_release, s);
+    }
+
+    t0 = sim_now();
+    for (i = 0; i < n; i++) {
+      if (_xbee_nsenddata(xbee, con, payload, sizeof(payload))) break;
+    }
+    t1 = sim_now();
+    if (f == 2) pthread_join(t, NULL);
+    /* wait for the simulator to drain what is queued */
+    t2 = t1;
+    to = t1 + 500000000ULL;
+    while (s->txData < (unsigned long)n && sim_now() < to) {
+      unsigned long last = s->txData;
+      usleep(1000);
+      if (s->txData != last) {
+        t2 = sim_now();
+        to = t2 + 500000000ULL;
+      }
+    }
+    if (t2 == t1) t2 = sim_now();
+
+    printf("%s\n    { \"rtscts\": %d, \"cts_held_ms\": %d, \"frames\": %d, \"sent\": %d, \"send_s\": %.2f, \"wire_fps\": %.0f, \"delivered\": %lu, \"lost\": %lu, \"bad_frames\": %lu, \"dropped_bytes\": %lu, \"cts_waits\": %lu }",
+           (f?",":""), s->rtscts, ((f == 2)?200:0), n, i, (t1 - t0) / 1e9,
+           s->txData / ((t2 - t0) / 1e9), s->txData, n - s->txData, s->badFrames, s->dropped, s->ctsWaits);
+    bench_teardown(s, xbee);
+  }
+  printf("\n  ]");
+}
+
+/* ################################################################# */
+/* ### AT round-trip ############################################### */
+/* ################################################################# */
+
+static void bench_at(void) {
+  unsigned long long *lat;
+  xbee_con *con;
+  xbee_hnd xbee;
+  xbee_pkt *pkt;
+  int i, n;
+  sim *s;
+
+  begin_case("at");
+  xbee = bench_setup(&s, 57600);
+  con = _xbee_newcon(xbee, 'A', xbee_localAT);
+
+  n = 500 * scale;
+  lat = calloc(n, sizeof(*lat));
+  for (i = 0; i < n; i++) {
+    unsigned long long t0 = sim_now();
+    if (_xbee_senddata(xbee, con, "VR")) break;
+    if ((pkt = spin_getpacket(xbee, con)) == NULL) break;
+    lat[i] = sim_now() - t0;
+    free(pkt);
+  }
+
+  printf("{ ");
+  print_latency(lat, i);
+  printf(" }");
+  free(lat);
+  bench_teardown(s, xbee);
+}
+
+/* 40 settings pushed one at a time (as in sample/atsetup.c), and in one
+   xbee_at_batch() call */
+static void bench_atbatch(void) {
+  xbee_atcmd cmds[40];
+  unsigned long long t0, t1, t2;
+  int i, r, reps = 10 * scale, failed = 0;
+  xbee_con *con;
+  xbee_hnd xbee;
+  xbee_pkt *pkt;
+  sim *s;
+
+  begin_case("atbatch");
+  xbee = bench_setup(&s, 57600);
+  con = _xbee_newcon(xbee, 'A', xbee_localAT);
+
+  memset(cmds, 0, sizeof(cmds));
+  for (i = 0; i < 40; i++) {
+    cmds[i].cmd[0] = 'D';
+    cmds[i].cmd[1] = '0' + (i % 8);
+    cmds[i].param[0] = i & 0x07;
+    cmds[i].paramlen = 1;
+  }
+
+  t0 = sim_now();
+  for (r = 0; r < reps; r++) {
+    for (i = 0; i < 40; i++) {
+      if (_xbee_senddata(xbee, con, "%c%c%c", cmds[i].cmd[0], cmds[i].cmd[1], cmds[i].param[0])) break;
+      if ((pkt = spin_getpacket(xbee, con)) == NULL) break;
+      free(pkt);
+    }
+    _xbee_senddata(xbee, con, "AC");
+    if ((pkt = spin_getpacket(xbee, con)) != NULL) free(pkt);
+  }
+  t1 = sim_now();
+  for (r = 0; r < reps; r++) {
+    failed += _xbee_at_batch(xbee, con, cmds, 40, 0);
+  }
+  t2 = sim_now();
+
+  printf("{ \"commands\": 40, \"sequential_ms\": %.3f, \"batch_ms\": %.3f, \"speedup\": %.2f, \"failed\": %d }",
+         (t1 - t0) / 1e6 / reps, (t2 - t1) / 1e6 / reps, (double)(t1 - t0) / (t2 - t1), failed);
+  bench_teardown(s, xbee);
+}
+
+/* ################################################################# */
+
+#define ATCACHE_THREADS 16
+
+struct atcache_info {
+  xbee_hnd xbee;
+  xbee_con *con;
+  volatile int *go;
+  int ret;
+};
+
+static void *atcache_reader(void *arg) {
+  struct atcache_info *info = arg;
+  unsigned char value[8];
+  while (!*info->go) sched_yield();
+  info->ret = _xbee_atcache_get(info->xbee, info->con, "NI", 60000, value, sizeof(value));
+  return NULL;
+}
+
+/* checks the number of remote AT requests that the simulator has seen */
+static void atcache_expect(sim *s, unsigned long from, unsigned long want, const char *what) {
+  if (s->remoteAtReqs - from != want) {
+    fprintf(stderr, "bench: atcache: %s put %lu requests on the wire (expected %lu)\n",
+            what, s->remoteAtReqs - from, want);
+    exit(1);
+  }
+}
+
+/* xbee_atcache_get() - threads reading the same parameter at once must share
+   one request, reads within the ttl mustn't make any, and a write to the
+   parameter (with xbee_senddata or xbee_at_batch) must make the next read ask
+   the node again */
+static void bench_atcache(void) {
+  struct atcache_info info[ATCACHE_THREADS];
+  pthread_t t[ATCACHE_THREADS];
+  unsigned char value[8];
+  unsigned long long *lat, t0, t1;
+  unsigned long k;
+  volatile int go = 0;
+  xbee_atcmd cmd;
+  xbee_con *con;
+  xbee_hnd xbee;
+  xbee_pkt *pkt;
+  int i, n, bad;
+  sim *s;
+
+  begin_case("atcache");
+  xbee = bench_setup(&s, 57600);
+  con = _xbee_newcon(xbee, 'C', xbee_64bitRemoteAT, 0x0013A200, 0x00000001);
+
+  /* the node takes 50ms to answer, so every thread is waiting before it does */
+  s->atDelay = 50000;
+  k = s->remoteAtReqs;
+  for (i = 0; i < ATCACHE_THREADS; i++) {
+    info[i].xbee = xbee;
+    info[i].con = con;
+    info[i].go = &go;
+    pthread_create(&t[i], NULL, atcache_reader, &info[i]);
+  }
+  t0 = sim_now();
+  go = 1;
+  bad = 0;
+  for (i = 0; i < ATCACHE_THREADS; i++) {
+    pthread_join(t[i], NULL);
+    if (info[i].ret != 2) bad++;
+  }
+  t1 = sim_now();
+  s->atDelay = 0;
+  atcache_expect(s, k, 1, "concurrent reads");
+  printf("{ \"threads\": %d, \"failed\": %d, \"concurrent_ms\": %.3f", ATCACHE_THREADS, bad, (t1 - t0) / 1e6);
+
+  /* reads within the ttl */
+  n = 10000 * scale;
+  lat = calloc(n, sizeof(*lat));
+  k = s->remoteAtReqs;
+  for (i = 0; i < n; i++) {
+    t0 = sim_now();
+    if (_xbee_atcache_get(xbee, con, "NI", 60000, value, sizeof(value)) != 2) break;
+    lat[i] = sim_now() - t0;
+  }
+  atcache_expect(s, k, 0, "reads within the ttl");
+  printf(", \"hit\": { ");
+  print_latency(lat, i);
+  printf(" }");
+  free(lat);
+
+  /* a write through xbee_senddata() */
+  _xbee_senddata(xbee, con, "NI%s", "bench");
+  if ((pkt = spin_getpacket(xbee, con)) != NULL) free(pkt);
+  k = s->remoteAtReqs;
+  t0 = sim_now();
+  _xbee_atcache_get(xbee, con, "NI", 60000, value, sizeof(value));
+  t1 = sim_now();
+  atcache_expect(s, k, 1, "a read after xbee_senddata");
+  _xbee_atcache_get(xbee, con, "NI", 60000, value, sizeof(value));
+  atcache_expect(s, k, 1, "a second read after xbee_senddata");
+  printf(", \"miss_ms\": %.3f", (t1 - t0) / 1e6);
+
+  /* a write through xbee_at_batch() */
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.cmd[0] = 'N';
+  cmd.cmd[1] = 'I';
+  memcpy(cmd.param, "bench", 5);
+  cmd.paramlen = 5;
+  bad += !!_xbee_at_batch(xbee, con, &cmd, 1, 0);
+  k = s->remoteAtReqs;
+  _xbee_atcache_get(xbee, con, "NI", 60000, value, sizeof(value));
+  atcache_expect(s, k, 1, "a read after xbee_at_batch");
+
+  printf(", \"invalidated\": 2 }");
+  bench_teardown(s, xbee);
+}
+
+/* ################################################################# */
+/* ### I/O sample aggregation ###################################### */
+/* ################################################################# */
+
+/* the mean of each analog input over a stream of I/O frames, read either
+   packet by packet with xbee_getanalog(), or in columns from the I/O sink */
+static void bench_iosink(void) {
+  unsigned char frame[1024];
+  unsigned long long t0, t1, t2, to;
+  double sum[6], mean;
+  int flen, i, j, k, n, per = 10, got;
+  xbee_hnd xbee;
+  sim *s;
+
+  begin_case("iosink");
+  n = 2000 * scale;
+  flen = make_io16(frame, 0x1234, per);
+  printf("{");
+
+  /* packets */
+  {
+    xbee_pkt **pkts;
+    xbee_con *con;
+
+    xbee = bench_setup(&s, 57600);
+    con = _xbee_newcon(xbee, 'I', xbee_16bitIO, 0x1234);
+    pkts = calloc(n, sizeof(*pkts));
+
+    t0 = sim_now();
+    for (i = 0; i < n; i++) {
+      sim_sendraw(s, frame, flen);
+    }
+    for (got = 0; got < n; got++) {
+      if ((pkts[got] = spin_getpacket(xbee, con)) == NULL) break;
+    }
+    t1 = sim_now();
+    memset(sum, 0, sizeof(sum));
+    for (i = 0; i < got; i++) {
+      for (j = 0; j < pkts[i]->samples; j++) {
+        for (k = 0; k < 6; k++) {
+          if (xbee_hasanalog(pkts[i], j, k)) sum[k] += xbee_getanalog(pkts[i], j, k, 0);
+        }
+      }
+    }
+    t2 = sim_now();
+    mean = sum[0] / (got * per);
+    for (i = 0; i < got; i++) free(pkts[i]);
+    free(pkts);
+
+    printf("\n    \"packets\": { \"frames\": %d, \"samples\": %d, \"receive_s\": %.4f, \"aggregate_us\": %.1f, \"mean_a0\": %.2f },",
+           got, got * per, (t1 - t0) / 1e9, (t2 - t1) / 1e3, mean);
+    bench_teardown(s, xbee);
+  }
+
+  /* sink */
+  {
+    unsigned short *col[6];
+    xbee_ionode node;
+    xbee_iobuf buf;
+
+    xbee = bench_setup(&s, 57600);
+    _xbee_iosink(xbee, n * per, 0);
+    memset(&node, 0, sizeof(node));
+    node.addr[0] = 0x12;
+    node.addr[1] = 0x34;
+    memset(&buf, 0, sizeof(buf));
+    buf.len = n * per;
+    for (k = 0; k < 6; k++) {
+      buf.analog[k] = col[k] = malloc(buf.len * sizeof(unsigned short));
+    }
+
+    t0 = sim_now();
+    for (i = 0; i < n; i++) {
+      sim_sendraw(s, frame, flen);
+    }
+    /* wait for the listen thread to record them all */
+    to = t0 + 30000000000ULL;
+    while (_xbee_iosink_nodes(xbee, &node, 1) < 1 || node.total < (unsigned long)(n * per)) {
+      if (sim_now() > to) break;
+      sched_yield();
+    }
+    t1 = sim_now();
+    got = _xbee_iosink_read(xbee, &node, &buf, 1);
+    memset(sum, 0, sizeof(sum));
+    for (k = 0; k < 6; k++) {
+      for (i = 0; i < got; i++) sum[k] += col[k][i];
+    }
+    t2 = sim_now();
+    mean = (got > 0)?(sum[0] / got):0;
+    for (k = 0; k < 6; k++) free(col[k]);
+
+    printf("\n    \"sink\": { \"frames\": %d, \"samples\": %d, \"receive_s\": %.4f, \"aggregate_us\": %.1f, \"mean_a0\": %.2f }",
+           got / per, got, (t1 - t0) / 1e9, (t2 - t1) / 1e3, mean);
+    bench_teardown(s, xbee);
+  }
+  printf("\n  }");
+}
+
+/* ################################################################# */
+/* ### Analog conversion ########################################### */
+/* ################################################################# */
+
+/* converting A0 to volts from a batch of I/O packets, with the per-call loop
+   used in sample/analog.c and with xbee_getanalog_bulkn()
+   (this doesn't use the simulator, the packets are made in memory) */
+static void bench_analog(void) {
+  int npkts = 10000, per = 10, reps = 20 * scale;
+  unsigned long long t0, t1, t2;
+  float *out1, *out2, diff = 0;
+  xbee_pkt **pkts;
+  int i, j, r, o, n;
+
+  begin_case("analog");
+  pkts = calloc(npkts, sizeof(*pkts));
+  for (i = 0; i < npkts; i++) {
+    pkts[i] = xbee_pkt_alloc(0, per);
+    pkts[i]->IOPkt = 1;
+    pkts[i]->samples = per;
+    for (j = 0; j < per; j++) {
+      /* 1 in 10 samples doesn't have A0 */
+      pkts[i]->IOdata[j].IOmask = (((i + j) % 10)?0x7E00:0x7C00);
+      pkts[i]->IOdata[j].IOanalog[0] = (i * 7 + j) & 0x3FF;
+    }
+  }
+  out1 = malloc(npkts * per * sizeof(float));
+  out2 = malloc(npkts * per * sizeof(float));
+
+  t0 = sim_now();
+  for (r = 0; r < reps; r++) {
+    for (o = 0, i = 0; i < npkts; i++) {
+      for (j = 0; j < pkts[i]->samples; j++) {
+        out1[o++] = (xbee_hasanalog(pkts[i], j, 0)?xbee_getanalog(pkts[i], j, 0, 3.3):0);
+      }
+    }
+  }
+  t1 = sim_now();
+  for (r = 0; r < reps; r++) {
+    n = npkts * per;
+    xbee_getanalog_bulkn(pkts, npkts, 0, 3.3, out2, &n);
+  }
+  t2 = sim_now();
+
+  for (i = 0; i < npkts * per; i++) {
+    float d = out1[i] - out2[i];
+    if (d < 0) d = -d;
+    if (d > diff) diff = d;
+  }
+
+  printf("{ \"samples\": %d, \"per_call_msps\": %.1f, \"bulk_msps\": %.1f, \"speedup\": %.2f, \"max_diff\": %g }",
+         npkts * per * reps,
+         (npkts * per * (double)reps) / ((t1 - t0) / 1e3),
+         (npkts * per * (double)reps) / ((t2 - t1) / 1e3),
+         (t1 - t0) / (double)(t2 - t1), diff);
+
+  for (i = 0; i < npkts; i++) free(pkts[i]);
+  free(pkts);
+  free(out1);
+  free(out2);
+}
+
+/* ################################################################# */
+/* ### Queued packet memory ######################################## */
+/* ################################################################# */
+
+/* the heap used by each packet left queued on a connection, for a Tx status,
+   a 20 byte data frame and a single I/O sample */
+static void bench_pktmem(void) {
+  struct {
+    const char *name;
+    xbee_types type;
+  } kinds[] = {
+    { "txstatus", xbee_txStatus },
+    { "data20",   xbee_16bitData },
+    { "io1",      xbee_16bitIO },
+  };
+  unsigned char api[16], frame[256];
+  int flen, i, k, n, got;
+
+  begin_case("pktmem");
+  printf("{ \"sizeof_pkt\": %d,", (int)sizeof(xbee_pkt));
+  for (k = 0; k < (int)(sizeof(kinds) / sizeof(kinds[0])); k++) {
+    unsigned long long to;
+    size_t bytes = 0;
+    xbee_pkt **pkts;
+    xbee_con *con;
+    xbee_hnd xbee;
+    sim *s;
+
+    xbee = bench_setup(&s, 57600);
+    n = 2000 * scale;
+    if (kinds[k].type == xbee_txStatus) {
+      con = _xbee_newcon(xbee, 'S', xbee_txStatus);
+      api[0] = 0x89;
+      api[1] = 'S';
+      api[2] = 0x00;
+      flen = sim_encode(frame, api, 3);
+    } else if (kinds[k].type == xbee_16bitData) {
+      con = _xbee_newcon(xbee, 'I', xbee_16bitData, 0x1234);
+      flen = make_rx16(frame, 0x1234, 0, 20);
+    } else {
+      con = _xbee_newcon(xbee, 'I', xbee_16bitIO, 0x1234);
+      flen = make_io16(frame, 0x1234, 1);
+    }
+    for (i = 0; i < n; i++) {
+      sim_sendraw(s, frame, flen);
+    }
+
+    /* collect them once they are all queued, and add up what each one holds */
+    pkts = calloc(n, sizeof(*pkts));
+    to = sim_now() + 10000000000ULL;
+    for (got = 0; got < n && sim_now() < to; ) {
+      if ((pkts[got] = _xbee_getpacket(xbee, con)) == NULL) {
+        sched_yield();
+        continue;
+      }
+      bytes += malloc_usable_size(pkts[got]);
+      got++;
+    }
+    for (i = 0; i < got; i++) free(pkts[i]);
+    free(pkts);
+
+    printf("%s \"%s\": { \"packets\": %d, \"bytes_per_pkt\": %.1f }",
+           (k?",":""), kinds[k].name, got, (got?(bytes / (double)got):0));
+    bench_teardown(s, xbee);
+  }
+  printf(" }");
+}
+
+/* ################################################################# */
+/* ### Setup ####################################################### */
+/* ################################################################# */
+
+/* time taken to open 16 XBees: plain, through command mode, with command mode
+   settings given but skipped by XBEE_SETUP_PROBE, and with _xbee_setupmany()
+   doing them all at once. each simulated XBee takes 20ms to answer the probe */
+#define SETUP_RADIOS 16
+/* command mode takes a couple of seconds per radio, so fewer are used */
+#define SETUP_CMD_RADIOS 4
+static void bench_setup_time(void) {
+  const char *names[] = { "plain", "command", "probe", "probe_many" };
+  xbee_setupinfo info[SETUP_RADIOS];
+  xbee_hnd xbee[SETUP_RADIOS];
+  sim *s[SETUP_RADIOS];
+  unsigned long long t0, t1;
+  unsigned long cmdModes;
+  int i, m, n, ok;
+
+  begin_case("setup");
+  printf("[");
+  for (m = 0; m < 4; m++) {
+    n = ((m == 1)?SETUP_CMD_RADIOS:SETUP_RADIOS);
+    for (i = 0; i < n; i++) {
+      if ((s[i] = sim_open()) == NULL) {
+        fprintf(stderr, "bench: unable to open a pty\n");
+        exit(1);
+      }
+      s[i]->atDelay = 20000;
+      memset(&info[i], 0, sizeof(info[i]));
+      info[i].path = s[i]->path;
+      info[i].baudrate = 57600;
+      if (m) {
+        /* the module's default guard time */
+        info[i].cmdSeq = '+';
+        info[i].cmdTime = 1000;
+        info[i].flags = ((m == 1)?0:XBEE_SETUP_PROBE);
+      }
+    }
+
+    ok = 0;
+    t0 = sim_now();
+    if (m == 3) {
+      ok = _xbee_setupmany(info, n);
+      for (i = 0; i < n; i++) xbee[i] = info[i].xbee;
+    } else {
+      for (i = 0; i < n; i++) {
+        xbee[i] = _xbee_setupflags(info[i].path, info[i].baudrate, 0, info[i].cmdSeq, info[i].cmdTime, info[i].flags);
+        if (xbee[i]) ok++;
+      }
+    }
+    t1 = sim_now();
+
+    cmdModes = 0;
+    for (i = 0; i < n; i++) cmdModes += s[i]->cmdModes;
+    printf("%s\n    { \"mode\": \"%s\", \"radios\": %d, \"opened\": %d, \"command_mode\": %lu, \"total_ms\": %.2f, \"per_radio_ms\": %.2f }",
+           (m?",":""), names[m], n, ok, cmdModes, (t1 - t0) / 1e6, ((t1 - t0) / 1e6) / n);
+    for (i = 0; i < n; i++) {
+      if (xbee[i]) _xbee_end(xbee[i]);
+      sim_close(s[i]);
+    }
+  }
+  printf("\n  ]");
+}
+
+/* ################################################################# */
+/* ### Gateway ##################################################### */
+/* ################################################################# */
+
+#define GW_RADIOS 3
+/* a 16-bit data frame (0x81) from addr, heard with the given RSSI */
+static int make_rx16rssi(unsigned char *out, int addr, int rssi) {
+  unsigned char api[16] = { 0x81, 0x00, 0x00, 0x00, 0x00, 'g', 'w' };
+  api[1] = (addr >> 8) & 0xFF;
+  api[2] = addr & 0xFF;
+  api[3] = rssi;
+  return sim_encode(out, api, 7);
+}
+
+/* three radios used as one: the rate that their frames are merged at, how sends are
+   spread with no policy, whether XBEE_GW_LASTHEARD picks the radio that hears each
+   node best, and how many sends get through after one of the radios is unplugged */
+static void bench_gateway(void) {
+  unsigned long before[GW_RADIOS], least[GW_RADIOS];
+  unsigned char frame[64];
+  unsigned long long t0, t1, to;
+  xbee_hnd xbee[GW_RADIOS];
+  sim *s[GW_RADIOS];
+  xbee_pkt *pkt;
+  xbee_gw *gw;
+  int i, k, n, got, flen, routed, failed;
+
+  begin_case("gateway");
+  for (i = 0; i < GW_RADIOS; i++) {
+    xbee[i] = bench_setup(&s[i], 57600);
+  }
+  n = 3000 * scale;
+
+  /* merged RX - each node is heard by every radio, best by radio (node % GW_RADIOS) */
+  gw = xbee_gw_new(xbee, GW_RADIOS, XBEE_GW_LASTHEARD, NULL);
+  t0 = sim_now();
+  for (k = 0; k < n; k++) {
+    for (i = 0; i < GW_RADIOS; i++) {
+      flen = make_rx16rssi(frame, 0x1000 + (k % GW_RADIOS), ((k % GW_RADIOS) == i)?0x20:0x50);
+      sim_sendraw(s[i], frame, flen);
+    }
+  }
+  got = 0;
+  to = sim_now() + 10000000000ULL;
+  while (got < n * GW_RADIOS && sim_now() < to) {
+    if ((pkt = xbee_gw_getpacket(gw, NULL)) == NULL) {
+      sched_yield();
+      continue;
+    }
+    free(pkt);
+    got++;
+  }
+  t1 = sim_now();
+  printf("{ \"radios\": %d, \"rx_frames\": %d, \"rx_merged\": %d, \"rx_fps\": %.0f",
+         GW_RADIOS, n * GW_RADIOS, got, got / ((t1 - t0) / 1e9));
+
+  /* last heard - each node's frames should all go out on its best radio */
+  for (i = 0; i < GW_RADIOS; i++) before[i] = s[i]->txData;
+  for (k = 0; k < n; k++) {
+    xbee_gw_nsenddata(gw, xbee_16bitData, 0, 0x1000 + (k % GW_RADIOS), "gw", 2);
+  }
+  to = sim_now() + 2000000000ULL;
+  routed = 0;
+  while (sim_now() < to) {
+    for (routed = 0, i = 0; i < GW_RADIOS; i++) routed += s[i]->txData - before[i];
+    if (routed >= n) break;
+    usleep(1000);
+  }
+  for (routed = 0, i = 0; i < GW_RADIOS; i++) {
+    /* anything more than its own share went to the wrong radio */
+    routed += ((s[i]->txData - before[i] > (unsigned long)(n / GW_RADIOS))?
+               (n / GW_RADIOS):(s[i]->txData - before[i]));
+  }
+  printf(", \"lastheard_sent\": %d, \"lastheard_best_radio\": %d", n, routed);
+  xbee_gw_free(gw);
+
+  /* least loaded - with nothing to choose between them, sends are spread evenly */
+  gw = xbee_gw_new(xbee, GW_RADIOS, 0, NULL);
+  for (i = 0; i < GW_RADIOS; i++) before[i] = s[i]->txData;
+  for (k = 0; k < n; k++) {
+    xbee_gw_nsenddata(gw, xbee_16bitData, 0, 0x2000, "gw", 2);
+  }
+  usleep(200000);
+  printf(", \"leastloaded\": [");
+  for (i = 0; i < GW_RADIOS; i++) {
+    least[i] = s[i]->txData - before[i];
+    printf("%s%lu", (i?", ":""), least[i]);
+  }
+  printf("]");
+  xbee_gw_free(gw);
+
+  /* failover - radio 1 is unplugged, and the sends wait for their Tx status */
+  gw = xbee_gw_new(xbee, GW_RADIOS, XBEE_GW_ACK, NULL);
+  close(s[1]->master);
+  s[1]->master = -1;
+  failed = 0;
+  t0 = sim_now();
+  for (k = 0; k < n; k++) {
+    if (xbee_gw_nsenddata(gw, xbee_16bitData, 0, 0x2000, "gw", 2)) failed++;
+  }
+  t1 = sim_now();
+  printf(", \"failover_sent\": %d, \"failover_failed\": %d, \"failover_fps\": %.0f, \"radio1_up\": %d }",
+         n, failed, n / ((t1 - t0) / 1e9), xbee_gw_radiostate(gw, 1));
+  xbee_gw_free(gw);
+
+  for (i = 0; i < GW_RADIOS; i++) {
+    bench_teardown(s[i], xbee[i]);
+  }
+}
+
+/* ################################################################# */
+/* ### Packet Ring ################################################# */
+/* ################################################################# */
+
+struct ring_info {
+  xbee_ring *ring;
+  int want;
+  volatile int got;
+  unsigned long long readns;
+};
+
+static void *ring_consumer(void *arg) {
+  struct ring_info *info = arg;
+  unsigned long long seq, t0;
+  unsigned long long to = sim_now() + 30000000000ULL;
+  while (info->got + (int)xbee_ring_lost(info->ring) < info->want && sim_now() < to) {
+    t0 = sim_now();
+    if (xbee_ring_read(info->ring, &seq) == NULL) {
+      sched_yield();
+      continue;
+    }
+    info->readns += sim_now() - t0;
+    info->got++;
+  }
+  return NULL;
+}
+
+/* frames published by the listen thread to a shared memory ring, and read back
+   from it with xbee_ring_read() */
+static void bench_ring(void) {
+  struct ring_info info;
+  unsigned char frame[64];
+  unsigned long long t0, t1;
+  char name[32];
+  pthread_t t;
+  xbee_hnd xbee;
+  sim *s;
+  int i, flen;
+
+  begin_case("ring");
+  xbee = bench_setup(&s, 57600);
+  sprintf(name, "/libxbee-bench-%d", (int)getpid());
+  if (_xbee_ring_publish(xbee, name, 4096) || (info.ring = xbee_ring_attach(name)) == NULL) {
+    printf("{ \"error\": \"unable to publish to %s\" }", name);
+    bench_teardown(s, xbee);
+    return;
+  }
+  info.want = 20000 * scale;
+  info.got = 0;
+  info.readns = 0;
+  flen = make_rx16(frame, 0x1234, 0, 20);
+
+  pthread_create(&t, NULL, ring_consumer, &info);
+  t0 = sim_now();
+  for (i = 0; i < info.want; i++) {
+    sim_sendraw(s, frame, flen);
+  }
+  pthread_join(t, NULL);
+  t1 = sim_now();
+
+  printf("{ \"frames\": %d, \"read\": %d, \"lost\": %lu, \"seconds\": %.4f, \"fps\": %.0f, \"read_ns\": %.0f }",
+         info.want, info.got, xbee_ring_lost(info.ring), (t1 - t0) / 1e9,
+         info.got / ((t1 - t0) / 1e9), (info.got?(double)info.readns / info.got:0));
+  xbee_ring_detach(info.ring);
+  bench_teardown(s, xbee);
+}
+
+/* a flood of frames for a connection that nobody collects from, with and without
+   a limit on the memory that the handle may hold (xbee_memlimit) */
+static void bench_memlimit(void) {
+  unsigned long limits[] = { 0, 256 * 1024 };
+  unsigned char frame[64];
+  unsigned long long t0, t1, to;
+  xbee_meminfo m;
+  xbee_hnd xbee;
+  sim *s;
+  int i, k, n, flen;
+
+  begin_case("memlimit");
+  printf("{");
+  for (k = 0; k < (int)(sizeof(limits) / sizeof(limits[0])); k++) {
+    xbee = bench_setup(&s, 57600);
+    _xbee_newcon(xbee, 'I', xbee_16bitData, 0x1234);
+    _xbee_memlimit(xbee, limits[k]);
+    n = 20000 * scale;
+    flen = make_rx16(frame, 0x1234, 0, 20);
+
+    t0 = sim_now();
+    for (i = 0; i < n; i++) {
+      sim_sendraw(s, frame, flen);
+    }
+    /* every frame is either queued or dropped */
+    to = t0 + 10000000000ULL;
+    do {
+      _xbee_memstats(xbee, &m);
+      if (m.objects[xbee_mem_pkt] + m.dropped >= (unsigned long)n) break;
+      sched_yield();
+    } while (sim_now() < to);
+    t1 = sim_now();
+
+    printf("%s \"limit_%lu\": { \"frames\": %d, \"queued\": %lu, \"dropped\": %lu, \"bytes\": %lu, \"fps\": %.0f }",
+           (k?",":""), limits[k], n, m.objects[xbee_mem_pkt], m.dropped, m.bytes,
+           (m.objects[xbee_mem_pkt] + m.dropped) / ((t1 - t0) / 1e9));
+    bench_teardown(s, xbee);
+  }
+  printf(" }");
+}
+
+/* ################################################################# */
+/* ### Frame Server ################################################ */
+/* ################################################################# */
+
+struct serve_info {
+  xbee_hnd xbee;
+  xbee_con *con;
+  int want;
+  volatile int acked;
+};
+
+/* ACKed sends, one at a time - each waits for its own Tx status */
+static void *serve_sender(void *arg) {
+  struct serve_info *info = arg;
+  int i;
+  for (i = 0; i < info->want; i++) {
+    if (!_xbee_nsenddata(info->xbee, info->con, "srv", 3)) info->acked++;
+  }
+  return NULL;
+}
+
+/* 2 clients sharing an XBee through xbee_serve(). the server and both clients
+   send with frame ID 'A' at the same time, so every Tx status only gets back to
+   its sender if the server has remapped the frame IDs. the second client only
+   accepts frames from 0x2222 (xbee_setfilter), and it then disconnects while it
+   has AT requests outstanding */
+static void bench_serve(void) {
+  struct serve_info info[3];
+  xbee_con *rx[2][2];
+  xbee_filter rule;
+  struct stat st;
+  unsigned char frame[64];
+  unsigned long long t0, t1, to;
+  char addr[64];
+  pthread_t t[3];
+  xbee_hnd xbee, cl[2];
+  xbee_pkt *pkt;
+  sim *s;
+  int i, k, n, flen, got[2][2];
+
+  begin_case("serve");
+  xbee = bench_setup(&s, 57600);
+  sprintf(addr, "unix:/tmp/libxbee-bench-%d.sock", (int)getpid());
+  if (_xbee_serve(xbee, addr)) {
+    printf("{ \"error\": \"unable to serve on %s\" }", addr);
+    bench_teardown(s, xbee);
+    return;
+  }
+  printf("{ \"socket_mode\": \"%04o\"", (stat(&addr[5], &st)?0:(st.st_mode & 07777)));
+  for (i = 0; i < 2; i++) {
+    if ((cl[i] = _xbee_setup(addr, 0)) == NULL) {
+      fprintf(stderr, "bench: _xbee_setup(%s) failed\n", addr);
+      exit(1);
+    }
+    rx[i][0] = _xbee_newcon(cl[i], 'I', xbee_16bitData, 0x1111);
+    rx[i][1] = _xbee_newcon(cl[i], 'I', xbee_16bitData, 0x2222);
+  }
+  memset(&rule, 0, sizeof(rule));
+  rule.action = XBEE_FILTER_ACCEPT;
+  rule.apiType = -1;
+  rule.addrLen = 2;
+  rule.addrLo[0] = rule.addrHi[0] = 0x22;
+  rule.addrLo[1] = rule.addrHi[1] = 0x22;
+  _xbee_setfilter(cl[1], &rule, 1, XBEE_FILTER_REJECT);
+  n = 500 * scale;
+
+  /* ACKed sends - clients 0 and 1, and the server itself */
+  for (i = 0; i < 3; i++) {
+    info[i].xbee = ((i < 2)?cl[i]:xbee);
+    info[i].con = _xbee_newcon(info[i].xbee, 'A', xbee_16bitData, 0x1234);
+    info[i].con->waitforACK = 1;
+    info[i].want = n;
+    info[i].acked = 0;
+  }
+  t0 = sim_now();
+  for (i = 0; i < 3; i++) pthread_create(&t[i], NULL, serve_sender, &info[i]);
+  for (i = 0; i < 3; i++) pthread_join(t[i], NULL);
+  t1 = sim_now();
+  printf(", \"clients\": 2, \"acked_sends\": %d, \"acked\": [%d, %d, %d], \"acked_fps\": %.0f",
+         n, info[0].acked, info[1].acked, info[2].acked,
+         (info[0].acked + info[1].acked + info[2].acked) / ((t1 - t0) / 1e9));
+
+  /* filters - half of the frames are from 0x1111, which client 1 doesn't want */
+  for (k = 0; k < n * 2; k++) {
+    flen = make_rx16(frame, (k & 1)?0x2222:0x1111, 0, 20);
+    sim_sendraw(s, frame, flen);
+  }
+  memset(got, 0, sizeof(got));
+  to = sim_now() + 2000000000ULL;
+  while (sim_now() < to && got[0][0] + got[0][1] < n * 2) {
+    for (i = 0; i < 2; i++) {
+      for (k = 0; k < 2; k++) {
+        while ((pkt = _xbee_getpacket(cl[i], rx[i][k])) != NULL) {
+          got[i][k]++;
+          free(pkt);
+        }
+      }
+    }
+    usleep(1000);
+  }
+  /* anything client 1 is sent late would show up here */
+  usleep(100000);
+  for (k = 0; k < 2; k++) {
+    while ((pkt = _xbee_getpacket(cl[1], rx[1][k])) != NULL) {
+      got[1][k]++;
+      free(pkt);
+    }
+  }
+  printf(", \"rx_frames\": %d, \"client0_rx\": [%d, %d], \"client1_rx\": [%d, %d]",
+         n * 2, got[0][0], got[0][1], got[1][0], got[1][1]);
+
+  /* client 1 leaves with AT requests unanswered, and its frame IDs are given
+     back for the others to use */
+  s->atDelay = 50000;
+  k = s->atReqs;
+  info[1].con = _xbee_newcon(cl[1], 'B', xbee_localAT);
+  for (i = 0; i < 8; i++) _xbee_senddata(cl[1], info[1].con, "VR");
+  usleep(20000);
+  _xbee_end(cl[1]);
+  /* the answers arrive after it has gone */
+  to = sim_now() + 2000000000ULL;
+  while (s->atReqs < (unsigned long)k + 8 && sim_now() < to) usleep(1000);
+  s->atDelay = 0;
+  info[0].acked = 0;
+  t0 = sim_now();
+  serve_sender(&info[0]);
+  t1 = sim_now();
+  printf(", \"after_disconnect_acked\": %d, \"after_disconnect_fps\": %.0f }",
+         info[0].acked, info[0].acked / ((t1 - t0) / 1e9));
+
+  _xbee_end(cl[0]);
+  bench_teardown(s, xbee);
+}
+
+/* ################################################################# */
+/* ### Main ######################################################## */
+/* ################################################################# */
+
+struct bench_case {
+  const char *name;
+  void (*func)(void);
+};
+
+static struct bench_case cases[] = {
+  { "rx",        bench_rx },
+  { "apimode",   bench_apimode },
+  { "filter",    bench_filter },
+  { "getpacket", bench_getpacket },
+  { "callback",  bench_callback },
+  { "tx",        bench_tx },
+  { "txflow",    bench_txflow },
+  { "at",        bench_at },
+  { "atbatch",   bench_atbatch },
+  { "atcache",   bench_atcache },
+  { "iosink",    bench_iosink },
+  { "analog",    bench_analog },
+  { "pktmem",    bench_pktmem },
+  { "setup",     bench_setup_time },
+  { "gateway",   bench_gateway },
+  { "ring",      bench_ring },
+  { "memlimit",  bench_memlimit },
+  { "serve",     bench_serve },
+  { NULL,        NULL }
+};
+
+int main(int argc, char *argv[]) {
+  int i, c, any = 0;
+
+  for (i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+      if ((scale = atoi(argv[++i])) < 1) scale = 1;
+    } else {
+      any = 1;
+    }
+  }
+
+  printf("{\n  \"libxbee\": \"%s\",\n  \"build\": \"%s\",\n  \"scale\": %d,", xbee_svn_version(), xbee_build_info(), scale);
+  printf("\n  \"results\": {");
+  for (c = 0; cases[c].name; c++) {
+    int run = !any;
+    for (i = 1; i < argc && !run; i++) {
+      if (!strcmp(argv[i], "-s")) {
+        i++;
+        continue;
+      }
+      if (!strcmp(argv[i], cases[c].name)) run = 1;
+    }
+    if (!run) continue;
+    fflush(stdout);
+    cases[c].func();
+  }
+  printf("\n  }\n}\n");
+
+  return 0;
+}
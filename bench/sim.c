@@ -0,0 +1,408 @@
+/*
+  libxbee - a C library to aid the use of Digi's Series 1 XBee modules
+            running in API mode (AP=2).
+
+  Copyright (C) 2009  Attie Grande (attie@attie.co.uk)
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <time.h>
+#include <stdarg.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "sim.h"
+
+/* the open simulators, for ioctl() */
+static pthread_mutex_t simsmutex = PTHREAD_MUTEX_INITIALIZER;
+static sim *sims;
+
+unsigned long long sim_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ((unsigned long long)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+int sim_encode(unsigned char *out, const unsigned char *api, int len) {
+  int i, o;
+  unsigned char c, chksum = 0;
+
+  out[0] = 0x7E;
+  o = 1;
+  for (i = -2; i <= len; i++) {
+    if (i == -2) {
+      c = (len >> 8) & 0xFF;
+    } else if (i == -1) {
+      c = len & 0xFF;
+    } else if (i == len) {
+      c = 0xFF - chksum;
+    } else {
+      c = api[i];
+      chksum += c;
+    }
+    if (c == 0x7E || c == 0x7D || c == 0x11 || c == 0x13) {
+      out[o++] = 0x7D;
+      c ^= 0x20;
+    }
+    out[o++] = c;
+  }
+  return o;
+}
+
+int sim_encode1(unsigned char *out, const unsigned char *api, int len) {
+  unsigned char chksum = 0;
+  int i;
+
+  out[0] = 0x7E;
+  out[1] = (len >> 8) & 0xFF;
+  out[2] = len & 0xFF;
+  for (i = 0; i < len; i++) {
+    out[3 + i] = api[i];
+    chksum += api[i];
+  }
+  out[3 + len] = 0xFF - chksum;
+  return len + 4;
+}
+
+int sim_sendraw(sim *s, const unsigned char *buf, int len) {
+  int ret, done = 0;
+  pthread_mutex_lock(&s->writemutex);
+  while (done < len) {
+    if ((ret = write(s->master, &buf[done], len - done)) == -1) {
+      if (errno == EINTR || errno == EAGAIN) continue;
+      break;
+    }
+    done += ret;
+  }
+  pthread_mutex_unlock(&s->writemutex);
+  return (done == len)?0:-1;
+}
+
+/* libxbee checks CTS with TIOCMGET, which a pty can't answer. this takes the
+   place of the C library's ioctl() and answers it for the slave side of each
+   simulator, from sim->cts. everything else goes straight to the kernel */
+int ioctl(int fd, unsigned long req, ...) {
+  struct stat st;
+  va_list ap;
+  void *arg;
+  sim *s;
+  int ret;
+
+  va_start(ap, req);
+  arg = va_arg(ap, void *);
+  va_end(ap);
+  if ((ret = syscall(SYS_ioctl, fd, req, arg)) != -1 || req != TIOCMGET) return ret;
+  if (fstat(fd, &st) || !S_ISCHR(st.st_mode)) return ret;
+
+  pthread_mutex_lock(&simsmutex);
+  for (s = sims; s; s = s->next) {
+    if (s->rdev == st.st_rdev) break;
+  }
+  if (s) {
+    *(int *)arg = TIOCM_DSR | (s->cts?TIOCM_CTS:0);
+    if (!s->cts) s->ctsWaits++;
+    ret = 0;
+  }
+  pthread_mutex_unlock(&simsmutex);
+  return ret;
+}
+
+int sim_send(sim *s, const unsigned char *api, int len) {
+  unsigned char buf[1024];
+  if (len > 500) return -1;
+  return sim_sendraw(s, buf, (s->ap1?sim_encode1(buf, api, len):sim_encode(buf, api, len)));
+}
+
+/* reply to a request made by libxbee */
+static void sim_reply(sim *s, unsigned char *d, int len) {
+  unsigned char r[64];
+
+  switch (d[0]) {
+  case 0x08: /* local AT */
+  case 0x09:
+    if (len < 4) break;
+    s->atReqs++;
+    if (!d[1]) break;
+    if (s->atDelay) usleep(s->atDelay);
+    r[0] = 0x88;
+    r[1] = d[1];
+    r[2] = d[2];
+    r[3] = d[3];
+    r[4] = 0x00;
+    if (len == 4 && d[2] == 'N' && d[3] == 'D') {
+      /* a node discovery - each node answers in the Series 1 format
+         (MY, SH, SL, dB, NI), followed by an empty response */
+      int i;
+      for (i = 0; i < s->ndNodes; i++) {
+        r[5] = 0x00;
+        r[6] = i + 1;
+        r[7] = 0x00; r[8] = 0x13; r[9] = 0xA2; r[10] = 0x00;
+        r[11] = 0x00; r[12] = 0x00; r[13] = 0x00; r[14] = i + 1;
+        r[15] = 0x28;
+        sprintf((char *)&r[16], "NODE%d", i + 1);
+        sim_send(s, r, 16 + strlen((char *)&r[16]) + 1);
+      }
+      sim_send(s, r, 5);
+    } else if (len == 4) {
+      /* a query - return 2 bytes of 'data' */
+      r[5] = 0x10;
+      r[6] = 0xE8;
+      sim_send(s, r, 7);
+    } else {
+      sim_send(s, r, 5);
+    }
+    break;
+
+  case 0x17: /* remote AT */
+    if (len < 15) break;
+    s->atReqs++;
+    s->remoteAtReqs++;
+    if (!d[1]) break;
+    if (s->atDelay) usleep(s->atDelay);
+    r[0] = 0x97;
+    r[1] = d[1];
+    memcpy(&r[2], &d[2], 8);
+    r[10] = 0x12;
+    r[11] = 0x34;
+    r[12] = d[13];
+    r[13] = d[14];
+    r[14] = 0x00;
+    if (len == 15) {
+      r[15] = 0x10;
+      r[16] = 0xE8;
+      sim_send(s, r, 17);
+    } else {
+      sim_send(s, r, 15);
+    }
+    break;
+
+  case 0x00: /* 64-bit Tx */
+  case 0x01: /* 16-bit Tx */
+    s->txData++;
+    if (!d[1]) break;
+    r[0] = 0x89;
+    r[1] = d[1];
+    r[2] = 0x00;
+    sim_send(s, r, 3);
+    break;
+
+  case 0x10: /* Series 2 Tx */
+  case 0x11: /* Series 2 Explicit Tx */
+    s->txData++;
+    if (!d[1]) break;
+    r[0] = 0x8B;
+    r[1] = d[1];
+    r[2] = 0xFF;
+    r[3] = 0xFE;
+    r[4] = 0x00;
+    r[5] = 0x00;
+    r[6] = 0x00;
+    sim_send(s, r, 7);
+    break;
+  }
+}
+
+/* answers a line sent in command mode, returning FALSE once ATCN leaves it.
+   only what libxbee needs to get into API mode is understood, everything else
+   is just OK'd */
+static int sim_command(sim *s, char *line) {
+  char r[8];
+  if (!strcmp(line, "ATAP")) {
+    sprintf(r, "%d\r", (s->ap1?1:2));
+    sim_sendraw(s, (unsigned char *)r, strlen(r));
+    return 1;
+  }
+  if (!strncmp(line, "ATAP", 4)) s->ap1 = (line[4] == '1');
+  sim_sendraw(s, (unsigned char *)"OK\r", 3);
+  return strcmp(line, "ATCN");
+}
+
+/* reads and decodes frames written by libxbee */
+static void *sim_thread(void *arg) {
+  sim *s = arg;
+  unsigned char buf[512], d[1024];
+  int state = 0, esc = 0, len = 0, pos = 0;
+  unsigned char chksum = 0;
+  char line[32];
+  int plus = 0, cmdMode = 0, linelen = 0;
+  unsigned long long last = sim_now(), now;
+  double room = 0;
+  int ret, i, n;
+
+  while (s->run) {
+    n = sizeof(buf);
+    if (s->drainRate > 0) {
+      /* the buffer empties at drainRate */
+      now = sim_now();
+      room += ((now - last) / 1e9) * s->drainRate;
+      if (room > s->bufSize) room = s->bufSize;
+      last = now;
+    } else {
+      room = sizeof(buf);
+    }
+    s->cts = (!s->ctsHold && room >= SIM_CTS_FREE);
+    if (s->rtscts) {
+      /* the UART holds what the buffer has no room for */
+      if (s->ctsHold || room < 1) {
+        usleep(100);
+        continue;
+      }
+      if (n > (int)room) n = room;
+    }
+    /* don't sit in read() for long, CTS has to follow the buffer as it drains */
+    if (s->drainRate > 0 || s->ctsHold) {
+      struct pollfd pfd;
+      pfd.fd = s->master;
+      pfd.events = POLLIN;
+      if (poll(&pfd, 1, 1) == 0) continue;
+    }
+    if ((ret = read(s->master, buf, n)) <= 0) {
+      if (ret == -1 && (errno == EINTR || errno == EAGAIN)) continue;
+      /* EIO - the slave side has been closed */
+      usleep(1000);
+      continue;
+    }
+    s->rxBytes += ret;
+    if (s->drainRate > 0) {
+      /* without flow control, whatever doesn't fit is lost */
+      if (ret > (int)room) {
+        s->dropped += ret - (int)room;
+        ret = room;
+      }
+      room -= ret;
+    }
+    for (i = 0; i < ret; i++) {
+      unsigned char c = buf[i];
+      /* in API mode 1 a 0x7E inside a frame is just data */
+      if (c == 0x7E && (!s->ap1 || !state)) {
+        state = 1;
+        esc = 0;
+        continue;
+      }
+      if (!state) {
+        /* text outside of a frame - "+++" enters command mode (the guard
+           times aren't checked), then each line is a command until ATCN */
+        if (cmdMode) {
+          if (c != '\r') {
+            if (linelen < (int)sizeof(line) - 1) line[linelen++] = c;
+            continue;
+          }
+          line[linelen] = '\0';
+          linelen = 0;
+          cmdMode = sim_command(s, line);
+        } else if (c != '+') {
+          plus = 0;
+        } else if (++plus == 3) {
+          plus = 0;
+          cmdMode = 1;
+          s->cmdModes++;
+          sim_sendraw(s, (unsigned char *)"OK\r", 3);
+        }
+        continue;
+      }
+      if (c == 0x7D && !s->ap1) {
+        esc = 1;
+        continue;
+      }
+      if (esc) {
+        c ^= 0x20;
+        esc = 0;
+      }
+      switch (state) {
+      case 1: len = c << 8;  state = 2; break;
+      case 2: len |= c; pos = 0; chksum = 0;
+              state = ((len > 0 && len < (int)sizeof(d))?3:0); break;
+      case 3:
+        d[pos++] = c;
+        chksum += c;
+        if (pos == len) state = 4;
+        break;
+      case 4:
+        state = 0;
+        if (((chksum + c) & 0xFF) != 0xFF) {
+          s->badFrames++;
+          break;
+        }
+        s->rxFrames++;
+        sim_reply(s, d, len);
+        break;
+      }
+    }
+  }
+  return NULL;
+}
+
+sim *sim_open(void) {
+  sim *s;
+  struct termios tc;
+  struct stat st;
+  char *name;
+
+  if ((s = calloc(1, sizeof(sim))) == NULL) return NULL;
+  if ((s->master = posix_openpt(O_RDWR | O_NOCTTY)) == -1) {
+    free(s);
+    return NULL;
+  }
+  if (grantpt(s->master) || unlockpt(s->master) || (name = ptsname(s->master)) == NULL) {
+    close(s->master);
+    free(s);
+    return NULL;
+  }
+  snprintf(s->path, sizeof(s->path), "%s", name);
+  if (stat(s->path, &st) == 0) s->rdev = st.st_rdev;
+
+  /* put the master into raw mode, we don't want the line discipline getting involved */
+  tcgetattr(s->master, &tc);
+  cfmakeraw(&tc);
+  tcsetattr(s->master, TCSANOW, &tc);
+
+  pthread_mutex_init(&s->writemutex, NULL);
+  s->cts = 1;
+  s->run = 1;
+  if (pthread_create(&s->thread, NULL, sim_thread, s)) {
+    close(s->master);
+    free(s);
+    return NULL;
+  }
+  pthread_mutex_lock(&simsmutex);
+  s->next = sims;
+  sims = s;
+  pthread_mutex_unlock(&simsmutex);
+  return s;
+}
+
+void sim_close(sim *s) {
+  sim **l;
+  if (!s) return;
+  pthread_mutex_lock(&simsmutex);
+  for (l = &sims; *l && *l != s; l = &(*l)->next);
+  if (*l) *l = s->next;
+  pthread_mutex_unlock(&simsmutex);
+  s->run = 0;
+  pthread_cancel(s->thread);
+  pthread_join(s->thread, NULL);
+  close(s->master);
+  pthread_mutex_destroy(&s->writemutex);
+  free(s);
+}
@@ -0,0 +1,101 @@
+/*
+  libxbee - a C library to aid the use of Digi's Series 1 XBee modules
+            running in API mode (AP=2).
+
+  Copyright (C) 2009  Attie Grande (attie@attie.co.uk)
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef BENCH_SIM_H
+#define BENCH_SIM_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+/* a very small XBee module simulator sitting on the master side of a pty.
+   libxbee is pointed at the slave side (sim->path) and talks to it as if
+   it were a real module running in API mode 2 */
+typedef struct sim sim;
+struct sim {
+  int master;
+  char path[64];
+
+  pthread_t thread;
+  pthread_mutex_t writemutex;
+  volatile int run;
+
+  /* statistics - updated by the simulator thread */
+  volatile unsigned long rxFrames;  /* frames recieved from libxbee */
+  volatile unsigned long rxBytes;
+  volatile unsigned long txData;    /* data frames sent by libxbee (0x00/0x01/0x10/0x11) */
+  volatile unsigned long atReqs;    /* AT requests answered */
+  volatile unsigned long remoteAtReqs; /* ...of which were remote (0x17) */
+  volatile unsigned long badFrames; /* checksum errors etc */
+
+  /* the number of nodes that answer an ND request, see sim_reply() */
+  volatile int ndNodes;
+
+  /* models the module's serial buffer - when drainRate is set, at most bufSize
+     bytes are held and they are sent over the air at drainRate bytes/sec. with
+     rtscts set nothing more is read while the buffer is full (as the UART would
+     hold it), otherwise the bytes that don't fit are dropped */
+  volatile int bufSize;
+  volatile int drainRate;
+  volatile int rtscts;
+  volatile unsigned long dropped;   /* bytes lost because the buffer was full */
+
+  /* CTS as libxbee sees it (a pty can't carry it, so TIOCMGET is answered for
+     it, see sim.c) - deasserted while fewer than SIM_CTS_FREE bytes of the
+     buffer are free, or while ctsHold is set */
+  volatile int cts;
+  volatile int ctsHold;
+  volatile unsigned long ctsWaits;  /* times libxbee found CTS deasserted */
+
+  /* TRUE to talk API mode 1 - nothing is escaped */
+  volatile int ap1;
+
+  /* times that command mode was entered with "+++" (see sim_command()) */
+  volatile unsigned long cmdModes;
+
+  /* microseconds taken to answer an AT request (local or remote) */
+  volatile int atDelay;
+
+  /* the slave side's device, and the next open simulator */
+  dev_t rdev;
+  sim *next;
+};
+
+/* a real module deasserts CTS with this many bytes of its buffer left */
+#define SIM_CTS_FREE 17
+
+sim *sim_open(void);
+void sim_close(sim *s);
+
+/* escapes and frames the given API data (type byte first) into out
+   out must be at least (len * 2) + 6 bytes long. returns the number of bytes */
+int sim_encode(unsigned char *out, const unsigned char *api, int len);
+
+/* the same as sim_encode(), but for API mode 1 (nothing is escaped)
+   out must be at least len + 4 bytes long */
+int sim_encode1(unsigned char *out, const unsigned char *api, int len);
+
+/* writes a framed API packet to libxbee */
+int sim_send(sim *s, const unsigned char *api, int len);
+/* writes pre-encoded bytes to libxbee */
+int sim_sendraw(sim *s, const unsigned char *buf, int len);
+
+/* returns a monotonic time in nanoseconds */
+unsigned long long sim_now(void);
+
+#endif
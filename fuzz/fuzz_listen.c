@@ -0,0 +1,378 @@
+/*
+  libxbee - a C library to aid the use of Digi's Series 1 XBee modules
+            running in API mode (AP=2).
+
+  Copyright (C) 2009  Attie Grande (attie@attie.co.uk)
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* this is a fuzz harness for the API frame decoder (xbee_listen() and
+   xbee_parse_io()). the input is fed to the listen loop as an in-memory byte
+   source, exactly as if it had been read from the serial port.
+
+   built with -DLIBFUZZER it provides LLVMFuzzerTestOneInput() for libFuzzer,
+   otherwise it provides a main() that will:
+     fuzz_listen                   run stdin (for AFL)
+     fuzz_listen <file|dir> ...    run each file
+     fuzz_listen -seed <dir>       write the seed corpus into <dir> */
+
+#include "../api.c"
+
+#include <stdint.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define ADDR64H 0x0013A200
+#define ADDR64L 0x40081826
+#define ADDR16  0x1234
+
+static xbee_hnd fuzz_xbee = NULL;
+static xbee_con *fuzz_subs[3];
+static xbee_gw *fuzz_gw = NULL;
+static xbee_ring *fuzz_ring = NULL;
+
+/* sets up a handle that isn't attached to a serial port, with a connection
+   for each type of packet that the seeds contain */
+static void fuzz_init(void) {
+  xbee_hnd xbee = NULL;
+  xbee_filter filters[2];
+
+  xbee = Xcalloc(sizeof(struct xbee_hnd));
+  xbee_mutex_init(xbee->logmutex);
+  xbee_mutex_init(xbee->conmutex);
+  xbee_mutex_init(xbee->pktmutex);
+  xbee_mutex_init(xbee->sendmutex);
+  xbee_mutex_init(xbee->threadmutex);
+  xbee_mutex_init(xbee->iosinkmutex);
+  xbee_mutex_init(xbee->nodemutex);
+  xbee_mutex_init(xbee->atcachemutex);
+  xbee_cond_init(xbee->atcachecond);
+  xbee_mutex_init(xbee->framemutex);
+  xbee_cond_init(xbee->framecond);
+  xbee_mutex_init(xbee->filtermutex);
+  xbee_mutex_init(xbee->dedupmutex);
+  xbee_mutex_init(xbee->servemutex);
+  xbee_mutex_init(xbee->ringmutex);
+  xbee_sem_init(xbee->threadsem);
+
+  /* log to nowhere so that the log paths are exercised too */
+  if (!getenv("FUZZ_NOLOG")) {
+    xbee->log = fopen("/dev/null","w");
+  }
+
+  xbee->oldAPI = 2;
+  xbee->apimode = 2;
+  xbee->xbee_ready = 1;
+
+  _xbee_newcon(xbee, 0x01, xbee_localAT);
+  _xbee_newcon(xbee, 0x01, xbee_txStatus);
+  _xbee_newcon(xbee, 0x01, xbee_modemStatus);
+  _xbee_newcon(xbee, 0x01, xbee_16bitRemoteAT, ADDR16);
+  _xbee_newcon(xbee, 0x01, xbee_64bitRemoteAT, ADDR64H, ADDR64L);
+  _xbee_newcon(xbee, 0x01, xbee_16bitData, ADDR16);
+  _xbee_newcon(xbee, 0x01, xbee_16bitData, 0xFFFF);
+  _xbee_newcon(xbee, 0x01, xbee_64bitData, ADDR64H, ADDR64L);
+  _xbee_newcon(xbee, 0x01, xbee_16bitIO, ADDR16);
+  _xbee_newcon(xbee, 0x01, xbee_64bitIO, ADDR64H, ADDR64L);
+  _xbee_newcon(xbee, 0x01, xbee2_data, ADDR64H, ADDR64L);
+  _xbee_newcon(xbee, 0x01, xbee2_txStatus);
+  _xbee_newcon(xbee, 0x01, xbee2_IO, ADDR64H, ADDR64L);
+  _xbee_newcon(xbee, 0x01, xbee2_explicit, ADDR64H, ADDR64L, 0xE8, 0xE8, 0x0011, 0xC105);
+  _xbee_newcon(xbee, 0x01, xbee2_explicit, ADDR64H, ADDR64L, 0xE8, 0xE8, 0x0011, 0x0104);
+  _xbee_newcon(xbee, 0x01, xbee2_explicit, 0xFFFFFFFF, 0xFFFFFFFF, 0xE8, 0xE8, 0x0012, 0xC105);
+
+  /* subscriptions share packets with the connections above, and get some of their own */
+  fuzz_subs[0] = _xbee_subscribe(xbee, xbee_16bitData, ADDR16);
+  fuzz_subs[1] = _xbee_subscribe(xbee, xbee_64bitIO, ADDR64H, ADDR64L);
+  fuzz_subs[2] = _xbee_subscribe(xbee, xbee_16bitData, 0x5678);
+
+  /* record I/O samples too, small enough that the ring wraps */
+  _xbee_iosink(xbee, 16, 1);
+
+  /* filter out some frames - weak ones, and "drop" from 0x5600-0x56FF */
+  memset(filters, 0, sizeof(filters));
+  filters[0].action = XBEE_FILTER_REJECT;
+  filters[0].apiType = -1;
+  filters[0].RSSI = 0x60;
+  filters[1].action = XBEE_FILTER_REJECT;
+  filters[1].apiType = XBEE_16BIT_DATARX;
+  filters[1].addrLen = 2;
+  filters[1].addrLo[0] = 0x56;
+  filters[1].addrHi[0] = 0x56;
+  filters[1].addrHi[1] = 0xFF;
+  filters[1].matchLen = 4;
+  memcpy(filters[1].match, "drop", 4);
+  _xbee_setfilter(xbee, filters, 2, XBEE_FILTER_ACCEPT);
+
+  /* and drop repeats, with a small table so that entries are replaced */
+  _xbee_dedup(xbee, 50, 8);
+
+  /* and be the only radio in a gateway, which takes a copy of every data / I/O packet */
+  fuzz_gw = xbee_gw_new(&xbee, 1, XBEE_GW_LASTHEARD, NULL);
+
+  /* and publish every packet to a small ring, which is read back after each input.
+     the name is removed straight away, the mappings last as long as the process */
+  {
+    char name[32];
+    sprintf(name, "/libxbee-fuzz-%d", (int)getpid());
+    if (!_xbee_ring_publish(xbee, name, 8)) {
+      fuzz_ring = xbee_ring_attach(name);
+      shm_unlink(name);
+    }
+  }
+
+  /* and hold at most a couple of KB of packets, so that long inputs are shed */
+  xbee->memLimit = xbee->memBytes + 2048;
+
+  fuzz_xbee = xbee;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  xbee_hnd xbee;
+  xbee_pkt *p, *n;
+  int i;
+
+  if (!fuzz_xbee) fuzz_init();
+  xbee = fuzz_xbee;
+
+  /* point the listen thread at the input... it will return once its all used
+     this is done in API mode 2, and again in API mode 1 (no escapes, resyncs on bad frames) */
+  for (i = 2; i >= 1; i--) {
+    xbee->apimode = i;
+    xbee->rxbuf = data;
+    xbee->rxbuflen = ((size > INT_MAX)?INT_MAX:size);
+    xbee->rxbufpos = 0;
+    xbee->rxbacklen = 0;
+    xbee->rxbackpos = 0;
+    xbee->run = 1;
+    xbee_listen(xbee);
+  }
+
+  /* explicitly addressed packets must only match the connection with the same endpoints,
+     cluster and profile (two of the connections differ only by their profile) */
+  for (p = xbee->pktlist; p; p = p->next) {
+    xbee_con *con;
+    if (p->type != xbee2_explicit) continue;
+    for (con = xbee->conlist; con && (con->subscribe || !xbee_matchpktcon(xbee, p, con)); con = con->next);
+    if (!con || con->profileID != p->profileID || con->dstEndpoint != p->srcEndpoint) abort();
+  }
+
+  /* only a remote AT response to IS carries a sample, anything else would be left
+     over from an earlier frame */
+  for (p = xbee->pktlist; p; p = p->next) {
+    if (p->type == xbee_remoteAT && (p->atCmd[0] != 'I' || p->atCmd[1] != 'S') && p->samples) abort();
+  }
+
+  /* throw away anything that was queued */
+  p = xbee->pktlist;
+  while (p) {
+    n = p->next;
+    xbee_mem_add(xbee, xbee_mem_pkt, -1, xbee_pkt_size(p));
+    Xfree(p);
+    p = n;
+  }
+  xbee->pktlist = NULL;
+  xbee->pktlast = NULL;
+  xbee->pktcount = 0;
+  for (i = 0; i < 3; i++) {
+    _xbee_purgecon(xbee, fuzz_subs[i]);
+  }
+  while ((p = xbee_gw_getpacket(fuzz_gw, NULL)) != NULL) {
+    Xfree(p);
+  }
+  while ((p = xbee_ring_read(fuzz_ring, NULL)) != NULL) {
+    if (p->datalen > XBEE_PKT_MAXDATA) abort();
+    if (p->type == xbee_remoteAT && (p->atCmd[0] != 'I' || p->atCmd[1] != 'S') && p->samples) abort();
+  }
+
+  /* with everything collected, none of the packets can still be counted */
+  if (xbee->memObjects[xbee_mem_pkt] || xbee->memTypeBytes[xbee_mem_pkt] ||
+      xbee->memObjects[xbee_mem_callback] || xbee->memObjects[xbee_mem_tx]) abort();
+
+  return 0;
+}
+
+#ifndef LIBFUZZER
+
+/* ################################################################# */
+/* ### Seed Corpus ################################################# */
+/* ################################################################# */
+
+#define A64 0x00,0x13,0xA2,0x00,0x40,0x08,0x18,0x26
+#define A16 0x12,0x34
+
+/* un-framed API data for each seed (API identifier first) */
+struct seed {
+  const char *name;
+  int len;
+  unsigned char api[64];
+};
+static struct seed seeds[] = {
+  { "modem_status",   2, { 0x8A, 0x02 } },
+  { "local_at",       9, { 0x88, 0x01, 'N', 'I', 0x00, 'T', 'E', 'S', 'T' } },
+  { "local_at_nd",   22, { 0x88, 0x01, 'N', 'D', 0x00, A16, A64, 0x28, 'N', 'O', 'D', 'E', '1', 0x00 } },
+  { "local_at_nd_zb",27, { 0x88, 0x01, 'N', 'D', 0x00, A16, A64, 'R', 'T', 'R', 0x00,
+                           0xFF, 0xFE, 0x01, 0x00, 0xC1, 0x05, 0x10, 0x1E } },
+  { "remote_at",     17, { 0x97, 0x01, A64, A16, 'V', 'R', 0x00, 0x10, 0xE8 } },
+  { "remote_at_is",  24, { 0x97, 0x01, A64, A16, 'I', 'S', 0x00, 0x01, 0x06, 0x01, 0x00, 0x01, 0x02, 0x00, 0x01, 0xFF } },
+  { "tx_status",      3, { 0x89, 0x01, 0x00 } },
+  { "rx64_data",     16, { 0x80, A64, 0x28, 0x00, 'h', 'e', 'l', 'l', 'o' } },
+  { "rx16_data",     10, { 0x81, A16, 0x28, 0x00, 'h', 'e', 'l', 'l', 'o' } },
+  { "rx16_bcast",    10, { 0x81, 0x56, 0x78, 0x28, 0x02, 'b', 'c', 'a', 's', 't' } },
+  { "rx16_sub_only",  8, { 0x81, 0x56, 0x78, 0x28, 0x00, 's', 'u', 'b' } },
+  { "rx16_filtered",  9, { 0x81, 0x56, 0x78, 0x28, 0x00, 'd', 'r', 'o', 'p' } },
+  { "rx16_weak",     10, { 0x81, A16, 0x64, 0x00, 'h', 'e', 'l', 'l', 'o' } },
+  { "rx64_io",       26, { 0x82, A64, 0x28, 0x00, 0x02, 0x06, 0x01,
+                           0x00, 0x01, 0x02, 0x00, 0x01, 0xFF,
+                           0x00, 0x00, 0x01, 0x23, 0x03, 0xFF } },
+  { "rx16_io",       14, { 0x83, A16, 0x28, 0x00, 0x01, 0x0E, 0x00, 0x03, 0xFF, 0x00, 0x10, 0x02, 0x00 } },
+  { "rx16_io_dig",   10, { 0x83, A16, 0x28, 0x00, 0x01, 0x01, 0xFF, 0x01, 0x55 } },
+  { "zb_tx_status",   7, { 0x8B, 0x01, 0xFF, 0xFE, 0x00, 0x00, 0x00 } },
+  { "zb_rx_data",    18, { 0x90, A64, A16, 0x01, 'z', 'i', 'g', 'b', 'e', 'e' } },
+  { "zb_io",         24, { 0x92, A64, A16, 0x01, 0x01, 0x0C, 0x01, 0x83,
+                           0x08, 0x01, 0x02, 0x00, 0x01, 0xFF, 0x03, 0x10 } },
+  { "zb_explicit",   20, { 0x91, A64, A16, 0xE8, 0xE8, 0x00, 0x11, 0xC1, 0x05, 0x01, 'h', 'i' } },
+  { "zb_explicit_ha", 20, { 0x91, A64, A16, 0xE8, 0xE8, 0x00, 0x11, 0x01, 0x04, 0x01, 'h', 'a' } },
+  { "zb_explicit_any",20, { 0x91, 0x00, 0x13, 0xA2, 0x00, 0x40, 0x99, 0x99, 0x99, A16,
+                           0xE8, 0xE8, 0x00, 0x12, 0xC1, 0x05, 0x02, 'h', 'i' } },
+  { "zb_node_ident", 34, { 0x95, A64, A16, 0x02, A16, A64, 'E', 'N', 'D', 0x00,
+                           0x00, 0x00, 0x02, 0x01, 0xC1, 0x05, 0x10, 0x1E } },
+  { "escaped",       10, { 0x81, A16, 0x28, 0x00, 0x7E, 0x7D, 0x11, 0x13, 0x00 } },
+  { "unknown",        4, { 0xAA, 0x01, 0x02, 0x03 } },
+  { NULL, 0, { 0 } }
+};
+
+/* escapes and frames the API data */
+static int fuzz_encode(unsigned char *out, const unsigned char *api, int len) {
+  int i, o = 0;
+  unsigned char c, chksum = 0;
+
+  out[o++] = 0x7E;
+  for (i = -2; i <= len; i++) {
+    if (i == -2)       c = (len >> 8) & 0xFF;
+    else if (i == -1)  c = len & 0xFF;
+    else if (i == len) c = 0xFF - chksum;
+    else {
+      c = api[i];
+      chksum += c;
+    }
+    if (c == 0x7E || c == 0x7D || c == 0x11 || c == 0x13) {
+      out[o++] = 0x7D;
+      c ^= 0x20;
+    }
+    out[o++] = c;
+  }
+  return o;
+}
+
+static int fuzz_writeseed(const char *dir, const char *name, unsigned char *buf, int len) {
+  char path[256];
+  FILE *f;
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  if ((f = fopen(path, "wb")) == NULL) {
+    perror(path);
+    return 1;
+  }
+  fwrite(buf, 1, len, f);
+  fclose(f);
+  return 0;
+}
+
+static int fuzz_seed(const char *dir) {
+  unsigned char buf[4096];
+  int i, len, all = 0;
+
+  mkdir(dir, 0755);
+  for (i = 0; seeds[i].name; i++) {
+    len = fuzz_encode(buf, seeds[i].api, seeds[i].len);
+    if (fuzz_writeseed(dir, seeds[i].name, buf, len)) return 1;
+  }
+  /* and one with every frame back to back, with some noise in between */
+  for (i = 0; seeds[i].name; i++) {
+    all += fuzz_encode(&buf[all], seeds[i].api, seeds[i].len);
+    buf[all++] = 0x00;
+  }
+  return fuzz_writeseed(dir, "stream", buf, all);
+}
+
+/* ################################################################# */
+/* ### Replay Driver ############################################### */
+/* ################################################################# */
+
+static int fuzz_runfd(FILE *f) {
+  unsigned char *buf = NULL;
+  size_t len = 0, ret;
+  do {
+    buf = realloc(buf, len + 4096);
+    ret = fread(&buf[len], 1, 4096, f);
+    len += ret;
+  } while (ret);
+  LLVMFuzzerTestOneInput(buf, len);
+  free(buf);
+  return 0;
+}
+
+static int fuzz_runfile(const char *path) {
+  struct stat st;
+  FILE *f;
+  int ret;
+
+  if (stat(path, &st)) {
+    perror(path);
+    return 1;
+  }
+  if (S_ISDIR(st.st_mode)) {
+    struct dirent *e;
+    char sub[512];
+    DIR *d;
+    if ((d = opendir(path)) == NULL) {
+      perror(path);
+      return 1;
+    }
+    ret = 0;
+    while ((e = readdir(d)) != NULL) {
+      if (e->d_name[0] == '.') continue;
+      snprintf(sub, sizeof(sub), "%s/%s", path, e->d_name);
+      ret |= fuzz_runfile(sub);
+    }
+    closedir(d);
+    return ret;
+  }
+  if ((f = fopen(path, "rb")) == NULL) {
+    perror(path);
+    return 1;
+  }
+  ret = fuzz_runfd(f);
+  fclose(f);
+  return ret;
+}
+
+int main(int argc, char *argv[]) {
+  int i, ret = 0;
+
+  if (argc == 3 && !strcmp(argv[1], "-seed")) {
+    return fuzz_seed(argv[2]);
+  }
+  if (argc < 2) {
+    return fuzz_runfd(stdin);
+  }
+  for (i = 1; i < argc; i++) {
+    ret |= fuzz_runfile(argv[i]);
+  }
+  return ret;
+}
+
+#endif /* LIBFUZZER */
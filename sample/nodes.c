@@ -0,0 +1,67 @@
+#ifdef shell
+gcc -o ${0//.c/} $0 -lxbee -g
+exit
+}
+#endif
+/*
+  libxbee - a C library to aid the use of Digi's Series 1 XBee modules
+            running in API mode (AP=2).
+
+  Copyright (C) 2009  Attie Grande (attie@attie.co.uk)
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* this sample does the same as scan.c, but lets libxbee's node table
+   parse the ND responses */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <xbee.h>
+
+#define MAXNODES 100
+
+int main(int argc, char *argv[]) {
+  xbee_con *con;
+  xbee_node nodes[MAXNODES];
+  int i, n;
+
+  if (xbee_setup("/dev/ttyUSB0",57600) == -1) {
+    return 1;
+  }
+
+  /* grab a local AT connection */
+  con = xbee_newcon('I',xbee_localAT);
+
+  while (1) {
+    /* send a ND - Node Discover request, the responses go into the node table */
+    xbee_senddata(con,"ND");
+    sleep(5);
+    /* we don't need the responses ourselves */
+    xbee_purgecon(con);
+
+    n = xbee_nodelist(nodes,MAXNODES);
+    printf("%d nodes:\n",n);
+    for (i = 0; i < n && i < MAXNODES; i++) {
+      printf("MY: 0x%02X%02X    ",nodes[i].Addr16[0],nodes[i].Addr16[1]);
+      printf("SH: 0x%02X%02X%02X%02X    ",nodes[i].Addr64[0],nodes[i].Addr64[1],nodes[i].Addr64[2],nodes[i].Addr64[3]);
+      printf("SL: 0x%02X%02X%02X%02X    ",nodes[i].Addr64[4],nodes[i].Addr64[5],nodes[i].Addr64[6],nodes[i].Addr64[7]);
+      if (nodes[i].RSSI != -1) printf("dB: -%2d    ",nodes[i].RSSI);
+      printf("NI: %s\n",nodes[i].NI);
+    }
+  }
+
+  return 0;
+}
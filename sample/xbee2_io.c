@@ -0,0 +1,67 @@
+#ifdef shell
+gcc -o ${0//.c/} $0 -lxbee -g
+exit
+}
+#endif
+/*
+  libxbee - a C library to aid the use of Digi's Series 1 XBee modules
+            running in API mode (AP=2).
+
+  Copyright (C) 2009  Attie Grande (attie@attie.co.uk)
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* this sample will output the I/O samples pushed by a series 2 node
+   configure the node with IR (sample rate) and the inputs that you want */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <xbee.h>
+
+/* the series 2 ADC reference is fixed at 1.2v */
+#define Vref 1.2
+
+void callback(xbee_con *con, xbee_pkt *pkt) {
+  int i, j;
+  for (i = 0; i < pkt->samples; i++) {
+    for (j = 0; j <= 7; j++) {
+      if (xbee_hasdigital(pkt,i,j)) printf("D%d: %d  ",j,xbee_getdigital(pkt,i,j));
+    }
+    for (j = 0; j <= 3; j++) {
+      if (xbee_hasanalog(pkt,i,j)) printf("A%d: %.2fv  ",j,xbee_getanalog(pkt,i,j,Vref));
+    }
+    /* the supply voltage is given as A5 (in 1200/1024 mV units) */
+    if (xbee_hasanalog(pkt,i,5)) printf("Supply: %.2fv",xbee_getanalog(pkt,i,5,0) * 1.2 / 1024);
+    printf("\n");
+  }
+}
+
+int main(int argc, char *argv[]) {
+  xbee_con *con;
+
+  if (xbee_setup("/dev/ttyUSB0",57600) == -1) {
+    return 1;
+  }
+
+  con = xbee_newcon('I', xbee2_IO, 0x13A200, 0x403302B1);
+  con->callback = callback;
+
+  for (;;) {
+    sleep(60);
+  }
+
+  return 0;
+}
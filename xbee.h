@@ -82,7 +82,10 @@ enum xbee_types {
   
   /* XBee Series 2 stuff */
   xbee2_data,
-  xbee2_txStatus
+  xbee2_txStatus,
+
+  xbee2_IO,           /* (appended to keep the existing values) */
+  xbee2_explicit      /* frame ID for ACKs */
 };
 typedef enum xbee_types xbee_types;
 
@@ -97,6 +100,8 @@ struct xbee_sample {
 };
 
 typedef struct xbee_pkt xbee_pkt;
+/* the most data that a packet can hold */
+#define XBEE_PKT_MAXDATA 128
 struct xbee_pkt {
   unsigned int sAddr64        : 1; /* TRUE / FALSE */
   unsigned int dataPkt        : 1;
@@ -119,15 +124,29 @@ struct xbee_pkt {
 
   unsigned char Addr64[8];        /* AT  Data            */
 
-  unsigned char data[128];        /* AT  Data            */
+  unsigned char srcEndpoint;      /*     Data            */ /* explicit addressing (xbee2_explicit) */
+  unsigned char dstEndpoint;      /*     Data            */
+  unsigned short clusterID;       /*     Data            */
+  unsigned short profileID;       /*     Data            */
+
+  unsigned char *data;            /* AT  Data            */ /* up to XBEE_PKT_MAXDATA bytes */
   unsigned int datalen;
   
   xbee_types type;
 
   xbee_pkt *next;
 
-  xbee_sample IOdata[1];  /* this array can be extended by using a this trick:
-                             p = calloc(sizeof(xbee_pkt) + (sizeof(xbee_sample) * (samples - 1))) */
+  xbee_sample *IOdata;            /* 'samples' long */
+
+  /* the data and samples are held in the same allocation as the packet, just after it,
+     so a packet is still free()'d in one go. use xbee_pkt_alloc() to make one yourself */
+
+  unsigned long long rxTime;      /* CLOCK_MONOTONIC (ns) when the frame's start byte was read */
+  unsigned long long queueTime;   /* CLOCK_MONOTONIC (ns) when it was queued (or given to the callback) */
+
+  volatile long refs;             /* references held as well as the first - packets given to
+                                     subscriptions are shared, see xbee_subscribe() */
+  volatile long held;             /* INTERNAL - the queues inside libxbee that hold the packet */
 };
 
 typedef struct xbee_con xbee_con;
@@ -142,6 +161,7 @@ struct xbee_con {
   unsigned int noFreeAfterCB : 1; /* prevents libxbee from free'ing the packet after
                                      the callback has completed */
   unsigned int sleeping      : 1; /* if sleeping, another connection can be made and take control */
+  unsigned int subscribe     : 1; /* set by xbee_subscribe(), see below */
   xbee_types type;
   unsigned char frameID;
   unsigned char tAddr[8];         /* 64-bit 0-7   16-bit 0-1 */
@@ -154,8 +174,110 @@ struct xbee_con {
   xbee_sem_t waitforACKsem;
   volatile unsigned char ACKstatus; /* 255 = waiting, 0 = success, 1 = no ack, 2 = cca fail, 3 = purged */
   xbee_con *next;
+  /* explicit addressing (xbee2_explicit) - packets are matched on all four of these */
+  unsigned char srcEndpoint;      /* our endpoint */
+  unsigned char dstEndpoint;      /* the remote node's endpoint */
+  unsigned short clusterID;
+  unsigned short profileID;
+  /* subscriptions are given every matching packet, as well as the connection that would normally
+     take it. the packets are shared, so they must be released with xbee_pkt_unref() */
+  void *subList;
+  /* batched callbacks, see xbee_batchcallback(). when set it is used in place of callback */
+  void (*batchCallback)(xbee_con*,xbee_pkt**,int);
+  int batchMax;                   /* the most packets given to each call */
+  int batchLinger;                /* ms that the oldest packet may wait for a batch to fill */
+  xbee_cond_t batchcond;          /* signalled when a packet is queued for the batch callback */
+};
+
+typedef struct xbee_ionode xbee_ionode;
+struct xbee_ionode {
+  unsigned int addr64        : 1; /* TRUE if addr is a 64-bit address */
+  unsigned char addr[8];          /* 64-bit 0-7   16-bit 0-1 */
+  int samples;                    /* number of samples held */
+  unsigned long total;            /* number of samples ever recorded */
+};
+
+typedef struct xbee_node xbee_node;
+struct xbee_node {
+  unsigned char Addr64[8];
+  unsigned char Addr16[2];        /* 0xFFFE if unknown */
+  unsigned char parent[2];        /* ZigBee only - the parent's 16-bit address, 0xFFFE if none */
+  char NI[21];                    /* node identifier string */
+  int deviceType;                 /* ZigBee only - 0 = coordinator, 1 = router, 2 = end device, -1 = unknown */
+  int RSSI;                       /* Series 1 only - the inverted decibel value, -1 = unknown */
+  unsigned long long lastSeen;    /* monotonic timestamp in nanoseconds */
+};
+
+/* events given to the xbee_discover() callback */
+#define XBEE_NODE_LEAVE 0
+#define XBEE_NODE_JOIN  1
+
+/* a rule for xbee_setfilter(), the rule matches a frame if all of its fields do */
+#define XBEE_FILTER_ACCEPT 0
+#define XBEE_FILTER_REJECT 1
+typedef struct xbee_filter xbee_filter;
+struct xbee_filter {
+  int action;                     /* XBEE_FILTER_ACCEPT or XBEE_FILTER_REJECT */
+  int apiType;                    /* the API identifier (e.g. 0x81), or -1 for any data / I/O frame */
+  int addrLen;                    /* 0 = any address, 2 = 16-bit, 8 = 64-bit */
+  unsigned char addrLo[8];        /* the range of source addresses (inclusive), MSB first */
+  unsigned char addrHi[8];
+  int RSSI;                       /* 0 = any, else frames with this RSSI or weaker (inverted dB) */
+  int offset;                     /* where in the payload to compare 'match' */
+  int matchLen;                   /* 0 = any payload */
+  unsigned char match[16];
+};
+
+typedef struct xbee_atcmd xbee_atcmd;
+struct xbee_atcmd {
+  char cmd[2];                    /* e.g. "NI" */
+  unsigned char param[32];        /* the value to set */
+  int paramlen;                   /* 0 to just read the current value */
+  int status;                     /* the response status (0 = OK), or -1 if there was no response */
+  unsigned char value[32];        /* the value given in the response (if any) */
+  int valuelen;
+};
+
+typedef struct xbee_iobuf xbee_iobuf;
+struct xbee_iobuf {
+  int len;                        /* length of each of the arrays */
+  int count;                      /* number of samples copied into the arrays */
+  unsigned long long *time;       /* monotonic timestamp in nanoseconds */
+  unsigned short *mask;           /* see xbee_sample */
+  unsigned short *digital;
+  unsigned short *analog[6];      /* any of these may be NULL if not wanted */
+};
+
+/* several XBees on the same network used as one, see xbee_gw_new() */
+typedef struct xbee_gw xbee_gw;
+#define XBEE_GW_LASTHEARD 0x01  /* send on the radio that hears the destination best */
+#define XBEE_GW_ACK       0x02  /* wait for the Tx status, and try another radio if it fails */
+
+/* the kinds of memory counted for a handle, see xbee_memstats() */
+enum xbee_memtypes {
+  xbee_mem_pkt,       /* packets queued for connections, subscriptions, callbacks and gateways */
+  xbee_mem_con,       /* connections */
+  xbee_mem_callback,  /* callback list nodes, and the callback threads' bookkeeping */
+  xbee_mem_tx,        /* frames being sent */
+  xbee_mem_types
+};
+
+/* the memory held by a handle, see xbee_memstats() */
+typedef struct xbee_meminfo xbee_meminfo;
+struct xbee_meminfo {
+  unsigned long bytes;            /* held in total */
+  unsigned long limit;            /* 0 if there isn't one, see xbee_memlimit() */
+  unsigned long objects[xbee_mem_types];
+  unsigned long typeBytes[xbee_mem_types];
+  unsigned long dropped;          /* frames dropped because of the limit, or because memory ran out */
+  unsigned long failed;           /* allocations that failed */
 };
 
+/* the reading end of a packet ring, see xbee_ring_attach() */
+typedef struct xbee_ring xbee_ring;
+
+/* give this as the baud rate to xbee_setup() to probe for the XBee's rate (it must already be in API mode) */
+#define XBEE_BAUD_AUTO 0
 int CALLTYPE xbee_setup(char *path, int baudrate);
 int CALLTYPE xbee_setuplog(char *path, int baudrate, int logfd);
 int CALLTYPE xbee_setupAPI(char *path, int baudrate, char cmdSeq, int cmdTime);
@@ -165,6 +287,26 @@ xbee_hnd CALLTYPE _xbee_setuplog(char *path, int baudrate, int logfd);
 xbee_hnd CALLTYPE _xbee_setupAPI(char *path, int baudrate, char cmdSeq, int cmdTime);
 xbee_hnd CALLTYPE _xbee_setuplogAPI(char *path, int baudrate, int logfd, char cmdSeq, int cmdTime);
 
+/* flags for xbee_setupflags() */
+#define XBEE_SETUP_RTSCTS 0x01  /* use RTS/CTS hardware flow control */
+#define XBEE_SETUP_AP1    0x02  /* use API mode 1 (nothing is escaped) instead of API mode 2 */
+#define XBEE_SETUP_PROBE  0x04  /* skip command mode if the XBee already answers API frames */
+int CALLTYPE xbee_setupflags(char *path, int baudrate, int logfd, char cmdSeq, int cmdTime, int flags);
+xbee_hnd CALLTYPE _xbee_setupflags(char *path, int baudrate, int logfd, char cmdSeq, int cmdTime, int flags);
+
+/* an XBee for _xbee_setupmany(), the arguments are the same as xbee_setupflags() */
+typedef struct xbee_setupinfo xbee_setupinfo;
+struct xbee_setupinfo {
+  char *path;
+  int baudrate;
+  int logfd;
+  char cmdSeq;
+  int cmdTime;
+  int flags;
+  xbee_hnd xbee;                  /* set by _xbee_setupmany(), NULL if this XBee couldn't be opened */
+};
+int CALLTYPE _xbee_setupmany(xbee_setupinfo *info, int count);
+
 int CALLTYPE xbee_end(void);
 int CALLTYPE _xbee_end(xbee_hnd xbee);
 
@@ -177,9 +319,18 @@ xbee_con * CALLTYPEVA xbee_newcon(unsigned char frameID, xbee_types type, ...);
 xbee_con * CALLTYPEVA _xbee_newcon(xbee_hnd xbee, unsigned char frameID, xbee_types type, ...);
 xbee_con * CALLTYPE _xbee_vnewcon(xbee_hnd xbee, unsigned char frameID, xbee_types type, va_list ap);
 
+xbee_con * CALLTYPEVA xbee_subscribe(xbee_types type, ...);
+xbee_con * CALLTYPEVA _xbee_subscribe(xbee_hnd xbee, xbee_types type, ...);
+xbee_con * CALLTYPE _xbee_vsubscribe(xbee_hnd xbee, xbee_types type, va_list ap);
+int CALLTYPE xbee_batchcallback(xbee_con *con, void (*callback)(xbee_con*,xbee_pkt**,int), int max, int linger);
+int CALLTYPE _xbee_batchcallback(xbee_hnd xbee, xbee_con *con, void (*callback)(xbee_con*,xbee_pkt**,int), int max, int linger);
+
 xbee_con * CALLTYPEVA xbee_getcon(unsigned char frameID, xbee_types type, ...);
 xbee_con * CALLTYPEVA _xbee_getcon(xbee_hnd xbee, unsigned char frameID, xbee_types type, ...);
 xbee_con * CALLTYPE _xbee_vgetcon(xbee_hnd xbee, unsigned char frameID, xbee_types type, va_list ap);
+/* for xbee2_explicit, tAddr must be XBEE_CONKEYLEN bytes long - the 64-bit address, then the
+   source and destination endpoints, and the cluster and profile IDs (big-endian) */
+#define XBEE_CONKEYLEN 14
 xbee_con * CALLTYPE _xbee_vvgetcon(xbee_hnd xbee, unsigned char *tAddr, unsigned char frameID, xbee_types type, va_list ap);
 xbee_con * CALLTYPE _xbee_xgetcon(xbee_hnd xbee, unsigned char frameID, xbee_types type, unsigned char *tAddr);
 
@@ -208,11 +359,82 @@ xbee_pkt * CALLTYPE _xbee_getpacket(xbee_hnd xbee, xbee_con *con);
 xbee_pkt * CALLTYPE xbee_getpacketwait(xbee_con *con);
 xbee_pkt * CALLTYPE _xbee_getpacketwait(xbee_hnd xbee, xbee_con *con);
 
+xbee_pkt * CALLTYPE xbee_pkt_alloc(int datalen, int samples);
+void CALLTYPE xbee_pkt_ref(xbee_pkt *pkt);
+void CALLTYPE xbee_pkt_unref(xbee_pkt *pkt);
+
 int CALLTYPE xbee_hasdigital(xbee_pkt *pkt, int sample, int input);
 int CALLTYPE xbee_getdigital(xbee_pkt *pkt, int sample, int input);
 
 int CALLTYPE xbee_hasanalog(xbee_pkt *pkt, int sample, int input);
 double CALLTYPE xbee_getanalog(xbee_pkt *pkt, int sample, int input, double Vref);
+int CALLTYPE xbee_getanalog_bulk(xbee_pkt *pkt, int input, double Vref, float *out, int *n);
+int CALLTYPE xbee_getanalog_bulkn(xbee_pkt **pkts, int npkts, int input, double Vref, float *out, int *n);
+
+int CALLTYPE xbee_iosink(int samples, int passthrough);
+int CALLTYPE _xbee_iosink(xbee_hnd xbee, int samples, int passthrough);
+int CALLTYPE xbee_iosink_nodes(xbee_ionode *nodes, int max);
+int CALLTYPE _xbee_iosink_nodes(xbee_hnd xbee, xbee_ionode *nodes, int max);
+int CALLTYPE xbee_iosink_read(xbee_ionode *node, xbee_iobuf *buf, int consume);
+int CALLTYPE _xbee_iosink_read(xbee_hnd xbee, xbee_ionode *node, xbee_iobuf *buf, int consume);
+
+int CALLTYPE xbee_nodelist(xbee_node *nodes, int max);
+int CALLTYPE _xbee_nodelist(xbee_hnd xbee, xbee_node *nodes, int max);
+int CALLTYPE xbee_getnode64(unsigned char *addr64, xbee_node *node);
+int CALLTYPE _xbee_getnode64(xbee_hnd xbee, unsigned char *addr64, xbee_node *node);
+int CALLTYPE xbee_getnode16(unsigned char *addr16, xbee_node *node);
+int CALLTYPE _xbee_getnode16(xbee_hnd xbee, unsigned char *addr16, xbee_node *node);
+int CALLTYPE xbee_getnodeNI(const char *NI, xbee_node *node);
+int CALLTYPE _xbee_getnodeNI(xbee_hnd xbee, const char *NI, xbee_node *node);
+
+int CALLTYPE xbee_discover(int minInterval, int maxInterval, void (*callback)(xbee_node *node, int event));
+int CALLTYPE _xbee_discover(xbee_hnd xbee, int minInterval, int maxInterval, void (*callback)(xbee_node *node, int event));
+
+int CALLTYPE xbee_atcache_get(xbee_con *con, char *cmd, int ttl, unsigned char *value, int maxlen);
+int CALLTYPE _xbee_atcache_get(xbee_hnd xbee, xbee_con *con, char *cmd, int ttl, unsigned char *value, int maxlen);
+void CALLTYPE xbee_atcache_flush(xbee_con *con);
+void CALLTYPE _xbee_atcache_flush(xbee_hnd xbee, xbee_con *con);
+
+int CALLTYPE xbee_at_batch(xbee_con *con, xbee_atcmd *cmds, int n, int write);
+int CALLTYPE _xbee_at_batch(xbee_hnd xbee, xbee_con *con, xbee_atcmd *cmds, int n, int write);
+
+int CALLTYPE xbee_setfilter(xbee_filter *rules, int count, int defaultAction);
+int CALLTYPE _xbee_setfilter(xbee_hnd xbee, xbee_filter *rules, int count, int defaultAction);
+unsigned long CALLTYPE xbee_filter_rejected(void);
+unsigned long CALLTYPE _xbee_filter_rejected(xbee_hnd xbee);
+
+int CALLTYPE xbee_dedup(int window, int entries);
+int CALLTYPE _xbee_dedup(xbee_hnd xbee, int window, int entries);
+unsigned long CALLTYPE xbee_dedup_suppressed(void);
+unsigned long CALLTYPE _xbee_dedup_suppressed(xbee_hnd xbee);
+
+xbee_gw * CALLTYPE xbee_gw_new(xbee_hnd *radios, int count, int policy,
+                               void (*callback)(xbee_gw *gw, int radio, xbee_pkt *pkt));
+void CALLTYPE xbee_gw_free(xbee_gw *gw);
+xbee_pkt * CALLTYPE xbee_gw_getpacket(xbee_gw *gw, int *radio);
+int CALLTYPE xbee_gw_nsenddata(xbee_gw *gw, xbee_types type, unsigned int addrH, unsigned int addrL,
+                               char *data, int length);
+int CALLTYPE xbee_gw_radiostate(xbee_gw *gw, int radio);
+
+int CALLTYPE xbee_serve(char *addr);
+int CALLTYPE _xbee_serve(xbee_hnd xbee, char *addr);
+void CALLTYPE xbee_serve_stop(void);
+void CALLTYPE _xbee_serve_stop(xbee_hnd xbee);
+
+int CALLTYPE xbee_memlimit(unsigned long bytes);
+int CALLTYPE _xbee_memlimit(xbee_hnd xbee, unsigned long bytes);
+int CALLTYPE xbee_memstats(xbee_meminfo *stats);
+int CALLTYPE _xbee_memstats(xbee_hnd xbee, xbee_meminfo *stats);
+
+int CALLTYPE xbee_ring_publish(const char *name, int slots);
+int CALLTYPE _xbee_ring_publish(xbee_hnd xbee, const char *name, int slots);
+void CALLTYPE xbee_ring_stop(void);
+void CALLTYPE _xbee_ring_stop(xbee_hnd xbee);
+xbee_ring * CALLTYPE xbee_ring_attach(const char *name);
+xbee_pkt * CALLTYPE xbee_ring_read(xbee_ring *ring, unsigned long long *seq);
+int CALLTYPE xbee_ring_pending(xbee_ring *ring);
+unsigned long CALLTYPE xbee_ring_lost(xbee_ring *ring);
+void CALLTYPE xbee_ring_detach(xbee_ring *ring);
 
 const char * CALLTYPE xbee_svn_version(void);
 const char * CALLTYPE xbee_build_info(void);
@@ -29,8 +29,35 @@
 
 #include "linux.h"
 
-int init_serial(xbee_hnd xbee, int baudrate) {
-  struct flock fl;
+#if defined(__linux__) && (defined(__i386__) || defined(__x86_64__) || defined(__arm__) || defined(__aarch64__))
+/* glibc's <termios.h> can't be mixed with <asm/termbits.h>, so the kernel's
+   termios2 is declared here. it allows any baud rate to be given (BOTHER) */
+#define XBEE_TERMIOS2
+struct xbee_termios2 {
+  tcflag_t c_iflag;
+  tcflag_t c_oflag;
+  tcflag_t c_cflag;
+  tcflag_t c_lflag;
+  cc_t c_line;
+  cc_t c_cc[19];
+  speed_t c_ispeed;
+  speed_t c_ospeed;
+};
+#define XBEE_TCGETS2 _IOR('T',0x2A,struct xbee_termios2)
+#define XBEE_TCSETS2 _IOW('T',0x2B,struct xbee_termios2)
+#ifndef BOTHER
+#define BOTHER 0010000
+#endif
+#ifndef IBSHIFT
+#define IBSHIFT 16
+#endif
+#endif
+
+/* #################################################################
+   xbee_serial_speed - INTERNAL
+   sets the baud rate of the open serial port, rates without a Bxxx constant
+   are given to the kernel as-is where termios2 is avaliable */
+static int xbee_serial_speed(xbee_hnd xbee, int baudrate) {
   struct termios tc;
   speed_t chosenbaud;
 
@@ -44,11 +71,61 @@ int init_serial(xbee_hnd xbee, int baudrate) {
   case 38400: chosenbaud = B38400;  break;
   case 57600: chosenbaud = B57600;  break;
   case 115200:chosenbaud = B115200; break;
+#ifdef B230400
+  case 230400:chosenbaud = B230400; break;
+#endif
+#ifdef B460800
+  case 460800:chosenbaud = B460800; break;
+#endif
+#ifdef B921600
+  case 921600:chosenbaud = B921600; break;
+#endif
   default:
+#ifdef XBEE_TERMIOS2
+    if (baudrate > 0) {
+      struct xbee_termios2 tc2;
+      if (ioctl(xbee->ttyfd, XBEE_TCGETS2, &tc2) == -1) return -1;
+      tc2.c_cflag &= ~CBAUD;
+      tc2.c_cflag |= BOTHER;
+      tc2.c_cflag &= ~(CBAUD << IBSHIFT);
+      tc2.c_cflag |= BOTHER << IBSHIFT;
+      tc2.c_ispeed = baudrate;
+      tc2.c_ospeed = baudrate;
+      if (ioctl(xbee->ttyfd, XBEE_TCSETS2, &tc2) == -1) return -1;
+      return 0;
+    }
+#endif
     fprintf(stderr,"%s(): Unknown or incompatiable baud rate specified... (%d)\n",__FUNCTION__,baudrate);
     return -1;
   };
 
+  /* i/o rates */
+  if (tcgetattr(xbee->ttyfd, &tc) == -1) return -1;
+  cfsetspeed(&tc, chosenbaud);     /* set i/o baud rate */
+  if (tcsetattr(xbee->ttyfd, TCSANOW, &tc) == -1) return -1;
+
+  return 0;
+}
+
+int init_serial(xbee_hnd xbee, int baudrate) {
+  struct flock fl;
+  struct termios tc;
+
+  /* a client of a frame server (see xbee_serve()) shares its XBee, there is no serial port */
+  if ((xbee->ttyfd = xbee_socket(xbee, xbee->path, 0)) != -2) {
+    if (xbee->ttyfd == -1 || (xbee->tty = fdopen(xbee->ttyfd,"r+")) == NULL) {
+      if (xbee->ttyfd != -1) close(xbee->ttyfd);
+      xbee_mutex_destroy(xbee->conmutex);
+      xbee_mutex_destroy(xbee->pktmutex);
+      xbee_mutex_destroy(xbee->sendmutex);
+      Xfree(xbee->path);
+      return -1;
+    }
+    setvbuf(xbee->tty,NULL,_IONBF,BUFSIZ);
+    xbee->client = 1;
+    return 0;
+  }
+
   /* open the serial port as a file descriptor */
   if ((xbee->ttyfd = open(xbee->path,O_RDWR | O_NOCTTY | O_NONBLOCK)) == -1) {
     xbee_perror("xbee_setup():open()");
@@ -113,6 +190,11 @@ int init_serial(xbee_hnd xbee, int baudrate) {
   tc.c_cflag &= ~ CSIZE;            /* remove size flag... */
   tc.c_cflag |=   CS8;              /* ...enable 8 bit characters */
   tc.c_cflag |=   HUPCL;            /* enable lower control lines on close - hang up */
+  if (xbee->flags & XBEE_SETUP_RTSCTS) {
+    tc.c_cflag |=   CRTSCTS;        /* enable RTS/CTS flow control */
+  } else {
+    tc.c_cflag &= ~ CRTSCTS;        /* disable RTS/CTS flow control */
+  }
   /* local flags */
   tc.c_lflag &= ~ ISIG;             /* disable generating signals */
   tc.c_lflag &= ~ ICANON;           /* disable canonical mode - line by line */
@@ -122,14 +204,87 @@ int init_serial(xbee_hnd xbee, int baudrate) {
   tc.c_lflag &= ~ IEXTEN;           /* disable input processing */
   /* control characters */
   memset(tc.c_cc,0,sizeof(tc.c_cc));
-  /* i/o rates */
-  cfsetspeed(&tc, chosenbaud);     /* set i/o baud rate */
   tcsetattr(xbee->ttyfd, TCSANOW, &tc);
+
+  /* i/o rates - XBEE_BAUD_AUTO starts at the XBee's default, xbee_autobaud() will find the real rate */
+  if (xbee_serial_speed(xbee, (baudrate == XBEE_BAUD_AUTO)?9600:baudrate)) {
+    xbee_mutex_destroy(xbee->conmutex);
+    xbee_mutex_destroy(xbee->pktmutex);
+    xbee_mutex_destroy(xbee->sendmutex);
+    Xfree(xbee->path);
+    fclose(xbee->tty);
+    return -1;
+  }
   tcflow(xbee->ttyfd, TCOON|TCION); /* enable input & output transmission */
 
   return 0;
 }
 
+/* #################################################################
+   xbee_socket - INTERNAL
+   opens the socket for a frame server address - "unix:<path>" or "tcp:<port>"
+   (on localhost only). with server set it is bound and listened on (a unix socket
+   can only be used by its owner, mode 0600), otherwise it is connected to.
+   returns the non-blocking socket, -1 on error or -2 if the address isn't a frame
+   server's (it is a serial port) */
+static int xbee_socket(xbee_hnd xbee, const char *addr, int server) {
+  struct sockaddr_un sun;
+  struct sockaddr_in sin;
+  struct sockaddr *sa;
+  socklen_t salen;
+  int fd, port, on = 1;
+
+  if (!strncmp(addr, "unix:", 5)) {
+    if (strlen(&addr[5]) >= sizeof(sun.sun_path)) return -1;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, &addr[5]);
+    sa = (struct sockaddr *)&sun;
+    salen = sizeof(sun);
+  } else if (!strncmp(addr, "tcp:", 4)) {
+    if ((port = atoi(&addr[4])) <= 0 || port > 0xFFFF) return -1;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sa = (struct sockaddr *)&sin;
+    salen = sizeof(sin);
+  } else {
+    return -2;
+  }
+
+  if ((fd = socket(sa->sa_family, SOCK_STREAM, 0)) == -1) {
+    xbee_perror("xbee_socket():socket()");
+    return -1;
+  }
+  if (server) {
+    if (sa->sa_family == AF_UNIX) {
+      unlink(sun.sun_path); /* left behind by a server that didn't stop cleanly */
+    } else {
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    }
+    /* the socket file is only for its owner - nothing can connect until listen() */
+    if (bind(fd, sa, salen) == -1 ||
+        (sa->sa_family == AF_UNIX && chmod(sun.sun_path, 0600) == -1) ||
+        listen(fd, 8) == -1) {
+      xbee_perror("xbee_socket():bind()");
+      close(fd);
+      return -1;
+    }
+  } else {
+    if (connect(fd, sa, salen) == -1) {
+      xbee_perror("xbee_socket():connect()");
+      close(fd);
+      return -1;
+    }
+    if (sa->sa_family == AF_INET) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  return fd;
+}
+
 static int xbee_select(xbee_hnd xbee, struct timeval *timeout) {
   fd_set fds;
 
@@ -139,6 +294,58 @@ static int xbee_select(xbee_hnd xbee, struct timeval *timeout) {
   return select(xbee->ttyfd+1, &fds, NULL, NULL, timeout);
 }
 
+/* #################################################################
+   xbee_write_all - INTERNAL
+   writes all of the data, waiting for room when the port is busy. with RTS/CTS
+   enabled, nothing is written while the XBee holds CTS deasserted and the
+   driver's output queue is kept short. returns the number of bytes written */
+static int xbee_write_all(xbee_hnd xbee, const unsigned char *data, int len) {
+  unsigned long long deadline;
+  struct timeval to;
+  fd_set fds;
+  int done = 0, n, ret, status, outq;
+
+  deadline = xbee_clock_ns() + (XBEE_TX_TIMEOUT * 1000000ULL);
+  while (done < len) {
+    n = len - done;
+    if (xbee->flags & XBEE_SETUP_RTSCTS) {
+      /* ports that can't report CTS (e.g. a pty) are treated as always clear */
+      if (ioctl(xbee->ttyfd, TIOCMGET, &status) == 0 && !(status & TIOCM_CTS)) {
+        if (xbee_clock_ns() > deadline) break;
+        usleep(100);
+        continue;
+      }
+      if (ioctl(xbee->ttyfd, TIOCOUTQ, &outq) == 0) {
+        if (outq >= XBEE_TX_OUTQ) n = 0;
+        else if (n > XBEE_TX_OUTQ - outq) n = XBEE_TX_OUTQ - outq;
+      }
+    }
+
+    if (n > 0) {
+      if ((ret = write(xbee->ttyfd, &data[done], n)) > 0) {
+        done += ret;
+        deadline = xbee_clock_ns() + (XBEE_TX_TIMEOUT * 1000000ULL);
+        continue;
+      }
+      if (ret == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) break;
+    }
+    if (xbee_clock_ns() > deadline) break;
+
+    /* wait for the driver to make some room */
+    if (n > 0) {
+      FD_ZERO(&fds);
+      FD_SET(xbee->ttyfd, &fds);
+      to.tv_sec = 0;
+      to.tv_usec = 10000;
+      select(xbee->ttyfd+1, NULL, &fds, NULL, &to);
+    } else {
+      usleep(100);
+    }
+  }
+
+  return done;
+}
+
 #define xbee_sem_wait1sec(a) xbee_sem_wait1sec2(&(a))
 static inline int xbee_sem_wait1sec2(xbee_sem_t *sem) {
   struct timespec to;
@@ -146,3 +353,35 @@ static inline int xbee_sem_wait1sec2(xbee_sem_t *sem) {
   to.tv_sec++;
   return sem_timedwait(sem,&to);
 }
+
+#define xbee_sem_waitms(a,b) xbee_sem_waitms2(&(a),(b))
+static inline int xbee_sem_waitms2(xbee_sem_t *sem, int ms) {
+  struct timespec to;
+  clock_gettime(CLOCK_REALTIME,&to);
+  to.tv_sec += ms / 1000;
+  to.tv_nsec += (ms % 1000) * 1000000L;
+  if (to.tv_nsec >= 1000000000L) {
+    to.tv_sec++;
+    to.tv_nsec -= 1000000000L;
+  }
+  return sem_timedwait(sem,&to);
+}
+
+static inline int xbee_cond_timedwait2(xbee_cond_t *cond, xbee_mutex_t *mutex, int ms) {
+  struct timespec to;
+  clock_gettime(CLOCK_REALTIME,&to);
+  to.tv_sec += ms / 1000;
+  to.tv_nsec += (ms % 1000) * 1000000L;
+  if (to.tv_nsec >= 1000000000L) {
+    to.tv_sec++;
+    to.tv_nsec -= 1000000000L;
+  }
+  return pthread_cond_timedwait(cond,mutex,&to);
+}
+
+/* returns a monotonic time in nanoseconds */
+static unsigned long long xbee_clock_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ((unsigned long long)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
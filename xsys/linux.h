@@ -31,6 +31,7 @@
 #define xbee_thread_cancel(a,b)   pthread_cancel((a))
 #define xbee_thread_join(a)       pthread_join((a),NULL)
 #define xbee_thread_tryjoin(a)    pthread_tryjoin_np((a),NULL)
+#define xbee_thread_detach(a)     pthread_detach((a))
 
 #define xbee_mutex_init(a)        pthread_mutex_init(&(a),NULL)
 #define xbee_mutex_destroy(a)     pthread_mutex_destroy(&(a))
@@ -48,6 +49,12 @@
 #define xbee_cond_wait(a,b)       pthread_cond_wait(&(a),&(b))
 #define xbee_cond_signal(a)       pthread_cond_signal(&(a))
 #define xbee_cond_broadcast(a)    pthread_cond_broadcast(&(a))
+#define xbee_cond_timedwait(a,b,c) xbee_cond_timedwait2(&(a),&(b),(c))
+
+#define xbee_atomic_inc(a)        __sync_add_and_fetch(&(a),1)
+#define xbee_atomic_dec(a)        __sync_sub_and_fetch(&(a),1)
+#define xbee_atomic_add(a,b)      __sync_add_and_fetch(&(a),(b))
+#define xbee_barrier()            __sync_synchronize()
 
 #define xbee_write(xbee,a,b)      fwrite((a),1,(b),(xbee)->tty)
 #define xbee_read(xbee,a,b)       fread((a),1,(b),(xbee)->tty)
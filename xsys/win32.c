@@ -30,12 +30,35 @@
 #include "win32.h"
 #include "win32.dll.c"
 
+/* #################################################################
+   xbee_serial_speed - INTERNAL
+   sets the baud rate of the open serial port, Win32 accepts any rate the driver does */
+static int xbee_serial_speed(xbee_hnd xbee, int baudrate) {
+  DCB tc;
+
+  if (baudrate <= 0) return -1;
+  if (!GetCommState(xbee->tty, &tc)) return -1;
+  tc.BaudRate = baudrate;
+  if (!SetCommState(xbee->tty, &tc)) return -1;
+
+  return 0;
+}
+
 static int init_serial(xbee_hnd xbee, int baudrate) {
   int chosenbaud;
   DCB tc;
   int evtMask;
   COMMTIMEOUTS timeouts;
 
+  /* a frame server's address can't be used here */
+  if (xbee_socket(xbee, xbee->path, 0) != -2) {
+    xbee_mutex_destroy(xbee->conmutex);
+    xbee_mutex_destroy(xbee->pktmutex);
+    xbee_mutex_destroy(xbee->sendmutex);
+    Xfree(xbee->path);
+    return -1;
+  }
+
   /* open the serial port */
   xbee->tty = CreateFile(TEXT(xbee->path),
                         GENERIC_READ | GENERIC_WRITE,
@@ -55,10 +78,10 @@ static int init_serial(xbee_hnd xbee, int baudrate) {
   }
 
   GetCommState(xbee->tty, &tc);
-  tc.BaudRate          = baudrate;
+  tc.BaudRate          = (baudrate == XBEE_BAUD_AUTO)?9600:baudrate;
   tc.fBinary           = TRUE;
   tc.fParity           = FALSE;
-  tc.fOutxCtsFlow      = FALSE;
+  tc.fOutxCtsFlow      = (xbee->flags & XBEE_SETUP_RTSCTS)?TRUE:FALSE;
   tc.fOutxDsrFlow      = FALSE;
   tc.fDtrControl       = DTR_CONTROL_DISABLE;
   tc.fDsrSensitivity   = FALSE;
@@ -67,7 +90,7 @@ static int init_serial(xbee_hnd xbee, int baudrate) {
   tc.fInX              = FALSE;
   tc.fErrorChar        = FALSE;
   tc.fNull             = FALSE;
-  tc.fRtsControl       = RTS_CONTROL_DISABLE;
+  tc.fRtsControl       = (xbee->flags & XBEE_SETUP_RTSCTS)?RTS_CONTROL_HANDSHAKE:RTS_CONTROL_DISABLE;
   tc.fAbortOnError     = FALSE;
   tc.ByteSize          = 8;
   tc.Parity            = NOPARITY;
@@ -135,6 +158,16 @@ static int xbee_select(xbee_hnd xbee, struct timeval *timeout) {
   return -1;
 }
 
+/* #################################################################
+   xbee_socket - INTERNAL
+   frame servers aren't supported on Win32. returns -1 for a frame server's
+   address, or -2 if it isn't one (it is a serial port) */
+static int xbee_socket(xbee_hnd xbee, const char *addr, int server) {
+  if (strncmp(addr, "unix:", 5) && strncmp(addr, "tcp:", 4)) return -2;
+  xbee_log("Frame servers aren't supported on Win32");
+  return -1;
+}
+
 /* this offers the same behavior as non-blocking I/O under linux */
 int xbee_write(xbee_hnd xbee, const void *ptr, size_t size) {
   xbee->ttyeof = FALSE;
@@ -147,6 +180,21 @@ int xbee_write(xbee_hnd xbee, const void *ptr, size_t size) {
   return xbee->ttyw;
 }
 
+/* #################################################################
+   xbee_write_all - INTERNAL
+   writes all of the data. the driver holds writes while CTS is deasserted
+   (if RTS/CTS is enabled), so this only needs to keep going after a short write */
+static int xbee_write_all(xbee_hnd xbee, const unsigned char *data, int len) {
+  int done = 0, ret;
+
+  while (done < len) {
+    if ((ret = xbee_write(xbee, &data[done], len - done)) <= 0) break;
+    done += ret;
+  }
+
+  return done;
+}
+
 /* this offers the same behavior as non-blocking I/O under linux */
 int xbee_read(xbee_hnd xbee, void *ptr, size_t size) {
   xbee->ttyeof = FALSE;
@@ -178,6 +226,16 @@ int gettimeofday(struct timeval *tv, struct timezone *tz) {
   return 0;
 }
 
+/* returns a monotonic time in nanoseconds */
+static unsigned long long xbee_clock_ns(void) {
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER now;
+  if (!freq.QuadPart) QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
+  return ((unsigned long long)(now.QuadPart / freq.QuadPart) * 1000000000ULL) +
+         (((unsigned long long)(now.QuadPart % freq.QuadPart) * 1000000000ULL) / freq.QuadPart);
+}
+
 /* ################################################################# */
 /* ### Helper Functions (Mainly for VB6 use) ####################### */
 /* ################################################################# */
@@ -46,6 +46,7 @@ HMODULE glob_hModule = NULL;
 #define xbee_thread_cancel(a,b)   TerminateThread((a),(b))
 #define xbee_thread_join(a)       WaitForSingleObject((a),INFINITE)
 #define xbee_thread_tryjoin(a)    WaitForSingleObject((a),0)
+#define xbee_thread_detach(a)     CloseHandle((a))
 
 #define xbee_mutex_init(a)        (((a) = CreateEvent(NULL,FALSE,TRUE,NULL)) == NULL)
 #define xbee_mutex_destroy(a)     CloseHandle((a))
@@ -57,6 +58,7 @@ HMODULE glob_hModule = NULL;
 #define xbee_sem_destroy(a)       CloseHandle((a))
 #define xbee_sem_wait(a)          WaitForSingleObject((a),INFINITE)
 #define xbee_sem_wait1sec(a)      WaitForSingleObject((a),1000)
+#define xbee_sem_waitms(a,b)      WaitForSingleObject((a),(b))
 #define xbee_sem_post(a)          SetEvent((a))
 
 #define xbee_cond_init(a)         InitializeConditionVariable(&(a))
@@ -64,6 +66,12 @@ HMODULE glob_hModule = NULL;
 #define xbee_cond_wait(a,b)       SleepConditionVariableCS(&(a),&(b),INFINITE)
 #define xbee_cond_signal(a)       WakeConditionVariable(&(a))
 #define xbee_cond_broadcast(a)    WakeAllConditionVariable(&(a))
+#define xbee_cond_timedwait(a,b,c) SleepConditionVariableCS(&(a),&(b),(c))
+
+#define xbee_atomic_inc(a)        InterlockedIncrement(&(a))
+#define xbee_atomic_dec(a)        InterlockedDecrement(&(a))
+#define xbee_atomic_add(a,b)      InterlockedExchangeAdd(&(a),(b))
+#define xbee_barrier()            MemoryBarrier()
 
 #define xbee_feof(a)              (xbee->ttyeof)
 #define xbee_ferror(a)            (0)